@@ -0,0 +1,674 @@
+//  build.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Building and changing documents. New nodes come from the document's
+//  pools, which take back those of values no longer in it: each node
+//  counts the places it's in, and a value replaced from its last one
+//  is freed along with all only it held. Strings' and numbers' text is
+//  freed with them too, short text living in cells of a pool of the
+//  document's and longer in an allocation of its own. Keys are kept in
+//  chunks instead, once per document, so those freed members had are
+//  reused rather than piling up. Setting a member has to look for its
+//  key and otherwise append after the last member: short objects are
+//  simply scanned, while longer ones have their members, and their
+//  last, entered in hash tables of the document's the first time
+//  they're set, keeping sets O(1) however many members there are.
+
+#include "json.h"
+#include "json_node.h"
+#include "pool.h"
+#include "parse.h"
+#include "index.h"
+#include "build.h"
+#include "dtoa.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEXT_CHUNK 4096
+#define SCANNED_MEMBERS 8 // objects with fewer members aren't hashed
+#define MIN_SLOTS 64
+#define NEW_ARRAY 4
+#define CELL 32 // text shorter than this goes in a pool's cell
+
+typedef struct TEXT TEXT;
+typedef struct LONG_TEXT LONG_TEXT;
+typedef struct SLOT SLOT;
+typedef struct TABLE TABLE;
+typedef struct KEYS KEYS;
+
+struct TEXT
+    {
+    TEXT *next;
+    size_t used;
+    size_t size;
+    char bytes[];
+    };
+
+struct LONG_TEXT
+    {
+    LONG_TEXT *newer;
+    LONG_TEXT *older;
+    char bytes[];
+    };
+
+struct SLOT
+    {
+    JSON_DATA *object; // NULL if the slot is empty
+    MAP_NODE *member;
+    uint64_t hash;
+    };
+
+struct TABLE
+    // Open addressing, linear probing
+    {
+    SLOT *slots;
+    size_t mask; // slots - 1, a power of 2 less 1
+    size_t used;
+    };
+
+struct KEYS
+    // Open addressing, linear probing
+    {
+    char **slots; // NULL if the slot is empty
+    size_t mask;
+    size_t used;
+    };
+
+struct BUILT
+    {
+    TEXT *text; // the chunk of keys being filled first
+    KEYS keys; // every one in the chunks
+    Pool *cells; // short text, NULL until needed
+    LONG_TEXT *long_text; // the last allocated
+    TABLE members; // by object and key
+    TABLE lasts; // each hashed object's last member, by object
+    };
+
+static char true_text[] = "true";
+static char false_text[] = "false";
+static char null_text[] = "null";
+
+static BUILT *built(JSON *json)
+    {
+    if (!json->built)
+        json->built = (BUILT *)calloc(1, sizeof(BUILT));
+    return json->built;
+    }
+
+static char *copy_text(BUILT *b, const char *text, size_t length)
+    // NUL terminated, as parsed text is
+    {
+    TEXT *chunk = b->text;
+    if (!chunk || chunk->size - chunk->used <= length)
+        {
+        size_t size = length < TEXT_CHUNK ? TEXT_CHUNK : length + 1;
+        chunk = (TEXT *)malloc(sizeof(TEXT) + size);
+        if (!chunk)
+            return NULL;
+        chunk->used = 0;
+        chunk->size = size;
+        if (size > TEXT_CHUNK && b->text)
+            {
+            // Too big to share, so the current chunk stays current
+            chunk->next = b->text->next;
+            b->text->next = chunk;
+            }
+        else
+            {
+            chunk->next = b->text;
+            b->text = chunk;
+            }
+        }
+    char *copy = chunk->bytes + chunk->used;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    chunk->used += length + 1;
+    return copy;
+    }
+
+static uint64_t object_hash(const JSON_DATA *object)
+    {
+    uint64_t h = (uintptr_t)object * 0x9E3779B97F4A7C15ull;
+    return h ^ h >> 29;
+    }
+
+static uint64_t fnv(uint64_t h, const char *text, size_t length)
+    // FNV-1a over the text, starting from h
+    {
+    for (size_t i = 0; i < length; ++i)
+        h = (h ^ (unsigned char)text[i]) * 0x100000001B3ull;
+    return h ^ h >> 32;
+    }
+
+static uint64_t member_hash(const JSON_DATA *object, const char *key,
+                            size_t length)
+    {
+    return fnv(object_hash(object), key, length);
+    }
+
+static char **find_key(KEYS *keys, const char *key, size_t length)
+    // The slot holding the key, or the empty one where it would go
+    {
+    size_t i = fnv(0xCBF29CE484222325ull, key, length) & keys->mask;
+    for (;; i = (i + 1) & keys->mask)
+        {
+        char *slot = keys->slots[i];
+        if (!slot || (!strncmp(slot, key, length) && !slot[length]))
+            return &keys->slots[i];
+        }
+    }
+
+static char *intern(JSON *json, const char *key, size_t length)
+    // The document's copy of the key, made the first time it's needed
+    {
+    BUILT *b = built(json);
+    if (!b)
+        return NULL;
+    KEYS *keys = &b->keys;
+    size_t slots = keys->slots ? keys->mask + 1 : 0;
+    if ((keys->used + 1) * 4 > slots * 3)
+        {
+        size_t size = slots ? slots * 2 : MIN_SLOTS;
+        KEYS bigger = { (char **)calloc(size, sizeof(char *)), size - 1,
+                        keys->used };
+        if (!bigger.slots)
+            return NULL;
+        for (size_t i = 0; i < slots; ++i)
+            if (keys->slots[i])
+                *find_key(&bigger, keys->slots[i],
+                          strlen(keys->slots[i])) = keys->slots[i];
+        free(keys->slots);
+        *keys = bigger;
+        }
+    char **slot = find_key(keys, key, length);
+    if (!*slot)
+        {
+        if (!(*slot = copy_text(b, key, length)))
+            return NULL;
+        ++keys->used;
+        }
+    return *slot;
+    }
+
+static char *new_string(JSON *json, const char *text, size_t length)
+    // Text to free with the value holding it
+    {
+    BUILT *b = built(json);
+    if (!b)
+        return NULL;
+    char *copy;
+    if (length < CELL)
+        {
+        if (!b->cells && !(b->cells = PoolCreate(CELL)))
+            return NULL;
+        if (!(copy = (char *)PoolAlloc(b->cells)))
+            return NULL;
+        }
+    else
+        {
+        LONG_TEXT *t = (LONG_TEXT *)malloc(sizeof(LONG_TEXT) + length + 1);
+        if (!t)
+            return NULL;
+        t->newer = NULL;
+        t->older = b->long_text;
+        if (t->older)
+            t->older->newer = t;
+        b->long_text = t;
+        copy = t->bytes;
+        }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+    }
+
+static void free_string(BUILT *b, JSON_DATA *data)
+    {
+    if (data->length < CELL)
+        {
+        PoolFree(b->cells, data->data.string);
+        return;
+        }
+    LONG_TEXT *t = (LONG_TEXT *)(data->data.string -
+                                 offsetof(LONG_TEXT, bytes));
+    if (t->newer)
+        t->newer->older = t->older;
+    else
+        b->long_text = t->older;
+    if (t->older)
+        t->older->newer = t->newer;
+    free(t);
+    }
+
+static SLOT *probe(TABLE *table, uint64_t hash, const JSON_DATA *object,
+                   const char *key, size_t length)
+    // The slot holding the object's member with the key (or, with a
+    // NULL key, the object) or else the empty one where it would go.
+    // The table must have room.
+    {
+    for (size_t i = hash & table->mask;; i = (i + 1) & table->mask)
+        {
+        SLOT *slot = &table->slots[i];
+        if (!slot->object)
+            return slot;
+        if (slot->hash == hash && slot->object == object &&
+            (!key || (slot->member->key_length == length &&
+                      !memcmp(slot->member->key, key, length))))
+            return slot;
+        }
+    }
+
+static bool make_room(TABLE *table, size_t more)
+    // Grows the table, if need be, to take more entries under 3/4 full
+    {
+    size_t slots = table->slots ? table->mask + 1 : 0;
+    size_t needed = table->used + more;
+    if (needed * 4 <= slots * 3)
+        return true;
+    size_t size = slots ? slots * 2 : MIN_SLOTS;
+    while (size * 3 < needed * 4)
+        size *= 2;
+    SLOT *bigger = (SLOT *)calloc(size, sizeof(SLOT));
+    if (!bigger)
+        return false;
+    for (size_t i = 0; i < slots; ++i)
+        if (table->slots[i].object)
+            {
+            size_t j = table->slots[i].hash & (size - 1);
+            while (bigger[j].object)
+                j = (j + 1) & (size - 1);
+            bigger[j] = table->slots[i];
+            }
+    free(table->slots);
+    table->slots = bigger;
+    table->mask = size - 1;
+    return true;
+    }
+
+static void enter(TABLE *table, SLOT *slot, uint64_t hash,
+                  JSON_DATA *object, MAP_NODE *member)
+    {
+    slot->object = object;
+    slot->member = member;
+    slot->hash = hash;
+    ++table->used;
+    }
+
+static void vacate(TABLE *table, SLOT *slot)
+    // Empties the slot, moving back entries that probed past it
+    {
+    size_t i = slot - table->slots;
+    for (size_t j = (i + 1) & table->mask; table->slots[j].object;
+         j = (j + 1) & table->mask)
+        {
+        size_t home = table->slots[j].hash & table->mask;
+        // Entries whose probe starts after i (cyclically) stay put
+        if (i < j ? i < home && home <= j : i < home || home <= j)
+            continue;
+        table->slots[i] = table->slots[j];
+        i = j;
+        }
+    table->slots[i].object = NULL;
+    --table->used;
+    }
+
+static void hash_members(BUILT *b, JSON_DATA *object, SLOT *last)
+    // Enters all the object's members, which has room made for them,
+    // and its last one at the slot for that
+    {
+    MAP_NODE *member = object->data.map;
+    MAP_NODE *tail = NULL;
+    for (; member; member = member->next)
+        {
+        uint64_t hash = member_hash(object, member->key, member->key_length);
+        enter(&b->members, probe(&b->members, hash, object, member->key,
+                                 member->key_length),
+              hash, object, member);
+        tail = member;
+        }
+    enter(&b->lasts, last, object_hash(object), object, tail);
+    }
+
+static void unhash_members(BUILT *b, JSON_DATA *object)
+    // Takes the object's entries out of the tables, if it has any,
+    // before its node is reused for another
+    {
+    if (!b || !b->lasts.slots)
+        return;
+    SLOT *last = probe(&b->lasts, object_hash(object), object, NULL, 0);
+    if (!last->object)
+        return;
+    vacate(&b->lasts, last);
+    for (MAP_NODE *member = object->data.map; member; member = member->next)
+        vacate(&b->members,
+               probe(&b->members,
+                     member_hash(object, member->key, member->key_length),
+                     object, member->key, member->key_length));
+    }
+
+static bool fixed(const JSON *json)
+    // Clones have no pools to grow, and views share their layers' nodes
+    {
+    return json->arena || json->view;
+    }
+
+static bool placeable(const JSON_DATA *value)
+    // Whether the value can go in one more place
+    {
+    return value && value->refs < MAX_REFS;
+    }
+
+static void changed(JSON *json, JSON_DATA *container)
+    // Outdates the document's containers' cached hashes, and the indexes
+    // that read the container (or the document's root, if NULL)
+    {
+    ++json->changes;
+    if (container)
+        index_changed(json, container);
+    }
+
+static void release(JSON *json, JSON_DATA *data)
+    // Takes the value out of one of its places, freeing it (and all only
+    // it held) if that was the last
+    {
+    if (--data->refs)
+        return;
+    if (data->type == JSON_TYPE_MAP || data->type == JSON_TYPE_ARRAY)
+        index_forget(json, data);
+    switch (data->type)
+        {
+    case JSON_TYPE_MAP:
+        {
+        unhash_members(json->built, data);
+        MAP_NODE *member = data->data.map;
+        while (member)
+            {
+            MAP_NODE *next = member->next;
+            release(json, member->data);
+            PoolFree(json->map_pool, member);
+            member = next;
+            }
+        break;
+        }
+    case JSON_TYPE_ARRAY:
+        {
+        ARRAY *a = data->data.array;
+        for (size_t i = 0; i < a->next; ++i)
+            release(json, a->array[i]);
+        free(a->array);
+        index_destroy(a->indexes);
+        if (a->newer)
+            a->newer->older = a->older;
+        else
+            json->arrays = a->older;
+        if (a->older)
+            a->older->newer = a->newer;
+        PoolFree(json->array_pool, a);
+        break;
+        }
+    default:
+        if (data->built)
+            free_string(json->built, data);
+        break;
+        }
+    PoolFree(json->data_pool, data);
+    }
+
+static void replace(JSON *json, JSON_DATA **place, JSON_DATA *value)
+    {
+    ++value->refs; // first, in case it's inside what it replaces
+    if (*place)
+        release(json, *place);
+    *place = value;
+    }
+
+static JSON_DATA *new_data(JSON *json, enum JSON_TYPE type)
+    {
+    if (fixed(json))
+        return NULL;
+    JSON_DATA *data = (JSON_DATA *)PoolAlloc(json->data_pool);
+    if (data)
+        {
+        data->type = type;
+        data->refs = 0;
+        data->built = 0;
+        data->overlay = 0;
+        data->length = 0;
+        data->hash = 0;
+        }
+    return data;
+    }
+
+static JSON_DATA *new_constant(JSON *json, enum JSON_TYPE type, char *text)
+    {
+    JSON_DATA *data = new_data(json, type);
+    if (data)
+        data->data.string = text;
+    return data;
+    }
+
+static JSON_DATA *new_text(JSON *json, enum JSON_TYPE type,
+                           const char *text, size_t length)
+    {
+    JSON_DATA *data = new_data(json, type);
+    if (!data)
+        return NULL;
+    if (!(data->data.string = new_string(json, text, length)))
+        {
+        PoolFree(json->data_pool, data);
+        return NULL;
+        }
+    data->built = 1;
+    data->length = length;
+    return data;
+    }
+
+void build_destroy(JSON *json)
+    {
+    BUILT *doomed = json->built;
+    if (!doomed)
+        return;
+    while (doomed->text)
+        {
+        TEXT *next = doomed->text->next;
+        free(doomed->text);
+        doomed->text = next;
+        }
+    while (doomed->long_text)
+        {
+        LONG_TEXT *older = doomed->long_text->older;
+        free(doomed->long_text);
+        doomed->long_text = older;
+        }
+    if (doomed->cells)
+        PoolDestroy(doomed->cells);
+    free(doomed->keys.slots);
+    free(doomed->members.slots);
+    free(doomed->lasts.slots);
+    free(doomed);
+    json->built = NULL;
+    }
+
+JSON *json_new(void)
+    {
+    return parse_create();
+    }
+
+void json_set_root(JSON *json, JSON_DATA *data)
+    {
+    if (fixed(json) || (data && !placeable(data)))
+        return;
+    if (data)
+        replace(json, &json->data, data);
+    else if (json->data)
+        {
+        release(json, json->data);
+        json->data = NULL;
+        }
+    changed(json, NULL);
+    }
+
+JSON_DATA *json_new_object(JSON *json)
+    {
+    JSON_DATA *data = new_data(json, JSON_TYPE_MAP);
+    if (data)
+        data->data.map = NULL;
+    return data;
+    }
+
+JSON_DATA *json_new_array(JSON *json)
+    {
+    JSON_DATA *data = new_data(json, JSON_TYPE_ARRAY);
+    if (!data)
+        return NULL;
+    ARRAY *array = (ARRAY *)PoolAlloc(json->array_pool);
+    if (!array)
+        {
+        PoolFree(json->data_pool, data);
+        return NULL;
+        }
+    array->array = (JSON_DATA **)calloc(NEW_ARRAY, sizeof(JSON_DATA *));
+    if (!array->array)
+        {
+        PoolFree(json->array_pool, array);
+        PoolFree(json->data_pool, data);
+        return NULL;
+        }
+    array->size = NEW_ARRAY;
+    array->next = 0;
+    array->indexes = NULL;
+    array->changes = 0;
+    array->older = json->arrays; // freed with the parsed ones
+    array->newer = NULL;
+    if (json->arrays)
+        json->arrays->newer = array;
+    array->json = json;
+    json->arrays = array;
+    data->data.array = array;
+    return data;
+    }
+
+JSON_DATA *json_new_string(JSON *json, const char *string, size_t length)
+    {
+    return new_text(json, JSON_TYPE_STRING, string, length);
+    }
+
+JSON_DATA *json_new_number(JSON *json, double number)
+    {
+    if (!isfinite(number))
+        return json_new_null(json);
+    char text[DTOA_SIZE];
+    size_t length = dtoa(number, text);
+    return new_text(json, JSON_TYPE_NUMBER, text, length);
+    }
+
+JSON_DATA *json_new_boolean(JSON *json, bool value)
+    {
+    return new_constant(json, JSON_TYPE_BOOLEAN,
+                        value ? true_text : false_text);
+    }
+
+JSON_DATA *json_new_null(JSON *json)
+    {
+    return new_constant(json, JSON_TYPE_NULL, null_text);
+    }
+
+bool json_object_set(JSON *json, JSON_DATA *object, const char *key,
+                     JSON_DATA *value)
+    {
+    if (fixed(json) || !object || object->type != JSON_TYPE_MAP ||
+        !placeable(value))
+        return false;
+    size_t length = strlen(key);
+    MAP_NODE *member = NULL;
+    MAP_NODE *last = NULL;
+    SLOT *slot = NULL;
+    SLOT *last_slot = NULL;
+    uint64_t hash = 0;
+    if (object->length < SCANNED_MEMBERS)
+        {
+        for (member = object->data.map; member; member = member->next)
+            {
+            if (member->key_length == length &&
+                !memcmp(member->key, key, length))
+                break;
+            last = member;
+            }
+        }
+    else
+        {
+        BUILT *b = built(json);
+        if (!b || !make_room(&b->lasts, 1))
+            return false;
+        last_slot = probe(&b->lasts, object_hash(object), object, NULL, 0);
+        if (!make_room(&b->members, last_slot->object ? 1 : object->length + 1))
+            return false;
+        if (!last_slot->object)
+            hash_members(b, object, last_slot);
+        hash = member_hash(object, key, length);
+        slot = probe(&b->members, hash, object, key, length);
+        if (slot->object)
+            member = slot->member;
+        last = last_slot->member;
+        }
+    if (!member)
+        {
+        char *copy = intern(json, key, length);
+        if (!copy || !(member = (MAP_NODE *)PoolAlloc(json->map_pool)))
+            return false;
+        member->key = copy;
+        member->key_length = length;
+        member->data = NULL;
+        member->next = NULL;
+        if (last)
+            last->next = member;
+        else
+            object->data.map = member;
+        ++object->length;
+        if (slot)
+            {
+            enter(&json->built->members, slot, hash, object, member);
+            last_slot->member = member;
+            }
+        }
+    replace(json, &member->data, value);
+    changed(json, object);
+    return true;
+    }
+
+bool json_array_push(JSON *json, JSON_DATA *array, JSON_DATA *value)
+    {
+    if (fixed(json) || !array || array->type != JSON_TYPE_ARRAY ||
+        !placeable(value))
+        return false;
+    ARRAY *a = array->data.array;
+    if (a->next + 1 == a->size) // the NULL at the end needs a slot too
+        {
+        JSON_DATA **bigger = (JSON_DATA **)realloc(a->array,
+            a->size * 2 * sizeof(JSON_DATA *));
+        if (!bigger)
+            return false;
+        memset(bigger + a->size, 0, a->size * sizeof(JSON_DATA *));
+        a->array = bigger;
+        a->size *= 2;
+        }
+    ++value->refs;
+    a->array[a->next++] = value;
+    changed(json, array);
+    return true;
+    }
+
+bool json_array_set(JSON *json, JSON_DATA *array, size_t i,
+                    JSON_DATA *value)
+    {
+    if (fixed(json) || !array || array->type != JSON_TYPE_ARRAY ||
+        !placeable(value) || i >= array->data.array->next)
+        return false;
+    replace(json, &array->data.array->array[i], value);
+    changed(json, array);
+    return true;
+    }
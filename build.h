@@ -0,0 +1,17 @@
+//  build.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  What building and changing documents (see json_new) adds to them,
+//  as the rest of the library sees it.
+
+#ifndef __mmijson_build_h
+#define __mmijson_build_h
+
+#include "json.h"
+
+void build_destroy(JSON *);
+// Frees the builder's text and member table, if the document has any.
+
+#endif
@@ -0,0 +1,172 @@
+//  clone.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Deep copies into a single allocation. A first pass totals what the
+//  subtree needs, a second copies it: the JSON itself, then every
+//  node, member and exactly sized element vector in depth-first order
+//  (so a container's children sit right after it), then all the string
+//  bytes packed together.
+
+#include "json.h"
+#include "json_node.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+    {
+    char c;
+    union { JSON json; JSON_DATA data; MAP_NODE node; ARRAY array; } u;
+    } STRICTEST;
+
+// The strictest alignment among what's laid out in the arena, which
+// can be more than a pointer's (uint64_t on 32-bit targets)
+#define ARENA_ALIGN offsetof(STRICTEST, u)
+#define ALIGN(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+typedef struct ARENA ARENA;
+
+struct ARENA
+    {
+    char *nodes; // next free byte for structures
+    char *strings; // next free byte for text
+    JSON *json; // the copy
+    };
+
+static char true_text[] = "true";
+static char false_text[] = "false";
+static char null_text[] = "null";
+
+static bool measure(JSON_DATA *data, size_t *nodes, size_t *strings)
+    // Returns false if out of memory laying out an overlay's members
+    {
+    *nodes += ALIGN(sizeof(JSON_DATA));
+    switch (data->type)
+        {
+    case JSON_TYPE_MAP:
+        if (data->overlay && !overlay_flatten(data))
+            return false;
+        for (MAP_NODE *node = data->data.map; node; node = node->next)
+            {
+            *nodes += ALIGN(sizeof(MAP_NODE));
+            *strings += node->key_length + 1;
+            if (!measure(node->data, nodes, strings))
+                return false;
+            }
+        break;
+    case JSON_TYPE_ARRAY:
+        {
+        ARRAY *array = data->data.array;
+        *nodes += ALIGN(sizeof(ARRAY)) +
+                  ALIGN((array->next + 1) * sizeof(JSON_DATA *));
+        for (size_t i = 0; i < array->next; ++i)
+            if (!measure(array->array[i], nodes, strings))
+                return false;
+        break;
+        }
+    case JSON_TYPE_STRING:
+        *strings += data->length + 1;
+        break;
+    case JSON_TYPE_NUMBER:
+        *strings += data->length + 1;
+        break;
+    case JSON_TYPE_BOOLEAN:
+    case JSON_TYPE_NULL:
+        break; // shared constant text
+        }
+    return true;
+    }
+
+static void *take(ARENA *arena, size_t size)
+    {
+    void *p = arena->nodes;
+    arena->nodes += ALIGN(size);
+    return p;
+    }
+
+static char *copy_text(ARENA *arena, const char *text, size_t length)
+    {
+    char *p = arena->strings;
+    memcpy(p, text, length);
+    p[length] = '\0';
+    arena->strings += length + 1;
+    return p;
+    }
+
+static JSON_DATA *copy(ARENA *arena, JSON_DATA *data)
+    {
+    JSON_DATA *clone = (JSON_DATA *)take(arena, sizeof(JSON_DATA));
+    *clone = *data; // type, length and any cached hash that holds carry
+    clone->hash = cached_hash(data); // over, for good as clones can't change
+    clone->hashed_at = HASHED_FOREVER;
+    switch (data->type)
+        {
+    case JSON_TYPE_MAP:
+        {
+        MAP_NODE **link = &clone->data.map;
+        for (MAP_NODE *node = data->data.map; node; node = node->next)
+            {
+            MAP_NODE *member = (MAP_NODE *)take(arena, sizeof(MAP_NODE));
+            member->key = copy_text(arena, node->key, node->key_length);
+            member->key_length = node->key_length;
+            member->data = copy(arena, node->data);
+            *link = member;
+            link = &member->next;
+            }
+        *link = NULL;
+        break;
+        }
+    case JSON_TYPE_ARRAY:
+        {
+        ARRAY *from = data->data.array;
+        ARRAY *to = (ARRAY *)take(arena, sizeof(ARRAY));
+        to->array = (JSON_DATA **)take(arena,
+                                       (from->next + 1) * sizeof(JSON_DATA *));
+        to->size = to->next = from->next;
+        to->indexes = NULL; // built again on demand
+        to->changes = 0;
+        to->older = to->newer = NULL; // listed once indexed
+        to->json = arena->json;
+        for (size_t i = 0; i < from->next; ++i)
+            to->array[i] = copy(arena, from->array[i]);
+        to->array[to->next] = NULL;
+        clone->data.array = to;
+        break;
+        }
+    case JSON_TYPE_STRING:
+        clone->data.string = copy_text(arena, data->data.string, data->length);
+        break;
+    case JSON_TYPE_NUMBER:
+        clone->data.string = copy_text(arena, data->data.string,
+                                       data->length);
+        break;
+    case JSON_TYPE_BOOLEAN:
+        clone->data.string = data->data.string[0] == 't' ? true_text :
+                                                           false_text;
+        break;
+    case JSON_TYPE_NULL:
+        clone->data.string = null_text;
+        break;
+        }
+    return clone;
+    }
+
+JSON *json_clone(JSON_DATA *data)
+    {
+    size_t nodes = ALIGN(sizeof(JSON));
+    size_t strings = 0;
+    char *memory = NULL;
+    if (!measure(data, &nodes, &strings) ||
+        !(memory = (char *)malloc(nodes + strings)))
+        return NULL;
+
+    JSON *json = (JSON *)memory;
+    memset(json, 0, sizeof(JSON));
+    json->arena = memory;
+    ARENA arena = { memory + ALIGN(sizeof(JSON)), memory + nodes, json };
+    json->data = copy(&arena, data);
+    return json;
+    }
@@ -0,0 +1,188 @@
+//  columns.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Columnar extraction from an array of objects in one pass over each
+//  record's members. Records of the same shape list their keys in the
+//  same order, so for every member position the key seen there last
+//  time and what it matched are remembered; a member whose key equals
+//  that one is matched with a single compare, and only keys that moved
+//  fall back to searching the requested fields.
+
+#include "json.h"
+#include "json_node.h"
+#include "json_inline.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHED_POSITIONS 256
+#define NOT_WANTED (-1)
+
+typedef struct FIELD FIELD;
+typedef struct SEEN SEEN;
+
+struct FIELD
+    {
+    const char *name;
+    size_t length;
+    };
+
+struct SEEN
+    // The key last seen at a member position, and the field it matched
+    {
+    const char *key;
+    size_t length;
+    int field;
+    };
+
+static int find_field(const FIELD *fields, size_t n, const char *key,
+                      size_t length)
+    {
+    for (size_t i = 0; i < n; ++i)
+        if (fields[i].length == length && !memcmp(fields[i].name, key, length))
+            return i;
+    return NOT_WANTED;
+    }
+
+static bool to_int64(JSON_DATA *data, int64_t *value)
+    // Integers, written as such or not (1e3), that fit
+    {
+    char *end;
+    errno = 0;
+    long long n = strtoll(data->data.string, &end, 10);
+    if (end == data->data.string + data->length && !errno)
+        {
+        *value = n;
+        return true;
+        }
+    double d = json_inline_number(data);
+    if (d >= -9223372036854775808.0 && d < 9223372036854775808.0 &&
+        d == (double)(int64_t)d)
+        {
+        *value = (int64_t)d;
+        return true;
+        }
+    return false;
+    }
+
+static void store(JSON_COLUMN *column, JSON_COLUMN_TYPE type, size_t row,
+                  JSON_DATA *data)
+    {
+    bool valid = false;
+    switch (type)
+        {
+    case JSON_COLUMN_DOUBLE:
+        if ((valid = data->type == JSON_TYPE_NUMBER))
+            column->values.doubles[row] = json_inline_number(data);
+        break;
+    case JSON_COLUMN_INT64:
+        valid = data->type == JSON_TYPE_NUMBER &&
+                to_int64(data, &column->values.int64s[row]);
+        break;
+    case JSON_COLUMN_STRING:
+        if ((valid = data->type == JSON_TYPE_STRING))
+            column->values.strings[row] = json_inline_string_view(data);
+        break;
+        }
+    if (valid)
+        column->valid[row / 8] |= 1 << (row % 8);
+    }
+
+static size_t value_size(JSON_COLUMN_TYPE type)
+    {
+    switch (type)
+        {
+    case JSON_COLUMN_DOUBLE:
+        return sizeof(double);
+    case JSON_COLUMN_INT64:
+        return sizeof(int64_t);
+    case JSON_COLUMN_STRING:
+        break;
+        }
+    return sizeof(JSON_STRING_VIEW);
+    }
+
+void json_columns_free(JSON_COLUMN *columns, size_t n_fields)
+    {
+    for (size_t i = 0; i < n_fields; ++i)
+        {
+        free(columns[i].values.doubles);
+        columns[i].values.doubles = NULL;
+        columns[i].valid = NULL;
+        }
+    }
+
+bool json_extract_columns(JSON_DATA *array, const char **field_names,
+                          const JSON_COLUMN_TYPE *types, size_t n_fields,
+                          JSON_COLUMN *columns)
+    {
+    for (size_t i = 0; i < n_fields; ++i)
+        columns[i].values.doubles = NULL;
+    if (!json_inline_is_array(array))
+        return false;
+    size_t rows = json_inline_array_length(array);
+    FIELD *fields = (FIELD *)malloc(n_fields * sizeof(FIELD) + 1);
+    if (!fields)
+        return false;
+
+    // Each column is a single block: zeroed values, then the bitmap
+    size_t bitmap = (rows + 7) / 8;
+    for (size_t i = 0; i < n_fields; ++i)
+        {
+        fields[i].name = field_names[i];
+        fields[i].length = strlen(field_names[i]);
+        size_t values = rows * value_size(types[i]);
+        char *block = (char *)calloc(1, values + bitmap + 1);
+        if (!block)
+            {
+            json_columns_free(columns, i);
+            free(fields);
+            return false;
+            }
+        columns[i].values.doubles = (double *)block;
+        columns[i].valid = (uint8_t *)(block + values);
+        }
+
+    SEEN seen[CACHED_POSITIONS];
+    memset(seen, 0, sizeof(seen));
+    JSON_DATA **records = json_inline_array(array);
+    for (size_t row = 0; row < rows; ++row)
+        {
+        if (records[row]->type != JSON_TYPE_MAP)
+            continue; // a row of nulls
+        if (records[row]->overlay && !overlay_flatten(records[row]))
+            {
+            json_columns_free(columns, n_fields);
+            free(fields);
+            return false;
+            }
+        size_t position = 0;
+        for (MAP_NODE *member = records[row]->data.map; member;
+             member = member->next, ++position)
+            {
+            int field;
+            SEEN *last = position < CACHED_POSITIONS ? &seen[position] : NULL;
+            if (last && last->key && last->length == member->key_length &&
+                !memcmp(last->key, member->key, member->key_length))
+                field = last->field;
+            else
+                {
+                field = find_field(fields, n_fields, member->key,
+                                   member->key_length);
+                if (last)
+                    {
+                    last->key = member->key;
+                    last->length = member->key_length;
+                    last->field = field;
+                    }
+                }
+            if (field != NOT_WANTED)
+                store(&columns[field], types[field], row, member->data);
+            }
+        }
+    free(fields);
+    return true;
+    }
@@ -0,0 +1,405 @@
+//  compressed.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Parsing gzip (and, built with JSON_ZSTD, zstd) compressed files
+//  without a separate decompressed copy. A reader thread fills a small
+//  ring of compressed chunks while this thread inflates them straight
+//  into the buffer that is then parsed in place. The buffer starts at
+//  the decompressed size when the file says what it is (gzip's
+//  trailer, zstd's frame header) and the compressed size makes that
+//  believable, and otherwise grows geometrically.
+
+#include "json.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef JSON_ZSTD
+#include <zstd.h>
+#endif
+
+#define CHUNK_SIZE (256 * 1024)
+#define CHUNKS 4
+#define OUT_START (64 * 1024)
+#define MAX_RATIO 1032 // deflate's best; size hints beyond it are lies
+
+typedef struct PIPE PIPE;
+typedef struct OUT OUT;
+
+struct PIPE
+    // Compressed input, read ahead by the reader thread
+    {
+    FILE *f;
+    unsigned char *data[CHUNKS];
+    size_t length[CHUNKS];
+    size_t filled; // chunks read so far
+    size_t drained; // chunks consumed so far
+    bool done; // no more chunks will be filled
+    bool failed; // ... because of a read error
+    bool stop; // set by the consumer to make the reader quit
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    };
+
+struct OUT
+    // The decompressed text, NUL terminated once complete
+    {
+    char *buffer;
+    size_t size;
+    size_t length;
+    size_t max; // max_total_bytes, or SIZE_MAX
+    size_t plausible; // the largest size hint believed, 0 for none
+    JSON_ERROR error;
+    };
+
+static void *read_ahead(void *arg)
+    {
+    PIPE *pipe = (PIPE *)arg;
+    pthread_mutex_lock(&pipe->lock);
+    for (;;)
+        {
+        while (pipe->filled - pipe->drained == CHUNKS && !pipe->stop)
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        if (pipe->stop)
+            break;
+        size_t slot = pipe->filled % CHUNKS;
+        pthread_mutex_unlock(&pipe->lock);
+        size_t n = fread(pipe->data[slot], 1, CHUNK_SIZE, pipe->f);
+        bool failed = ferror(pipe->f);
+        pthread_mutex_lock(&pipe->lock);
+        if (n)
+            {
+            pipe->length[slot] = n;
+            ++pipe->filled;
+            }
+        if (n < CHUNK_SIZE)
+            {
+            pipe->failed = failed;
+            break;
+            }
+        pthread_cond_signal(&pipe->cond);
+        }
+    pipe->done = true;
+    pthread_cond_signal(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+    }
+
+static bool next_chunk(PIPE *pipe, const unsigned char **data, size_t *length)
+    // Waits for the next chunk; false at the end of the input
+    {
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->filled == pipe->drained && !pipe->done)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    bool more = pipe->filled > pipe->drained;
+    if (more)
+        {
+        size_t slot = pipe->drained % CHUNKS;
+        *data = pipe->data[slot];
+        *length = pipe->length[slot];
+        }
+    pthread_mutex_unlock(&pipe->lock);
+    return more;
+    }
+
+static void done_chunk(PIPE *pipe)
+    {
+    pthread_mutex_lock(&pipe->lock);
+    ++pipe->drained;
+    pthread_cond_signal(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    }
+
+static bool reserve(OUT *out, size_t wanted)
+    // Room for at least wanted more bytes plus the NUL
+    {
+    if (out->length + wanted < out->size)
+        return true;
+    if (out->length + wanted > out->max)
+        {
+        out->error = JSON_TOO_BIG;
+        return false;
+        }
+    size_t size = out->size ? out->size : OUT_START;
+    while (size <= out->length + wanted)
+        size *= 2;
+    char *bigger = (char *)realloc(out->buffer, size);
+    if (!bigger)
+        {
+        out->error = JSON_NO_MEMORY;
+        return false;
+        }
+    out->buffer = bigger;
+    out->size = size;
+    return true;
+    }
+
+static bool presize(OUT *out, size_t expected)
+    // Allocates exactly what a correct size hint needs; a wrong one is
+    // merely a worse starting point. Hints come from the file, so one
+    // beyond what its compressed size could expand to isn't taken.
+    {
+    if (expected > out->plausible)
+        return true;
+    if (expected > out->max)
+        expected = out->max;
+    if (!expected || out->size)
+        return true;
+    if (!(out->buffer = (char *)malloc(expected + 1)))
+        {
+        out->error = JSON_NO_MEMORY;
+        return false;
+        }
+    out->size = expected + 1;
+    return true;
+    }
+
+static size_t compressed_size(FILE *f)
+    // Bytes from the current position to the end, 0 if not seekable
+    {
+    long start = ftell(f);
+    if (start < 0 || fseek(f, 0, SEEK_END))
+        return 0;
+    long end = ftell(f);
+    if (fseek(f, start, SEEK_SET) || end < start)
+        return 0;
+    return end - start;
+    }
+
+static size_t gzip_size(FILE *f)
+    // A gzip file ends with the size of its (last member's) decompressed
+    // data modulo 2^32. Only seekable files can tell before reading all.
+    {
+    long start = ftell(f);
+    unsigned char trailer[4];
+    if (start < 0 || fseek(f, -4, SEEK_END))
+        return 0;
+    size_t n = fread(trailer, 1, sizeof(trailer), f);
+    if (fseek(f, start, SEEK_SET) || n != sizeof(trailer))
+        return 0;
+    return trailer[0] | trailer[1] << 8 | trailer[2] << 16 |
+           (size_t)trailer[3] << 24;
+    }
+
+static bool inflate_gzip(PIPE *pipe, OUT *out, size_t hint)
+    {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+        {
+        out->error = JSON_NO_MEMORY;
+        return false;
+        }
+    bool ok = presize(out, hint);
+    bool stalled = false;
+    int status = Z_OK;
+    const unsigned char *data;
+    size_t length;
+    while (ok && next_chunk(pipe, &data, &length))
+        {
+        z.next_in = (unsigned char *)data;
+        z.avail_in = length;
+        while (ok && z.avail_in)
+            {
+            if (status == Z_STREAM_END)
+                {
+                // Concatenated gzip members decompress to the
+                // concatenation of their contents
+                inflateReset(&z);
+                status = Z_OK;
+                }
+            // Only grow once inflate can't go on without room: with a
+            // correct size hint it finishes (trailer and all) in place
+            size_t room = out->size ? out->size - 1 - out->length : 0;
+            if ((!out->size || stalled) && !(ok = reserve(out, room + 1)))
+                break;
+            room = out->size - 1 - out->length;
+            z.next_out = (unsigned char *)out->buffer + out->length;
+            z.avail_out = room > UINT32_MAX ? UINT32_MAX : room;
+            size_t before = z.avail_out;
+            status = inflate(&z, Z_NO_FLUSH);
+            out->length += before - z.avail_out;
+            stalled = status == Z_BUF_ERROR;
+            if (status != Z_OK && status != Z_STREAM_END && !stalled)
+                {
+                out->error = JSON_READ_ERROR;
+                ok = false;
+                }
+            }
+        done_chunk(pipe);
+        }
+    // Truncated input leaves the last member unfinished
+    if (ok && status != Z_STREAM_END)
+        {
+        out->error = JSON_READ_ERROR;
+        ok = false;
+        }
+    inflateEnd(&z);
+    return ok;
+    }
+
+#ifdef JSON_ZSTD
+
+static bool decompress_zstd(PIPE *pipe, OUT *out)
+    {
+    ZSTD_DStream *z = ZSTD_createDStream();
+    if (!z)
+        {
+        out->error = JSON_NO_MEMORY;
+        return false;
+        }
+    bool ok = true;
+    bool first = true;
+    bool stalled = false;
+    size_t status = 0;
+    const unsigned char *data;
+    size_t length;
+    while (ok && next_chunk(pipe, &data, &length))
+        {
+        if (first)
+            {
+            unsigned long long size = ZSTD_getFrameContentSize(data, length);
+            if (size != ZSTD_CONTENTSIZE_UNKNOWN &&
+                size != ZSTD_CONTENTSIZE_ERROR && size < SIZE_MAX)
+                ok = presize(out, size);
+            first = false;
+            }
+        ZSTD_inBuffer in = { data, length, 0 };
+        while (ok && in.pos < in.size)
+            {
+            size_t room = out->size ? out->size - 1 - out->length : 0;
+            if ((!out->size || stalled) && !(ok = reserve(out, room + 1)))
+                break;
+            ZSTD_outBuffer dst = { out->buffer + out->length,
+                                   out->size - 1 - out->length, 0 };
+            size_t consumed = in.pos;
+            status = ZSTD_decompressStream(z, &dst, &in);
+            out->length += dst.pos;
+            stalled = !dst.pos && in.pos == consumed;
+            if (ZSTD_isError(status))
+                {
+                out->error = JSON_READ_ERROR;
+                ok = false;
+                }
+            }
+        done_chunk(pipe);
+        }
+    // Nonzero means the last frame wasn't complete
+    if (ok && status)
+        {
+        out->error = JSON_READ_ERROR;
+        ok = false;
+        }
+    ZSTD_freeDStream(z);
+    return ok;
+    }
+
+#endif
+
+static bool copy_plain(PIPE *pipe, OUT *out)
+    {
+    const unsigned char *data;
+    size_t length;
+    bool ok = true;
+    while (ok && next_chunk(pipe, &data, &length))
+        {
+        if ((ok = reserve(out, length)))
+            {
+            memcpy(out->buffer + out->length, data, length);
+            out->length += length;
+            }
+        done_chunk(pipe);
+        }
+    return ok;
+    }
+
+static bool decompress(PIPE *pipe, OUT *out, size_t gzip_hint)
+    {
+    const unsigned char *data;
+    size_t length;
+    if (!next_chunk(pipe, &data, &length))
+        return true; // empty
+    if (length >= 2 && data[0] == 0x1F && data[1] == 0x8B)
+        return inflate_gzip(pipe, out, gzip_hint);
+    if (length >= 4 && data[0] == 0x28 && data[1] == 0xB5 &&
+        data[2] == 0x2F && data[3] == 0xFD)
+        {
+#ifdef JSON_ZSTD
+        return decompress_zstd(pipe, out);
+#else
+        out->error = JSON_READ_ERROR;
+        return false;
+#endif
+        }
+    return copy_plain(pipe, out);
+    }
+
+JSON *json_parse_compressed(FILE *f)
+    {
+    return json_parse_compressed_opts(f, NULL, NULL);
+    }
+
+JSON *json_parse_compressed_opts(FILE *f, const JSON_PARSE_OPTIONS *options,
+                                 JSON_ERROR *error)
+    {
+    OUT out;
+    memset(&out, 0, sizeof(out));
+    out.max = options && options->max_total_bytes ?
+        options->max_total_bytes : SIZE_MAX;
+    size_t compressed = compressed_size(f);
+    out.plausible = compressed > SIZE_MAX / MAX_RATIO ?
+        SIZE_MAX : compressed * MAX_RATIO;
+    size_t gzip_hint = gzip_size(f);
+
+    PIPE *pipe = (PIPE *)calloc(1, sizeof(PIPE));
+    unsigned char *chunks = (unsigned char *)malloc(CHUNKS * CHUNK_SIZE);
+    pthread_t reader;
+    bool started = false;
+    if (pipe && chunks)
+        {
+        pipe->f = f;
+        for (int i = 0; i < CHUNKS; ++i)
+            pipe->data[i] = chunks + i * CHUNK_SIZE;
+        pthread_mutex_init(&pipe->lock, NULL);
+        pthread_cond_init(&pipe->cond, NULL);
+        if (!(started = !pthread_create(&reader, NULL, read_ahead, pipe)))
+            {
+            pthread_mutex_destroy(&pipe->lock);
+            pthread_cond_destroy(&pipe->cond);
+            }
+        }
+
+    if (!started)
+        out.error = JSON_NO_MEMORY;
+    else
+        {
+        decompress(pipe, &out, gzip_hint);
+        pthread_mutex_lock(&pipe->lock);
+        pipe->stop = true;
+        pthread_cond_signal(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+        pthread_join(reader, NULL);
+        if (!out.error && pipe->failed)
+            out.error = JSON_READ_ERROR;
+        if (!out.error)
+            reserve(&out, 0); // for the NUL, even if the input was empty
+        pthread_mutex_destroy(&pipe->lock);
+        pthread_cond_destroy(&pipe->cond);
+        }
+    free(chunks);
+    free(pipe);
+
+    if (out.error)
+        {
+        free(out.buffer);
+        if (error)
+            *error = out.error;
+        return NULL;
+        }
+    out.buffer[out.length] = '\0';
+    return json_parse_string_opts(out.buffer, true, options, error);
+    }
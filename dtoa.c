@@ -0,0 +1,369 @@
+//  dtoa.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Double to shortest text by Grisu2 (Florian Loitsch, "Printing
+//  Floating-Point Numbers Quickly and Accurately with Integers", 2010).
+//  The neighbours halfway to the doubles either side of the value are
+//  scaled by a cached power of ten into a range where 64 bit integer
+//  arithmetic finds the fewest digits lying between them, so the text
+//  always reads back as the same double and, in all but a small
+//  fraction of cases, is as short as any that does. The digits are then
+//  laid out as an integer, a decimal or an exponent, as JSON allows.
+
+#include "dtoa.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct DIY_FP DIY_FP;
+
+struct DIY_FP
+    // f * 2^e
+    {
+    uint64_t f;
+    int e;
+    };
+
+#define HIDDEN_BIT 0x0010000000000000ull
+#define SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFull
+
+static const struct
+    {
+    uint64_t f;
+    int e;
+    } cached_powers[] =
+    // 10^-348, 10^-340 ... 10^340, normalized and rounded
+    {
+    { 0xFA8FD5A0081C0288ULL, -1220 }, // 1e-348
+    { 0xBAAEE17FA23EBF76ULL, -1193 }, // 1e-340
+    { 0x8B16FB203055AC76ULL, -1166 }, // 1e-332
+    { 0xCF42894A5DCE35EAULL, -1140 }, // 1e-324
+    { 0x9A6BB0AA55653B2DULL, -1113 }, // 1e-316
+    { 0xE61ACF033D1A45DFULL, -1087 }, // 1e-308
+    { 0xAB70FE17C79AC6CAULL, -1060 }, // 1e-300
+    { 0xFF77B1FCBEBCDC4FULL, -1034 }, // 1e-292
+    { 0xBE5691EF416BD60CULL, -1007 }, // 1e-284
+    { 0x8DD01FAD907FFC3CULL, -980 }, // 1e-276
+    { 0xD3515C2831559A83ULL, -954 }, // 1e-268
+    { 0x9D71AC8FADA6C9B5ULL, -927 }, // 1e-260
+    { 0xEA9C227723EE8BCBULL, -901 }, // 1e-252
+    { 0xAECC49914078536DULL, -874 }, // 1e-244
+    { 0x823C12795DB6CE57ULL, -847 }, // 1e-236
+    { 0xC21094364DFB5637ULL, -821 }, // 1e-228
+    { 0x9096EA6F3848984FULL, -794 }, // 1e-220
+    { 0xD77485CB25823AC7ULL, -768 }, // 1e-212
+    { 0xA086CFCD97BF97F4ULL, -741 }, // 1e-204
+    { 0xEF340A98172AACE5ULL, -715 }, // 1e-196
+    { 0xB23867FB2A35B28EULL, -688 }, // 1e-188
+    { 0x84C8D4DFD2C63F3BULL, -661 }, // 1e-180
+    { 0xC5DD44271AD3CDBAULL, -635 }, // 1e-172
+    { 0x936B9FCEBB25C996ULL, -608 }, // 1e-164
+    { 0xDBAC6C247D62A584ULL, -582 }, // 1e-156
+    { 0xA3AB66580D5FDAF6ULL, -555 }, // 1e-148
+    { 0xF3E2F893DEC3F126ULL, -529 }, // 1e-140
+    { 0xB5B5ADA8AAFF80B8ULL, -502 }, // 1e-132
+    { 0x87625F056C7C4A8BULL, -475 }, // 1e-124
+    { 0xC9BCFF6034C13053ULL, -449 }, // 1e-116
+    { 0x964E858C91BA2655ULL, -422 }, // 1e-108
+    { 0xDFF9772470297EBDULL, -396 }, // 1e-100
+    { 0xA6DFBD9FB8E5B88FULL, -369 }, // 1e-92
+    { 0xF8A95FCF88747D94ULL, -343 }, // 1e-84
+    { 0xB94470938FA89BCFULL, -316 }, // 1e-76
+    { 0x8A08F0F8BF0F156BULL, -289 }, // 1e-68
+    { 0xCDB02555653131B6ULL, -263 }, // 1e-60
+    { 0x993FE2C6D07B7FACULL, -236 }, // 1e-52
+    { 0xE45C10C42A2B3B06ULL, -210 }, // 1e-44
+    { 0xAA242499697392D3ULL, -183 }, // 1e-36
+    { 0xFD87B5F28300CA0EULL, -157 }, // 1e-28
+    { 0xBCE5086492111AEBULL, -130 }, // 1e-20
+    { 0x8CBCCC096F5088CCULL, -103 }, // 1e-12
+    { 0xD1B71758E219652CULL, -77 }, // 1e-4
+    { 0x9C40000000000000ULL, -50 }, // 1e4
+    { 0xE8D4A51000000000ULL, -24 }, // 1e12
+    { 0xAD78EBC5AC620000ULL, 3 }, // 1e20
+    { 0x813F3978F8940984ULL, 30 }, // 1e28
+    { 0xC097CE7BC90715B3ULL, 56 }, // 1e36
+    { 0x8F7E32CE7BEA5C70ULL, 83 }, // 1e44
+    { 0xD5D238A4ABE98068ULL, 109 }, // 1e52
+    { 0x9F4F2726179A2245ULL, 136 }, // 1e60
+    { 0xED63A231D4C4FB27ULL, 162 }, // 1e68
+    { 0xB0DE65388CC8ADA8ULL, 189 }, // 1e76
+    { 0x83C7088E1AAB65DBULL, 216 }, // 1e84
+    { 0xC45D1DF942711D9AULL, 242 }, // 1e92
+    { 0x924D692CA61BE758ULL, 269 }, // 1e100
+    { 0xDA01EE641A708DEAULL, 295 }, // 1e108
+    { 0xA26DA3999AEF774AULL, 322 }, // 1e116
+    { 0xF209787BB47D6B85ULL, 348 }, // 1e124
+    { 0xB454E4A179DD1877ULL, 375 }, // 1e132
+    { 0x865B86925B9BC5C2ULL, 402 }, // 1e140
+    { 0xC83553C5C8965D3DULL, 428 }, // 1e148
+    { 0x952AB45CFA97A0B3ULL, 455 }, // 1e156
+    { 0xDE469FBD99A05FE3ULL, 481 }, // 1e164
+    { 0xA59BC234DB398C25ULL, 508 }, // 1e172
+    { 0xF6C69A72A3989F5CULL, 534 }, // 1e180
+    { 0xB7DCBF5354E9BECEULL, 561 }, // 1e188
+    { 0x88FCF317F22241E2ULL, 588 }, // 1e196
+    { 0xCC20CE9BD35C78A5ULL, 614 }, // 1e204
+    { 0x98165AF37B2153DFULL, 641 }, // 1e212
+    { 0xE2A0B5DC971F303AULL, 667 }, // 1e220
+    { 0xA8D9D1535CE3B396ULL, 694 }, // 1e228
+    { 0xFB9B7CD9A4A7443CULL, 720 }, // 1e236
+    { 0xBB764C4CA7A44410ULL, 747 }, // 1e244
+    { 0x8BAB8EEFB6409C1AULL, 774 }, // 1e252
+    { 0xD01FEF10A657842CULL, 800 }, // 1e260
+    { 0x9B10A4E5E9913129ULL, 827 }, // 1e268
+    { 0xE7109BFBA19C0C9DULL, 853 }, // 1e276
+    { 0xAC2820D9623BF429ULL, 880 }, // 1e284
+    { 0x80444B5E7AA7CF85ULL, 907 }, // 1e292
+    { 0xBF21E44003ACDD2DULL, 933 }, // 1e300
+    { 0x8E679C2F5E44FF8FULL, 960 }, // 1e308
+    { 0xD433179D9C8CB841ULL, 986 }, // 1e316
+    { 0x9E19DB92B4E31BA9ULL, 1013 }, // 1e324
+    { 0xEB96BF6EBADF77D9ULL, 1039 }, // 1e332
+    { 0xAF87023B9BF0EE6BULL, 1066 }, // 1e340
+    };
+
+static const uint64_t powers_of_ten[] =
+    {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+    10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+    100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull, 1000000000000000000ull,
+    10000000000000000000ull
+    };
+
+static DIY_FP multiply(DIY_FP x, DIY_FP y)
+    // The upper half of the 128 bit product, rounded
+    {
+    unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    DIY_FP r;
+    r.f = (uint64_t)(p >> 64) + ((uint64_t)p >> 63);
+    r.e = x.e + y.e + 64;
+    return r;
+    }
+
+static DIY_FP normalize(DIY_FP x)
+    {
+    int shift = __builtin_clzll(x.f);
+    x.f <<= shift;
+    x.e -= shift;
+    return x;
+    }
+
+static void boundaries(DIY_FP v, DIY_FP *minus, DIY_FP *plus)
+    // Halfway to the neighbouring doubles, sharing plus's exponent
+    {
+    DIY_FP p = { (v.f << 1) + 1, v.e - 1 };
+    *plus = normalize(p);
+    DIY_FP m;
+    if (v.f == HIDDEN_BIT) // the one below is closer
+        {
+        m.f = (v.f << 2) - 1;
+        m.e = v.e - 2;
+        }
+    else
+        {
+        m.f = (v.f << 1) - 1;
+        m.e = v.e - 1;
+        }
+    m.f <<= m.e - plus->e;
+    m.e = plus->e;
+    *minus = m;
+    }
+
+static DIY_FP cached_power(int e, int *k)
+    // A power of ten bringing a number with binary exponent e into
+    // [2^-60, 2^-32) or so, and its decimal exponent -k
+    {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int index = (int)dk;
+    if (dk - index > 0.0)
+        ++index;
+    index = (index >> 3) + 1;
+    *k = -(-348 + index * 8);
+    DIY_FP power = { cached_powers[index].f, cached_powers[index].e };
+    return power;
+    }
+
+static void round_down(char *digits, size_t length, uint64_t delta,
+                       uint64_t rest, uint64_t ten_kappa, uint64_t distance)
+    // Moves the last digit towards the value while the result stays
+    // within the boundaries
+    {
+    while (rest < distance && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < distance ||
+            distance - rest > rest + ten_kappa - distance))
+        {
+        --digits[length - 1];
+        rest += ten_kappa;
+        }
+    }
+
+static int decimal_digits(uint32_t n)
+    {
+    int count = 1;
+    while (n >= 10)
+        {
+        n /= 10;
+        ++count;
+        }
+    return count;
+    }
+
+static size_t generate(DIY_FP w, DIY_FP plus, uint64_t delta, char *digits,
+                       int *k)
+    // The fewest digits of a number between plus - delta and plus,
+    // nearest w
+    {
+    DIY_FP one = { 1ull << -plus.e, plus.e };
+    uint64_t distance = plus.f - w.f;
+    uint32_t integral = (uint32_t)(plus.f >> -one.e);
+    uint64_t fraction = plus.f & (one.f - 1);
+    int kappa = decimal_digits(integral);
+    size_t length = 0;
+    while (kappa > 0)
+        {
+        uint32_t power = (uint32_t)powers_of_ten[kappa - 1];
+        uint32_t d = integral / power;
+        integral %= power;
+        if (d || length)
+            digits[length++] = '0' + d;
+        --kappa;
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest <= delta)
+            {
+            *k += kappa;
+            round_down(digits, length, delta, rest,
+                       powers_of_ten[kappa] << -one.e, distance);
+            return length;
+            }
+        }
+    for (;;)
+        {
+        fraction *= 10;
+        delta *= 10;
+        uint32_t d = (uint32_t)(fraction >> -one.e);
+        if (d || length)
+            digits[length++] = '0' + d;
+        fraction &= one.f - 1;
+        --kappa;
+        if (fraction < delta)
+            {
+            *k += kappa;
+            round_down(digits, length, delta, fraction, one.f,
+                       -kappa < 20 ? distance * powers_of_ten[-kappa] : 0);
+            return length;
+            }
+        }
+    }
+
+static size_t grisu2(double value, char *digits, int *k)
+    // The digits of positive value, value = digits * 10^k
+    {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (int)(bits >> 52);
+    DIY_FP v;
+    if (biased)
+        {
+        v.f = (bits & SIGNIFICAND_MASK) + HIDDEN_BIT;
+        v.e = biased - 1075;
+        }
+    else // subnormal
+        {
+        v.f = bits & SIGNIFICAND_MASK;
+        v.e = -1074;
+        }
+    DIY_FP minus, plus;
+    boundaries(v, &minus, &plus);
+    DIY_FP power = cached_power(plus.e, k);
+    DIY_FP w = multiply(normalize(v), power);
+    DIY_FP upper = multiply(plus, power);
+    DIY_FP lower = multiply(minus, power);
+    // Stay clear of the boundaries, given the rounding in multiply
+    ++lower.f;
+    --upper.f;
+    return generate(w, upper, upper.f - lower.f, digits, k);
+    }
+
+static char *exponent(int e, char *p)
+    {
+    *p++ = 'e';
+    if (e < 0)
+        {
+        *p++ = '-';
+        e = -e;
+        }
+    if (e >= 100)
+        {
+        *p++ = '0' + e / 100;
+        e %= 100;
+        *p++ = '0' + e / 10;
+        }
+    else if (e >= 10)
+        *p++ = '0' + e / 10;
+    *p++ = '0' + e % 10;
+    return p;
+    }
+
+static char *lay_out(char *digits, size_t length, int k, char *p)
+    // digits * 10^k as JavaScript would write it, bar the '+' in
+    // exponents
+    {
+    int n = (int)length;
+    int point = n + k; // 10^(point - 1) <= value < 10^point
+    if (k >= 0 && point <= 21) // 1234e7 as 12340000000
+        {
+        memcpy(p, digits, n);
+        memset(p + n, '0', k);
+        return p + point;
+        }
+    if (point > 0 && point <= 21) // 1234e-2 as 12.34
+        {
+        memcpy(p, digits, point);
+        p[point] = '.';
+        memcpy(p + point + 1, digits + point, n - point);
+        return p + n + 1;
+        }
+    if (point > -6 && point <= 0) // 1234e-7 as 0.0001234
+        {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -point);
+        memcpy(p - point, digits, n);
+        return p - point + n;
+        }
+    *p++ = digits[0]; // 1234e30 as 1.234e33
+    if (n > 1)
+        {
+        *p++ = '.';
+        memcpy(p, digits + 1, n - 1);
+        p += n - 1;
+        }
+    return exponent(point - 1, p);
+    }
+
+size_t dtoa(double value, char *buffer)
+    {
+    char *p = buffer;
+    if (signbit(value))
+        {
+        *p++ = '-';
+        value = -value;
+        }
+    if (value == 0.0)
+        *p++ = '0';
+    else
+        {
+        char digits[20];
+        int k;
+        size_t length = grisu2(value, digits, &k);
+        p = lay_out(digits, length, k, p);
+        }
+    *p = '\0';
+    return p - buffer;
+    }
@@ -0,0 +1,21 @@
+//  dtoa.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Number formatting for the library sources that write numbers' token
+//  text themselves.
+
+#ifndef __mmijson_dtoa_h
+#define __mmijson_dtoa_h
+
+#include <stddef.h>
+
+#define DTOA_SIZE 32
+
+size_t dtoa(double value, char *buffer);
+// Writes the shortest JSON number that reads back as value (which must
+// be finite) into buffer, at least DTOA_SIZE bytes, NUL terminated.
+// Returns its length.
+
+#endif
@@ -0,0 +1,197 @@
+//  hash.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Structural hashing and deep equality. Hashes are cached in the
+//  nodes, so hashing a subtree a second time (or comparing documents
+//  that have been hashed) costs O(1) per already hashed node. As the
+//  builder can change containers, theirs are stamped with their
+//  document's count of changes (reached through the pool the node came
+//  from) and hold only while it stays the same.
+
+#include "json.h"
+#include "json_node.h"
+#include "json_inline.h"
+
+#include <string.h>
+
+#define SEED_NULL    0x9E3779B97F4A7C15ULL
+#define SEED_FALSE   0xC2B2AE3D27D4EB4FULL
+#define SEED_TRUE    0x165667B19E3779F9ULL
+#define SEED_NUMBER  0x27D4EB2F165667C5ULL
+#define SEED_STRING  0x85EBCA77C2B2AE63ULL
+#define SEED_ARRAY   0xFF51AFD7ED558CCDULL
+#define SEED_MAP     0xC4CEB9FE1A85EC53ULL
+#define MULTIPLIER   0x9FB21C651E98DF25ULL
+
+static uint64_t mix(uint64_t h)
+    // The murmur3 64 bit finalizer
+    {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+    }
+
+static uint64_t hash_bytes(const char *p, size_t length, uint64_t seed)
+    // Eight bytes per step; the result depends on byte order, so hashes
+    // are stable across runs and processes but not across platforms
+    {
+    uint64_t h = seed ^ (length * MULTIPLIER);
+    for (; length >= 8; p += 8, length -= 8)
+        {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = (h ^ mix(word)) * MULTIPLIER;
+        }
+    if (length)
+        {
+        uint64_t word = 0;
+        memcpy(&word, p, length);
+        h = (h ^ mix(word)) * MULTIPLIER;
+        }
+    return mix(h);
+    }
+
+static uint64_t hash_number(JSON_DATA *data)
+    {
+    double value = json_inline_number(data);
+    uint64_t bits;
+    if (value == 0)
+        value = 0; // -0 and 0 are the same number
+    memcpy(&bits, &value, sizeof(bits));
+    return mix(bits ^ SEED_NUMBER);
+    }
+
+uint64_t json_hash(JSON_DATA *data)
+    {
+    uint64_t cached = cached_hash(data);
+    if (cached)
+        return cached;
+
+    uint64_t h = 0;
+    switch (data->type)
+        {
+    case JSON_TYPE_NULL:
+        h = SEED_NULL;
+        break;
+    case JSON_TYPE_BOOLEAN:
+        h = json_inline_boolean(data) ? SEED_TRUE : SEED_FALSE;
+        break;
+    case JSON_TYPE_NUMBER:
+        h = hash_number(data);
+        break;
+    case JSON_TYPE_STRING:
+        h = hash_bytes(data->data.string, data->length, SEED_STRING);
+        break;
+    case JSON_TYPE_ARRAY:
+        {
+        // Order matters: fold each element in
+        ARRAY *array = data->data.array;
+        h = SEED_ARRAY ^ array->next;
+        for (size_t i = 0; i < array->next; ++i)
+            h = mix(h * MULTIPLIER + json_hash(array->array[i]));
+        break;
+        }
+    case JSON_TYPE_MAP:
+        {
+        // Order doesn't: sum the independently mixed members (of an
+        // overlay that can't be laid out, none)
+        uint64_t sum = 0;
+        if (data->overlay && !overlay_flatten(data))
+            break;
+        for (MAP_NODE *node = data->data.map; node; node = node->next)
+            sum += mix(hash_bytes(node->key, node->key_length, SEED_MAP) +
+                       json_hash(node->data) * MULTIPLIER);
+        h = mix(sum ^ SEED_MAP ^ data->length);
+        break;
+        }
+        }
+
+    if (h == 0)
+        h = 1; // 0 means not yet computed
+    if ((data->type == JSON_TYPE_ARRAY || data->type == JSON_TYPE_MAP) &&
+        data->hashed_at != HASHED_FOREVER)
+        {
+        uint64_t changes = ((JSON *)PoolOwner(data))->changes;
+        if (changes >= HASHED_FOREVER)
+            return h; // too many to stamp with, so left uncached
+        data->hashed_at = (uint32_t)changes;
+        }
+    data->hash = h;
+    return h;
+    }
+
+static JSON_DATA *find_member(MAP_NODE *node, const char *key,
+                              size_t length)
+    {
+    for (; node; node = node->next)
+        if (node->key_length == length && !memcmp(node->key, key, length))
+            return node->data;
+    return NULL;
+    }
+
+static bool equal_maps(JSON_DATA *a, JSON_DATA *b)
+    {
+    if ((a->overlay && !overlay_flatten(a)) ||
+        (b->overlay && !overlay_flatten(b)))
+        return false;
+    if (a->length != b->length)
+        return false;
+    // Members usually come in the same order, so try b's member at the
+    // same position before searching b for the key
+    MAP_NODE *same = b->data.map;
+    for (MAP_NODE *node = a->data.map; node; node = node->next)
+        {
+        JSON_DATA *other;
+        if (same && same->key_length == node->key_length &&
+            !memcmp(same->key, node->key, node->key_length))
+            other = same->data;
+        else if (!(other = find_member(b->data.map, node->key,
+                                       node->key_length)))
+            return false;
+        if (!json_equal(node->data, other))
+            return false;
+        if (same)
+            same = same->next;
+        }
+    return true;
+    }
+
+bool json_equal(JSON_DATA *a, JSON_DATA *b)
+    {
+    if (a == b)
+        return true;
+    if (a->type != b->type || json_hash(a) != json_hash(b))
+        return false;
+
+    switch (a->type)
+        {
+    case JSON_TYPE_NULL:
+        return true;
+    case JSON_TYPE_BOOLEAN:
+        return json_inline_boolean(a) == json_inline_boolean(b);
+    case JSON_TYPE_NUMBER:
+        return json_inline_number(a) == json_inline_number(b);
+    case JSON_TYPE_STRING:
+        return a->length == b->length &&
+               !memcmp(a->data.string, b->data.string, a->length);
+    case JSON_TYPE_ARRAY:
+        {
+        ARRAY *x = a->data.array;
+        ARRAY *y = b->data.array;
+        if (x->next != y->next)
+            return false;
+        for (size_t i = 0; i < x->next; ++i)
+            if (!json_equal(x->array[i], y->array[i]))
+                return false;
+        return true;
+        }
+    case JSON_TYPE_MAP:
+        return equal_maps(a, b);
+        }
+    return false;
+    }
@@ -0,0 +1,376 @@
+//  index.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Hash indexes from the value found under each element of an array to
+//  the elements. Values are hashed and compared with json_hash and
+//  json_equal, so "1" and 1 differ but 1 and 1.0 don't. Slots are open
+//  addressed, and each value's elements are stored contiguously so a
+//  lookup hands them back without copying. Changing the array or a
+//  container an index read under its elements outdates its indexes,
+//  which are filled again when next used. A document that can change
+//  records those containers in an open addressed table from each to
+//  the arrays whose indexes read it.
+
+#include "json.h"
+#include "json_node.h"
+#include "index.h"
+#include "dtoa.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_SLOTS 8
+
+typedef struct WATCH WATCH;
+
+struct WATCH
+    {
+    const JSON_DATA *container; // NULL if the slot is empty
+    ARRAY *array; // one whose indexes read it
+    };
+
+struct WATCHES
+    {
+    size_t used;
+    size_t mask; // slots - 1, a power of 2 less 1
+    WATCH *slots;
+    };
+
+typedef struct WATCHER WATCHER;
+
+struct WATCHER
+    {
+    JSON *json; // NULL if the document can't change
+    ARRAY *array;
+    bool failed; // to record a read, which outdates nothing then
+    };
+
+static size_t home(const WATCHES *watches, const JSON_DATA *container)
+    {
+    uint64_t h = (uintptr_t)container * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h ^ h >> 29) & watches->mask;
+    }
+
+static void enter_watch(WATCHES *watches, const JSON_DATA *container,
+                        ARRAY *array)
+    // Enters the pair unless it's in already. The table must have room.
+    {
+    for (size_t i = home(watches, container);; i = (i + 1) & watches->mask)
+        {
+        WATCH *slot = &watches->slots[i];
+        if (!slot->container)
+            {
+            slot->container = container;
+            slot->array = array;
+            ++watches->used;
+            return;
+            }
+        if (slot->container == container && slot->array == array)
+            return;
+        }
+    }
+
+static bool watch(JSON *json, const JSON_DATA *container, ARRAY *array)
+    // Records that the array's indexes read the container
+    {
+    WATCHES *watches = json->watches;
+    if (!watches &&
+        !(watches = json->watches = (WATCHES *)calloc(1, sizeof(WATCHES))))
+        return false;
+    size_t slots = watches->slots ? watches->mask + 1 : 0;
+    if ((watches->used + 1) * 2 > slots) // at most half full
+        {
+        size_t size = slots ? slots * 2 : MIN_SLOTS;
+        WATCH *bigger = (WATCH *)calloc(size, sizeof(WATCH));
+        if (!bigger)
+            return false;
+        WATCH *old = watches->slots;
+        watches->slots = bigger;
+        watches->mask = size - 1;
+        watches->used = 0;
+        for (size_t i = 0; i < slots; ++i)
+            if (old[i].container)
+                enter_watch(watches, old[i].container, old[i].array);
+        free(old);
+        }
+    enter_watch(watches, container, array);
+    return true;
+    }
+
+static void unwatch(WATCHES *watches, size_t i)
+    // Empties slot i, moving back entries that probed past it
+    {
+    for (size_t j = (i + 1) & watches->mask; watches->slots[j].container;
+         j = (j + 1) & watches->mask)
+        {
+        size_t start = home(watches, watches->slots[j].container);
+        // Entries whose probe starts after i (cyclically) stay put
+        if (i < j ? i < start && start <= j : i < start || start <= j)
+            continue;
+        watches->slots[i] = watches->slots[j];
+        i = j;
+        }
+    watches->slots[i].container = NULL;
+    --watches->used;
+    }
+
+void index_changed(JSON *json, JSON_DATA *container)
+    {
+    if (container->type == JSON_TYPE_ARRAY)
+        ++container->data.array->changes;
+    WATCHES *watches = json->watches;
+    if (!watches || !watches->used)
+        return;
+    for (size_t i = home(watches, container); watches->slots[i].container;
+         i = (i + 1) & watches->mask)
+        if (watches->slots[i].container == container)
+            ++watches->slots[i].array->changes;
+    }
+
+void index_forget(JSON *json, JSON_DATA *container)
+    {
+    WATCHES *watches = json->watches;
+    if (!watches || !watches->used)
+        return;
+    size_t i = home(watches, container);
+    while (watches->slots[i].container)
+        if (watches->slots[i].container == container)
+            unwatch(watches, i); // which may move another entry to i
+        else
+            i = (i + 1) & watches->mask;
+    if (container->type != JSON_TYPE_ARRAY ||
+        !container->data.array->indexes)
+        return;
+    // Entries only move back into slot i or ones not yet reached, or
+    // else from ones already passed, so one pass finds all the array's
+    ARRAY *array = container->data.array;
+    for (i = 0; i <= watches->mask; )
+        if (watches->slots[i].container && watches->slots[i].array == array)
+            unwatch(watches, i);
+        else
+            ++i;
+    }
+
+void index_forget_all(JSON *json)
+    {
+    if (json->watches)
+        free(json->watches->slots);
+    free(json->watches);
+    json->watches = NULL;
+    }
+
+static void look(JSON_DATA *container, void *context)
+    {
+    WATCHER *watcher = (WATCHER *)context;
+    if (watcher->json && !watcher->failed &&
+        !watch(watcher->json, container, watcher->array))
+        watcher->failed = true;
+    }
+
+static void look_under(JSON_DATA *data, WATCHER *watcher)
+    // Records reads of the value's containers, all of which its json_hash
+    // and json_equal read
+    {
+    if (data->type == JSON_TYPE_MAP)
+        {
+        look(data, watcher);
+        for (MAP_NODE *member = data->data.map; member; member = member->next)
+            look_under(member->data, watcher);
+        }
+    else if (data->type == JSON_TYPE_ARRAY)
+        {
+        look(data, watcher);
+        for (size_t i = 0; i < data->data.array->next; ++i)
+            look_under(data->data.array->array[i], watcher);
+        }
+    }
+
+void index_destroy(JSON_INDEX *doomed)
+    {
+    while (doomed)
+        {
+        JSON_INDEX *next = doomed->next;
+        free(doomed->key_path);
+        free(doomed->slots);
+        free(doomed->elements);
+        free(doomed);
+        doomed = next;
+        }
+    }
+
+static INDEX_SLOT *find_slot(const JSON_INDEX *index, JSON_DATA *value)
+    // The value's slot, or the empty one where it would go
+    {
+    uint64_t hash = json_hash(value);
+    size_t i = hash & index->mask;
+    for (;; i = (i + 1) & index->mask)
+        {
+        INDEX_SLOT *slot = &index->slots[i];
+        if (!slot->value ||
+            (slot->hash == hash && json_equal(slot->value, value)))
+            return slot;
+        }
+    }
+
+static bool fill(JSON_INDEX *index, const JSON_QUERY *query)
+    {
+    ARRAY *array = index->array;
+    size_t n = array->next;
+    size_t slots = MIN_SLOTS;
+    while (slots < n * 2) // at most half full
+        slots *= 2;
+    index->mask = slots - 1;
+    index->slots = (INDEX_SLOT *)calloc(slots, sizeof(INDEX_SLOT));
+    INDEX_SLOT **slot_of = (INDEX_SLOT **)malloc(n * sizeof(INDEX_SLOT *) + 1);
+    if (!index->slots || !slot_of)
+        {
+        free(slot_of);
+        return false;
+        }
+
+    // Count the elements for each value, then give each value its run
+    // of the elements and place them in order
+    JSON *json = array->json;
+    WATCHER watcher = { json && !json->arena && !json->view ? json : NULL,
+                        array, false };
+    size_t indexed = 0;
+    for (size_t i = 0; i < n; ++i)
+        {
+        JSON_DATA *value = query ? query_trace(array->array[i], query,
+                                               look, &watcher) :
+                                   array->array[i];
+        slot_of[i] = NULL;
+        if (!value)
+            continue;
+        if (watcher.json)
+            look_under(value, &watcher);
+        INDEX_SLOT *slot = find_slot(index, value);
+        if (!slot->value)
+            {
+            slot->value = value;
+            slot->hash = json_hash(value);
+            }
+        ++slot->count;
+        slot_of[i] = slot;
+        ++indexed;
+        }
+    size_t first = 0;
+    for (size_t i = 0; i < slots; ++i)
+        {
+        index->slots[i].first = first;
+        first += index->slots[i].count;
+        index->slots[i].count = 0;
+        }
+    index->elements = (JSON_DATA **)malloc(indexed * sizeof(JSON_DATA *) + 1);
+    if (!index->elements)
+        {
+        free(slot_of);
+        return false;
+        }
+    for (size_t i = 0; i < n; ++i)
+        if (slot_of[i])
+            {
+            INDEX_SLOT *slot = slot_of[i];
+            index->elements[slot->first + slot->count++] = array->array[i];
+            }
+    free(slot_of);
+    if (watcher.failed)
+        return false; // left outdated, so it's filled again
+    index->changes = array->changes;
+    return true;
+    }
+
+static bool refill(JSON_INDEX *index)
+    // Fills an index in again if what it read has changed since, which
+    // is tried again on the next use if it fails
+    {
+    ARRAY *array = index->array;
+    if (array->changes == index->changes)
+        return true;
+    free(index->slots);
+    free(index->elements);
+    index->slots = NULL;
+    index->elements = NULL;
+    JSON_QUERY *query = NULL;
+    if (index->key_path && !(query = json_query_compile(index->key_path)))
+        return false;
+    bool filled = fill(index, query);
+    if (query)
+        json_query_destroy(query);
+    return filled;
+    }
+
+JSON_INDEX *json_index_build(JSON_DATA *data, const char *key_path)
+    {
+    if (data->type != JSON_TYPE_ARRAY)
+        return NULL;
+    ARRAY *array = data->data.array;
+    for (JSON_INDEX *index = array->indexes; index; index = index->next)
+        if (key_path ? index->key_path && !strcmp(index->key_path, key_path) :
+                       !index->key_path)
+            return refill(index) ? index : NULL;
+
+    JSON_INDEX *index = (JSON_INDEX *)calloc(1, sizeof(JSON_INDEX));
+    JSON_QUERY *query = NULL;
+    if (index)
+        index->array = array;
+    if (!index ||
+        (key_path && (!(index->key_path = strdup(key_path)) ||
+                      !(query = json_query_compile(key_path)))) ||
+        !fill(index, query))
+        {
+        if (query)
+            json_query_destroy(query);
+        if (index)
+            index_destroy(index);
+        return NULL;
+        }
+    if (query)
+        json_query_destroy(query);
+    if (!array->indexes && array->json && array->json->arena)
+        {
+        // An arena frees its nodes all at once, so its document lists
+        // just the arrays with indexes to free
+        array->older = array->json->arrays;
+        array->json->arrays = array;
+        }
+    index->next = array->indexes;
+    array->indexes = index;
+    return index;
+    }
+
+size_t json_index_lookup(const JSON_INDEX *index, JSON_DATA *value,
+                         JSON_DATA ***elements)
+    {
+    if (!refill((JSON_INDEX *)index)) // const to callers, it's a cache
+        return 0;
+    INDEX_SLOT *slot = find_slot(index, value);
+    if (!slot->value)
+        return 0;
+    *elements = index->elements + slot->first;
+    return slot->count;
+    }
+
+size_t json_index_lookup_string(const JSON_INDEX *index, const char *string,
+                                size_t length, JSON_DATA ***elements)
+    {
+    JSON_DATA value = { JSON_TYPE_STRING };
+    value.data.string = (char *)string; // only read
+    value.length = length;
+    return json_index_lookup(index, &value, elements);
+    }
+
+size_t json_index_lookup_number(const JSON_INDEX *index, double number,
+                                JSON_DATA ***elements)
+    {
+    if (!isfinite(number))
+        return 0; // JSON has no such numbers
+    char text[DTOA_SIZE]; // the token text numbers are read from
+    JSON_DATA value = { JSON_TYPE_NUMBER };
+    value.data.string = text;
+    value.length = dtoa(number, text);
+    return json_index_lookup(index, &value, elements);
+    }
@@ -0,0 +1,57 @@
+//  index.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Value indexes (see json_index_build) as the rest of the library sees
+//  them: each array keeps a list of its indexes, freed with it. An index
+//  remembers its array's count of changes when it was filled, and is
+//  filled again before use once that count moves on. The builder moves
+//  it on for changes to the array itself, and to the containers under
+//  its elements that the indexes read, which their document records.
+
+#ifndef __mmijson_index_h
+#define __mmijson_index_h
+
+#include "json.h"
+
+typedef struct INDEX_SLOT INDEX_SLOT;
+
+struct INDEX_SLOT
+    {
+    uint64_t hash;
+    JSON_DATA *value; // NULL if the slot is empty
+    size_t first; // the value's elements are elements[first...]
+    size_t count;
+    };
+
+struct JSON_INDEX
+    {
+    JSON_INDEX *next; // the array's next index
+    char *key_path; // NULL for the elements themselves
+    size_t mask; // slots - 1, a power of 2 less 1
+    INDEX_SLOT *slots;
+    JSON_DATA **elements; // grouped by value, in array order within each
+    struct ARRAY *array; // the one indexed
+    uint64_t changes; // the array's when filled
+    };
+
+void index_destroy(JSON_INDEX *);
+// Frees the index and all those after it.
+
+void index_changed(JSON *, JSON_DATA *container);
+// Outdates the indexes that read the container, which the builder has
+// just changed, and the container's own if it's an array.
+
+void index_forget(JSON *, JSON_DATA *container);
+// Stops recording reads of a container about to be freed and, for an
+// array, what its indexes read.
+
+void index_forget_all(JSON *);
+// Frees the document's record of what its indexes read.
+
+JSON_DATA *query_trace(JSON_DATA *, const JSON_QUERY *,
+                       void (*look)(JSON_DATA *, void *), void *context);
+// As json_query_get, first handing look each container it looks in.
+
+#endif
@@ -4,166 +4,220 @@
 //  This code is licensed under MIT license (see LICENSE for details)
 
 #include "json.h"
+#include "json_node.h"
+#include "json_inline.h"
 #include "pool.h"
+#include "profile.h"
+#include "shape.h"
+#include "index.h"
+#include "parse.h"
+#include "build.h"
+#include "overlay.h"
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <math.h> // NAN
+#include <time.h>
 
-#define BUF_INC 1024
-#define ARRAY_INC 2 
+#define BUF_START 1024
+#define ARRAY_START 4
 #define QUERY_DELIM ','
 #define NOT_CHAR 10000
+#define DEADLINE_INTERVAL 1023 // check the clock every 1024 values
+#define NO_END ((const char *)UINTPTR_MAX)
+#define READ_ONLY(json) ((json)->end != NO_END)
 
-typedef struct MAP_NODE MAP_NODE;
-typedef struct ARRAY ARRAY;
-
-
-struct JSON_DATA
+enum
     {
-    enum { map, array, string, number, boolean, null } type;
-    union
-        {
-        char *string;
-        MAP_NODE *map;
-        ARRAY *array;
-        } data;
+    none = JSON_OK, bad_map = JSON_BAD_MAP, bad_array = JSON_BAD_ARRAY, 
+    bad_string = JSON_BAD_STRING, bad_number = JSON_BAD_NUMBER, 
+    bad_boolean = JSON_BAD_BOOLEAN, bad_null = JSON_BAD_NULL, 
+    bad_trailing = JSON_BAD_TRAILING, too_deep = JSON_TOO_DEEP, 
+    too_many_nodes = JSON_TOO_MANY_NODES, 
+    string_too_long = JSON_STRING_TOO_LONG, too_big = JSON_TOO_BIG,
+    timed_out = JSON_TIMED_OUT, no_memory = JSON_NO_MEMORY
     };
 
-struct JSON
-    {
-    enum { none = 0, bad_map, bad_array, bad_string, bad_number, 
-           bad_boolean, bad_null } error;
-    Pool *data_pool;
-    Pool *map_pool;
-    Pool *array_pool;
-    JSON_DATA *data;
-    char *token;
-    int char_ahead;
-    char *work_buffer;
-    char *p;
-    char *buffer;
-    };
+static char true_text[] = "true";
+static char false_text[] = "false";
+static char null_text[] = "null";
 
 
+static uint64_t now_ns(void)
+    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
 static char jgetc(JSON *json)
+    // Read-only input has no terminating NUL, so reads at and past its
+    // end give one (still advancing, as callers step back over it)
     {
     if (json->char_ahead == NOT_CHAR)
+        {
+        if (json->p >= json->end)
+            {
+            ++json->p;
+            return '\0';
+            }
         return *json->p++;
+        }
     char rval = json->char_ahead;
     json->char_ahead = NOT_CHAR;
     return rval;
     }
 
 
-static JSON_DATA *create_data_boolean(JSON *json)
+static JSON_DATA *create_data(JSON *json, enum JSON_TYPE type)
     {
     JSON_DATA *data = PoolAlloc(json->data_pool);
-    data->type = boolean;
-    data->data.string = json->token;
+    data->type = type;
+    data->refs = 1; // parsed values are in one place, or the root
+    data->built = 0;
+    data->overlay = 0;
+    data->hash = 0;
+    return data;
+    }
+
+static JSON_DATA *create_data_boolean(JSON *json)
+    {
+    JSON_DATA *data = create_data(json, JSON_TYPE_BOOLEAN);
+    PROFILE_COUNT(booleans, 1);
+    data->data.string = json->token[0] == 't' ? true_text : false_text;
     return data;
     }
 
 static JSON_DATA *create_data_null(JSON *json)
     {
-    JSON_DATA *data = PoolAlloc(json->data_pool);
-    data->type = null;
-    data->data.string = json->token;
+    JSON_DATA *data = create_data(json, JSON_TYPE_NULL);
+    PROFILE_COUNT(nulls, 1);
+    data->data.string = null_text;
     return data;
     }
 
 static JSON_DATA *create_data_string(JSON *json)
     {
-    JSON_DATA *data = PoolAlloc(json->data_pool);
-    data->type = string;
+    JSON_DATA *data = create_data(json, JSON_TYPE_STRING);
+    PROFILE_COUNT(strings, 1);
     data->data.string = json->token;
+    data->length = json->token_length;
     return data;
     }
 
 static JSON_DATA *create_data_number(JSON *json)
     {
-    JSON_DATA *data = PoolAlloc(json->data_pool);
-    data->type = number;
+    JSON_DATA *data = create_data(json, JSON_TYPE_NUMBER);
+    PROFILE_COUNT(numbers, 1);
     data->data.string = json->token;
+    data->length = json->token_length;
     return data;
     }
 
-struct MAP_NODE
-    {
-    char *key;
-    JSON_DATA *data;
-    MAP_NODE *next;
-    };
-
 static JSON_DATA *create_data_map(JSON *json)
     {
-    JSON_DATA *data = PoolAlloc(json->data_pool);
-    data->type = map;
+    JSON_DATA *data = create_data(json, JSON_TYPE_MAP);
+    PROFILE_COUNT(objects, 1);
     data->data.map = NULL;
+    data->length = 0;
     return data;
     }
 
 static int skip_whitespace(JSON *json)
     {
     char c;
+    PROFILE_START(start);
     while ((isspace(c = jgetc(json))))
         ;
+    PROFILE_STOP(time_whitespace, start);
     return c;
     }
 
-static void put_data_map(JSON *json, JSON_DATA *map, char *key, JSON_DATA *data)
+static MAP_NODE *put_data_map(JSON *json, JSON_DATA *map, char *key, 
+                              size_t key_length, JSON_DATA *data)
+    // Returns the new member, or NULL if key replaced an existing one's
+    // value
     {
+    MAP_NODE *added = NULL;
+    PROFILE_START(start);
     if (!map->data.map)
         {
-        map->data.map = PoolAlloc(json->map_pool);
+        added = map->data.map = PoolAlloc(json->map_pool);
         map->data.map->key = key;
+        map->data.map->key_length = key_length;
         map->data.map->data = data;
         map->data.map->next = NULL;
+        ++map->length;
         }
     else
         {
         MAP_NODE *p = map->data.map;
         while (true)
             {
-            if (strcmp(p->key, key))
+            if (p->key_length != key_length || 
+                memcmp(p->key, key, key_length))
                 {
                 if (p->next)
                     p = p->next;
                 else
                     {
-                    p->next = PoolAlloc(json->map_pool);
+                    added = p->next = PoolAlloc(json->map_pool);
                     p->next->key = key;
+                    p->next->key_length = key_length;
                     p->next->data = data;
                     p->next->next = NULL;
+                    ++map->length;
                     break;
                     }
                 }
             else
                 {
-                p->data = data;
+                p->data = data; // last one wins
                 break;
                 }
             }
         }
+    PROFILE_STOP(time_map_insert, start);
+    return added;
     }
 
-
-struct ARRAY
+static MAP_NODE *append_data_map(JSON *json, JSON_DATA *map, MAP_NODE *last,
+                                 char *key, size_t key_length,
+                                 JSON_DATA *data)
+    // put_data_map for a key known to be new, after the last member
     {
-    JSON_DATA **array;
-    size_t size;
-    size_t next;
-    };
+    MAP_NODE *added = PoolAlloc(json->map_pool);
+    added->key = key;
+    added->key_length = key_length;
+    added->data = data;
+    added->next = NULL;
+    if (last)
+        last->next = added;
+    else
+        map->data.map = added;
+    ++map->length;
+    return added;
+    }
+
 
 static JSON_DATA *create_data_array(JSON *json)
     {
-    JSON_DATA *data = PoolAlloc(json->data_pool);
-    data->type = array;
+    JSON_DATA *data = create_data(json, JSON_TYPE_ARRAY);
+    PROFILE_COUNT(arrays, 1);
     data->data.array = PoolAlloc(json->array_pool);
-    data->data.array->size = ARRAY_INC;
+    data->data.array->size = ARRAY_START;
     data->data.array->next = 0;
+    data->data.array->indexes = NULL;
+    data->data.array->changes = 0;
     data->data.array->array = 
         calloc(data->data.array->size, sizeof(JSON_DATA *));
+    // Listed so the document frees it whether it ends up in the tree
+    // or not
+    data->data.array->older = json->arrays;
+    data->data.array->newer = NULL;
+    if (json->arrays)
+        json->arrays->newer = data->data.array;
+    data->data.array->json = json;
+    json->arrays = data->data.array;
     return data;
     }
 
@@ -172,32 +226,59 @@ static void put_data_array(ARRAY *array, JSON_DATA *data)
     array->array[array->next] = data;
     if (array->size == ++array->next)
         {
-        array->size += ARRAY_INC;
+        // Doubling keeps appending n elements O(n)
+        PROFILE_COUNT(array_reallocs, 1);
+        array->size *= 2;
         array->array = realloc(array->array, array->size * sizeof(JSON_DATA *));
-        for (int i = array->next; i < array->size; ++i)
-            array->array[i] = NULL;
+        memset(array->array + array->next, 0,
+               (array->size - array->next) * sizeof(JSON_DATA *));
         }
     }
 
-static JSON *create_json(void)
+static void init_json(JSON *json)
+    // Everything but the pools
     {
-    JSON *json = malloc(sizeof(JSON));
     json->error = none;
-    json->data_pool = PoolCreate(sizeof(JSON_DATA));
-    json->map_pool = PoolCreate(sizeof(MAP_NODE));
-    json->array_pool = PoolCreate(sizeof(ARRAY));
     json->data = NULL;
+    json->end = NO_END;
     json->buffer = NULL;
+    json->decoded = NULL;
     json->work_buffer = NULL;
+    json->work_end = NULL;
     json->char_ahead = NOT_CHAR;
     json->token = NULL;
+    json->depth = 0;
+    json->nodes = 0;
+    json->max_depth = SIZE_MAX;
+    json->max_nodes = SIZE_MAX;
+    json->max_string_length = SIZE_MAX;
+    json->deadline = 0;
+    json->shapes = NULL;
+    json->arrays = NULL;
+    json->built = NULL;
+    json->changes = 0;
+    json->watches = NULL;
+    json->view = false;
+    json->overlays = NULL;
+    json->arena = NULL;
+    }
 
+static JSON *create_json(void)
+    {
+    JSON *json = malloc(sizeof(JSON));
+    json->data_pool = PoolCreate(sizeof(JSON_DATA));
+    PoolSetOwner(json->data_pool, json); // see cached_hash
+    json->map_pool = PoolCreate(sizeof(MAP_NODE));
+    json->array_pool = PoolCreate(sizeof(ARRAY));
+    init_json(json);
     return json;
     }
 
 
 static void terminate_token(JSON *json)
     {
+    if (READ_ONLY(json))
+        return; // tokens are known by their lengths alone
     json->char_ahead = *json->p;
     *json->p = '\0';
     ++json->p;
@@ -205,20 +286,203 @@ static void terminate_token(JSON *json)
 
 static void init_work_buffer(JSON *json)
     {
-    json->token = json->work_buffer = json->p - 1;
+    json->token = json->p - 1;
+    if (!READ_ONLY(json))
+        json->work_buffer = json->token;
+    }
+
+#define DECODED_START 256 // bytes in the first chunk of decoded text
+
+struct DECODED
+    {
+    DECODED *older;
+    char text[];
+    };
+
+static bool new_chunk(JSON *json, size_t length)
+    // Read-only input: moves work_buffer to a new chunk of decoded text
+    // with room for at least length bytes. Each chunk is twice the size
+    // of the one before, so decoding n bytes in all takes O(n) time and
+    // memory, however the input is laid out.
+    {
+    size_t size = DECODED_START;
+    if (json->decoded)
+        size = 2 * (json->work_end - json->decoded->text);
+    while (size < length)
+        size *= 2;
+    DECODED *chunk = (DECODED *)malloc(sizeof(DECODED) + size);
+    if (!chunk)
+        {
+        json->error = no_memory;
+        return false;
+        }
+    chunk->older = json->decoded;
+    json->decoded = chunk;
+    json->work_buffer = chunk->text;
+    json->work_end = chunk->text + size;
+    return true;
+    }
+
+static char *own_text(JSON *json, size_t length)
+    // Read-only input: where to put length bytes of text that can't be
+    // referenced in place; the caller moves work_buffer past them
+    {
+    if ((size_t)(json->work_end - json->work_buffer) < length &&
+        !new_chunk(json, length))
+        return NULL;
+    return json->work_buffer;
+    }
+
+static bool move_token(JSON *json)
+    // Read-only input, out of room while decoding a string: carries on
+    // in a new chunk, taking what's been decoded so far along
+    {
+    char *token = json->token;
+    size_t length = json->work_buffer - token;
+    if (!new_chunk(json, length + 1))
+        return false;
+    memcpy(json->work_buffer, token, length);
+    json->token = json->work_buffer;
+    json->work_buffer += length;
+    return true;
+    }
+
+static void free_decoded(JSON *json)
+    {
+    while (json->decoded)
+        {
+        DECODED *older = json->decoded->older;
+        free(json->decoded);
+        json->decoded = older;
+        }
+    }
+
+static bool scan_plain_string(JSON *json)
+    // Read-only input, called after the opening quote: takes a string
+    // without escapes where it is, returning true when it's done. At
+    // the first backslash the part already scanned is copied to
+    // document memory and false returned to carry on decoding there.
+    {
+    const char *start = json->p;
+    const char *end = json->end;
+    if ((size_t)(end - start) > json->max_string_length)
+        end = start + json->max_string_length + 1; // enough to tell
+    for (const char *p = start; p < end; ++p)
+        {
+        if (*p == '"')
+            {
+            json->token = (char *)start;
+            json->token_length = p - start;
+            json->p = (char *)p + 1;
+            return true;
+            }
+        if (*p == '\\')
+            {
+            json->p = (char *)p;
+            if ((json->token = own_text(json, p - start)))
+                {
+                memcpy(json->token, start, p - start);
+                json->work_buffer += p - start;
+                }
+            return false;
+            }
+        if (iscntrl((unsigned char)*p))
+            {
+            end = json->end;
+            break;
+            }
+        }
+    json->error = end == json->end ? bad_string : string_too_long;
+    return false;
     }
 
 static void putc_work_buffer(JSON *json, char c)
     {
+    // work_end is NULL in place, so only read-only input runs out
+    if (json->work_buffer == json->work_end && !move_token(json))
+        return;
     *json->work_buffer++ = c;
     }
 
+static int parse_hex4(JSON *json)
+    {
+    int value = 0;
+    for (int i = 0; i < 4; ++i)
+        {
+        int c = jgetc(json);
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            value |= c - 'A' + 10;
+        else
+            return -1;
+        }
+    return value;
+    }
+
+static int parse_unicode_escape(JSON *json)
+    // Called after "\u". Decodes the escape (and the low half of a
+    // surrogate pair) as UTF-8 into the work buffer. The encoding is
+    // never longer than the escape, so this is safe in place. \u0000
+    // becomes an embedded NUL, which is why strings carry lengths.
+    {
+    long code = parse_hex4(json);
+    if (code >= 0xDC00 && code <= 0xDFFF)
+        return -1; // unpaired low surrogate
+    if (code >= 0xD800 && code <= 0xDBFF)
+        {
+        if (jgetc(json) != '\\' || jgetc(json) != 'u')
+            return -1;
+        long low = parse_hex4(json);
+        if (low < 0xDC00 || low > 0xDFFF)
+            return -1;
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        }
+    if (code < 0)
+        return -1;
+
+    if (code < 0x80)
+        putc_work_buffer(json, code);
+    else if (code < 0x800)
+        {
+        putc_work_buffer(json, 0xC0 | (code >> 6));
+        putc_work_buffer(json, 0x80 | (code & 0x3F));
+        }
+    else if (code < 0x10000)
+        {
+        putc_work_buffer(json, 0xE0 | (code >> 12));
+        putc_work_buffer(json, 0x80 | ((code >> 6) & 0x3F));
+        putc_work_buffer(json, 0x80 | (code & 0x3F));
+        }
+    else
+        {
+        putc_work_buffer(json, 0xF0 | (code >> 18));
+        putc_work_buffer(json, 0x80 | ((code >> 12) & 0x3F));
+        putc_work_buffer(json, 0x80 | ((code >> 6) & 0x3F));
+        putc_work_buffer(json, 0x80 | (code & 0x3F));
+        }
+    return 0;
+    }
+
 static int parse_string(JSON *json)
     {
-    int c;
+    int c = '"';
+    PROFILE_START(start);
     init_work_buffer(json);
+    if (READ_ONLY(json) && (scan_plain_string(json) || json->error))
+        goto done;
     while ((c = jgetc(json)) != '\0')
         {
+        // Stop as soon as the string is too long, not after it
+        if ((size_t)(json->work_buffer - json->token) >
+            json->max_string_length)
+            {
+            json->error = string_too_long;
+            break;
+            }
         if (c == '\\')
             {
             c = jgetc(json);
@@ -243,6 +507,13 @@ static int parse_string(JSON *json)
             case 't':
                 c = '\t';
                 break;
+            case 'u':
+                if (parse_unicode_escape(json))
+                    {
+                    json->error = bad_string;
+                    break;
+                    }
+                continue;
             default:
                 json->error = bad_string;
                 break;
@@ -258,54 +529,88 @@ static int parse_string(JSON *json)
         putc_work_buffer(json, c);
         }
 
-    if (c != '"')
+    if (c != '"' && !json->error)
         json->error = bad_string;
-    else
+    if (!json->error)
+        {
+        json->token_length = json->work_buffer - json->token;
         putc_work_buffer(json, 0);
+        }
+done:
+    PROFILE_STOP(time_strings, start);
     return json->error ? -1 : 0;
     }
 
+static int skip_digits(JSON *json, int *c)
+    // At least one digit, leaving *c at the first non-digit
+    {
+    if (!isdigit(*c))
+        return -1;
+    while (isdigit(*c = jgetc(json)))
+        ;
+    return 0;
+    }
+
 static int parse_number(int c, JSON *json)
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
     {
-    bool is_dotted = false;
-    if (c == '-' || isdigit(c))
+    int rval = 0;
+    PROFILE_START(start);
+    if (c == '-')
+        c = jgetc(json);
+    if (c == '0')
+        c = jgetc(json);
+    else
+        rval = skip_digits(json, &c);
+    if (!rval && c == '.')
+        {
+        c = jgetc(json);
+        rval = skip_digits(json, &c);
+        }
+    if (!rval && (c == 'e' || c == 'E'))
         {
-        while ((c = jgetc(json)) != '\0')
+        c = jgetc(json);
+        if (c == '+' || c == '-')
+            c = jgetc(json);
+        rval = skip_digits(json, &c);
+        }
+    if (rval)
+        json->error = bad_number;
+    else
+        {
+        --json->p; // back to the character after the number
+        json->token_length = json->p - json->token;
+        if (READ_ONLY(json) && json->p == json->end)
             {
-            if (c == '.')
+            // Nothing after it to stop atof, so it needs its own copy
+            char *copy = own_text(json, json->token_length + 1);
+            if (copy)
                 {
-                if (is_dotted)
-                    {
-                    json->error = bad_number;
-                    return -1;
-                    }
-                else
-                    is_dotted = true;
-                }
-            else if (!isdigit(c))
-                {
-                --json->p;
-                break;
+                memcpy(copy, json->token, json->token_length);
+                copy[json->token_length] = '\0';
+                json->token = copy;
+                json->work_buffer += json->token_length + 1;
                 }
+            else
+                rval = -1;
             }
         terminate_token(json);
-        return 0;
         }
-    json->error = bad_number;
-    return -1;
+    PROFILE_STOP(time_numbers, start);
+    return rval;
     }
 
-static int parse_boolean(JSON *json)
+static int parse_boolean(char first, JSON *json)
     {
     char c;
-    if ((c =jgetc(json)) == 'r')
+    if ((c =jgetc(json)) == 'r' && first == 't')
         if (jgetc(json) == 'u')
             if (jgetc(json) == 'e')
                 {
                 terminate_token(json);
                 return 0;
                 }
-    if (c == 'a')
+    if (c == 'a' && first == 'f')
         if (jgetc(json) == 'l')
             if (jgetc(json) == 's')
                 if (jgetc(json) == 'e')
@@ -334,18 +639,50 @@ static int parse_null(JSON *json)
 static int parse_into_map(JSON_DATA *map, JSON *json);
 static int parse_into_array(ARRAY *array, JSON *json);
 
+static bool charge_node(JSON *json)
+    // Budget checks, run once per value. With no limits set they come
+    // down to two compares against SIZE_MAX and one bit test.
+    {
+    if (++json->nodes > json->max_nodes)
+        {
+        json->error = too_many_nodes;
+        return false;
+        }
+    if (json->deadline && (json->nodes & DEADLINE_INTERVAL) == 0 && 
+        now_ns() > json->deadline)
+        {
+        json->error = timed_out;
+        return false;
+        }
+    return true;
+    }
+
 static void parse_next_thing(char c, JSON_DATA **data, JSON *json)
     {
+    if (!charge_node(json))
+        return;
     init_work_buffer(json);
     switch (c)
         {
     case '{':
+        if (++json->depth > json->max_depth)
+            {
+            json->error = too_deep;
+            break;
+            }
         *data = create_data_map(json);
         parse_into_map(*data, json);
+        --json->depth;
         break;
     case '[':
+        if (++json->depth > json->max_depth)
+            {
+            json->error = too_deep;
+            break;
+            }
         *data = create_data_array(json);
         parse_into_array((*data)->data.array, json);
+        --json->depth;
         break;
     case '"':
         if (parse_string(json) == 0)
@@ -353,7 +690,7 @@ static void parse_next_thing(char c, JSON_DATA **data, JSON *json)
         break;
     case 't':
     case 'f':
-        if (parse_boolean(json) == 0)
+        if (parse_boolean(c, json) == 0)
             *data = create_data_boolean(json);
         break;
     case 'n':
@@ -366,116 +703,146 @@ static void parse_next_thing(char c, JSON_DATA **data, JSON *json)
         }
     }
 
+// Elements and members are parsed in a loop rather than by recursion,
+// so only nesting (bounded by max_depth) costs stack.
+
 static int parse_into_array(ARRAY *array, JSON *json)
     {
-    JSON_DATA *data = NULL;
     char c = skip_whitespace(json);
     if (c == ']')
-        {
-        if (array->next > 0)
-            {
-            json->error = bad_array;
-            return -1;
-            }
         return 0;
-        }
-    parse_next_thing(c, &data, json);
-    if (!json->error)
+    while (true)
         {
+        JSON_DATA *data = NULL;
+        parse_next_thing(c, &data, json);
+        if (json->error)
+            break; // data, if any, still goes with the document
         put_data_array(array, data);
         c = skip_whitespace(json);
-        if (c == ',')
-            parse_into_array(array, json); // recursion
-        else if (c != ']')
+        if (c == ']')
+            break;
+        if (c != ',' || (c = skip_whitespace(json)) == ']')
+            {
             json->error = bad_array;
+            break;
+            }
         }
     return json->error ? -1 : 0;
     }
 
+static bool match_key(JSON *json, const SHAPE *shape)
+    // Called after a key's opening quote: is it the shape's, byte for
+    // byte? If so it's taken as it is, since learned keys have no
+    // escapes to decode.
+    {
+    char *p = json->p;
+    size_t length = shape->key_length;
+    if (json->char_ahead != NOT_CHAR || length > json->max_string_length)
+        return false;
+    if (READ_ONLY(json))
+        {
+        // Room for the key and its closing quote
+        if ((size_t)(json->end - p) <= length || 
+            memcmp(p, shape->key, length))
+            return false;
+        }
+    else if (strncmp(p, shape->key, length)) // stops at the input's NUL
+        return false;
+    if (p[length] != '"')
+        return false;
+    if (!READ_ONLY(json))
+        p[length] = '\0';
+    json->token = p;
+    json->token_length = length;
+    json->p = p + length + 1;
+    return true;
+    }
+
 static int parse_into_map(JSON_DATA *map, JSON *json)
     {
+    // With a shape cache, the shapes the keys so far lead on to, until
+    // the object leaves what the cache knows
+    SHAPE **shapes = json->shapes ? &json->shapes->first : NULL;
+    MAP_NODE *last = NULL;
     char c = skip_whitespace(json);
-    init_work_buffer(json);
     if (c == '}')
+        return 0;
+    while (true)
         {
-        if (map->data.map)
+        if (c != '"')
             {
-            json->error = bad_map;
-            return -1;
+            json->error = bad_map; // key/string not found
+            break;
             }
-        return 0;
-        }
-    else if (c != '"')
-        json->error = bad_map; // key/string not found
-
-    char *key = json->token;
-    JSON_DATA *data = NULL;
-    if (!json->error && parse_string(json) == 0)
-        {
-        c = skip_whitespace(json);
-        if (c != ':')
+        SHAPE *shape = NULL;
+        const char *raw = json->p;
+        if (shapes && *shapes && match_key(json, *shapes))
+            shape = *shapes;
+        else if (parse_string(json))
+            break;
+        else if (shapes)
+            shape = shape_find(shapes, json->token, json->token_length);
+        char *key = json->token;
+        size_t key_length = json->token_length;
+        bool escaped = (size_t)(json->p - 1 - raw) != key_length;
+        if (skip_whitespace(json) != ':')
+            {
             json->error = bad_map;
+            break;
+            }
+        JSON_DATA *data = NULL;
+        parse_next_thing(skip_whitespace(json), &data, json);
+        if (json->error)
+            break; // data, if any, still goes with the document
+        if (shape)
+            last = append_data_map(json, map, last, key, key_length, data);
         else
             {
-            c = skip_whitespace(json);
-            parse_next_thing(c, &data, json);
+            MAP_NODE *added = put_data_map(json, map, key, key_length, data);
+            if (added)
+                last = added;
+            // Only keys that were new to the object keep a path's keys
+            // all different
+            if (shapes && added && !escaped)
+                shape = shape_add(json->shapes, shapes, key, key_length);
             }
-        }
-    if (!json->error)
-        {
-        put_data_map(json, map, key, data);
+        shapes = shape ? &shape->child : NULL;
         c = skip_whitespace(json);
-        if (c == ',')
-            parse_into_map(map, json); // recursion
-        else if (c != '}')
+        if (c == '}')
+            break;
+        if (c != ',')
+            {
             json->error = bad_map;
+            break;
+            }
+        c = skip_whitespace(json);
         }
-
     return json->error ? -1 : 0;
     }
 
 
-static void recurse_and_destroy_map_node(JSON *, MAP_NODE *);
-static void recurse_and_destroy_array(JSON *, ARRAY *);
-
-static void recurse_and_destroy_data(JSON *json, JSON_DATA *doomed)
-    {
-    if (doomed)
-        {
-        if (doomed->type == map)
-            recurse_and_destroy_map_node(json, doomed->data.map);
-        else if (doomed->type == array)
-            recurse_and_destroy_array(json, doomed->data.array);
-        }
-    }
-
-
-static void recurse_and_destroy_array(JSON *json, ARRAY *doomed)
+static void destroy_arrays(JSON *json)
+    // Every array the document made, in the tree or not: elements
+    // vectors and indexes are all that nodes own outside the pools
     {
-    if (doomed)
+    ARRAY *doomed = json->arrays;
+    while (doomed)
         {
-        for (int i = 0; i < doomed->next; ++i)
-            recurse_and_destroy_data(json, doomed->array[i]);
         free(doomed->array);
+        index_destroy(doomed->indexes);
+        doomed = doomed->older;
         }
-    }
-
-static void recurse_and_destroy_map_node(JSON *json, MAP_NODE *doomed)
-    {
-    if (doomed)
-        {
-        recurse_and_destroy_map_node(json, doomed->next);
-        recurse_and_destroy_data(json, doomed->data);
-        //PoolFree(json->map_pool, doomed);
-        }
+    json->arrays = NULL;
+    index_forget_all(json);
     }
 
 
-static void dump_string(const char *string, FILE *f)
+static void dump_string(const char *string, size_t length, FILE *f)
     {
     fputc('"', f);
     char const *p = string;
-    while (*p)
+    char const *end = string + length;
+    while (p < end)
         {
         switch (*p)
             {
@@ -501,7 +868,10 @@ static void dump_string(const char *string, FILE *f)
             fprintf(f, "\\t");
             break;
         default:
-            fputc(*p, f);
+            if ((unsigned char)*p < 0x20)
+                fprintf(f, "\\u%04x", *p);
+            else
+                fputc(*p, f);
             break;
             }
         ++p; 
@@ -518,14 +888,20 @@ static void dump_data(JSON_DATA *data, FILE *f)
         {
         switch (data->type)
             {
-        case map:
-            dump_map(data->data.map, f);
+        case JSON_TYPE_MAP:
+            // An overlay that can't be laid out reads as empty
+            dump_map(data->overlay && !overlay_flatten(data) ? NULL :
+                                                               data->data.map,
+                     f);
             break;
-        case array:
+        case JSON_TYPE_ARRAY:
             dump_array(data->data.array, f);
             break;
-        case string:
-            dump_string(data->data.string, f);
+        case JSON_TYPE_STRING:
+            dump_string(data->data.string, data->length, f);
+            break;
+        case JSON_TYPE_NUMBER:
+            fwrite(data->data.string, 1, data->length, f);
             break;
         default:
             fprintf(f, "%s", data->data.string);
@@ -549,18 +925,15 @@ static void dump_array(ARRAY *array, FILE *f)
 
 static void dump_map_node(MAP_NODE *node, FILE *f)
     {
-    if (node)
+    for (; node; node = node->next)
         {
-        dump_string(node->key, f);
+        dump_string(node->key, node->key_length, f);
         fputc(':', f);
         dump_data(node->data, f);
         if (node->next)
-            {
             fputc(',', f);
-            dump_map_node(node->next, f); // recursion
-            }
         }
-     }
+    }
 
 static void dump_map(MAP_NODE *map, FILE *f)
     {
@@ -569,60 +942,197 @@ static void dump_map(MAP_NODE *map, FILE *f)
     fputc('}', f);
     }
 
+static void apply_options(JSON *json, const JSON_PARSE_OPTIONS *options)
+    {
+    if (options->max_depth)
+        json->max_depth = options->max_depth;
+    if (options->max_nodes)
+        json->max_nodes = options->max_nodes;
+    if (options->max_string_length)
+        json->max_string_length = options->max_string_length;
+    if (options->timeout_us)
+        json->deadline = now_ns() + options->timeout_us * 1000ull;
+    json->shapes = options->shapes;
+    }
+
+static void parse_document(JSON *json)
+    {
+    char c = skip_whitespace(json);
+    parse_next_thing(c, &(json->data), json);
+    // A NUL inside read-only input isn't its end
+    if (!json->error && (skip_whitespace(json) != '\0' ||
+                         (READ_ONLY(json) && json->p <= json->end)))
+        json->error = bad_trailing;
+    }
+
+static JSON *finish_parse(JSON *json, JSON_ERROR *error)
+    {
+    if (error)
+        *error = json->error;
+    if (json->error)
+        {
+        json_destroy(json);
+        json = NULL;
+        }
+    return json;
+    }
+
 JSON *json_parse_string(char *s, bool should_free)
     {
+    return json_parse_string_opts(s, should_free, NULL, NULL);
+    }
+
+JSON *json_parse_string_opts(char *s, bool should_free, 
+                             const JSON_PARSE_OPTIONS *options,
+                             JSON_ERROR *error)
+    {
+    PROFILE_PARSE_START(profile);
     JSON *json = create_json();
     json->p = s;
     if (should_free)
         json->buffer = s;
     else
         json->buffer = NULL;
+
+    if (options)
+        {
+        apply_options(json, options);
+        if (options->max_total_bytes && 
+            strnlen(s, options->max_total_bytes + 1) > 
+                options->max_total_bytes)
+            json->error = too_big;
+        }
     
-    char c = skip_whitespace(json);
-    parse_next_thing(c, &(json->data), json);
+    if (!json->error)
+        parse_document(json);
+    // A complete parse has read the terminating NUL too
+    PROFILE_PARSE_STOP(profile, json->p - s - !json->error);
+    return finish_parse(json, error);
+    }
+
+JSON *json_parse_buffer(const char *buffer, size_t length)
+    {
+    return json_parse_buffer_opts(buffer, length, NULL, NULL);
+    }
 
-    if (skip_whitespace(json) != '\0' || json->error)
+JSON *json_parse_buffer_opts(const char *buffer, size_t length,
+                             const JSON_PARSE_OPTIONS *options,
+                             JSON_ERROR *error)
+    {
+    JSON *json = create_json();
+    parse_buffer_into(json, buffer, length, options);
+    return finish_parse(json, error);
+    }
+
+JSON *parse_create(void)
+    {
+    return create_json();
+    }
+
+JSON_ERROR parse_buffer_into(JSON *json, const char *buffer, size_t length,
+                             const JSON_PARSE_OPTIONS *options)
+    {
+    PROFILE_PARSE_START(profile);
+    json->p = (char *)buffer; // only ever read through
+    json->end = buffer + length;
+
+    if (options)
         {
-        json_destroy(json);
-        json = NULL;
+        apply_options(json, options);
+        if (options->max_total_bytes && length > options->max_total_bytes)
+            json->error = too_big;
         }
 
-    return json;
+    if (!json->error)
+        parse_document(json);
+    // As for strings, with the NUL past the end standing in
+    PROFILE_PARSE_STOP(profile, json->p - buffer - !json->error);
+    return json->error;
+    }
+
+void parse_recycle(JSON *json)
+    {
+    destroy_arrays(json);
+    build_destroy(json);
+    overlay_destroy(json);
+    PoolClear(json->data_pool);
+    PoolClear(json->map_pool);
+    PoolClear(json->array_pool);
+    free(json->buffer);
+    free_decoded(json);
+    init_json(json);
     }
 
 JSON *json_parse_file(FILE *f)
     {
+    return json_parse_file_opts(f, NULL, NULL);
+    }
+
+JSON *json_parse_file_opts(FILE *f, const JSON_PARSE_OPTIONS *options,
+                           JSON_ERROR *error)
+    {
+    size_t max_bytes = options && options->max_total_bytes ?
+        options->max_total_bytes : SIZE_MAX;
     char *buffer = NULL;
-    size_t sz = BUF_INC;
+    size_t sz = BUF_START;
     size_t read_so_far = 0;
-    while ((buffer = realloc(buffer, sz)))
+    for (;;)
         {
-        read_so_far += fread(buffer + read_so_far, 1, BUF_INC, f); 
+        char *bigger = realloc(buffer, sz);
+        if (!bigger)
+            {
+            free(buffer);
+            if (error)
+                *error = JSON_NO_MEMORY;
+            return NULL;
+            }
+        buffer = bigger;
+        // Fill all but the byte kept for the terminating NUL
+        read_so_far += fread(buffer + read_so_far, 1, sz - 1 - read_so_far, f);
+        if (read_so_far > max_bytes)
+            {
+            free(buffer);
+            if (error)
+                *error = JSON_TOO_BIG;
+            return NULL;
+            }
         if (feof(f))
             {
-            *(buffer + read_so_far) = '\0';
+            buffer[read_so_far] = '\0';
             break;
             }
         if (ferror(f))
             {
             free(buffer);
+            if (error)
+                *error = JSON_READ_ERROR;
             return NULL;
             }
-        sz += BUF_INC;
+        sz *= 2; // geometric, so reading n bytes copies O(n)
         }
-    if (buffer)
-        return json_parse_string(buffer, true);
-    return NULL;
+    return json_parse_string_opts(buffer, true, options, error);
     }
 
 void json_destroy(JSON *doomed)
     {
-    recurse_and_destroy_data(doomed, doomed->data);
+    if (doomed->arena)
+        {
+        // The nodes all go with the arena, but arrays may have gained
+        // indexes since it was made
+        for (ARRAY *array = doomed->arrays; array; array = array->older)
+            index_destroy(array->indexes);
+        free(doomed->arena);
+        return;
+        }
+    destroy_arrays(doomed);
+    build_destroy(doomed);
+    overlay_destroy(doomed);
     PoolDestroy(doomed->data_pool);
     PoolDestroy(doomed->map_pool);
     PoolDestroy(doomed->array_pool);
     if (doomed->buffer)
         free(doomed->buffer);
+    free_decoded(doomed);
     free(doomed);
     }
 
@@ -631,71 +1141,106 @@ void json_dump(JSON *json, FILE *f)
     dump_data(json->data, f);
     }
 
-bool json_is_null(JSON_DATA *data)
+JSON_DATA *json_get_root(JSON *json)
     {
-    return data->type == null;
+    return json_inline_get_root(json);
     }
 
-JSON_DATA *json_get_root(JSON *json)
+bool json_is_null(JSON_DATA *data)
     {
-    return json->data;
+    return json_inline_is_null(data);
     }
 
 bool json_is_string(JSON_DATA *data)
     {
-    return data->type == string;
+    return json_inline_is_string(data);
     }
 
 const char *json_string(JSON_DATA *data)
     {
-    if (json_is_string(data))
-        return data->data.string;
-    return NULL;
+    return json_inline_string(data);
+    }
+
+size_t json_string_length(JSON_DATA *data)
+    {
+    return json_inline_string_length(data);
+    }
+
+JSON_STRING_VIEW json_string_view(JSON_DATA *data)
+    {
+    return json_inline_string_view(data);
     }
 
 bool json_is_number(JSON_DATA *data)
     {
-    return data->type == number;
+    return json_inline_is_number(data);
     }
 
 double json_number(JSON_DATA *data)
     {
-    if (json_is_number(data))
-        return atof(data->data.string);
-    return NAN;
+    return json_inline_number(data);
     }
 
 bool json_is_boolean(JSON_DATA *data)
     {
-    return data->type == boolean;
+    return json_inline_is_boolean(data);
     }
 
-JSON_DATA **json_array(JSON_DATA *data)
-    {
-    return data->data.array->array;
-    }
-    
 bool json_boolean(JSON_DATA *data)
     {
-    if (json_is_boolean(data))
-        return data->data.string[0] == 't';
-    return false; // :-(
+    return json_inline_boolean(data);
     }
 
 bool json_is_object(JSON_DATA *data)
     {
-    return data->type == map;
+    return json_inline_is_object(data);
+    }
+
+size_t json_object_size(JSON_DATA *data)
+    {
+    return json_inline_object_size(data);
+    }
+
+JSON_MEMBER *json_object_begin(JSON_DATA *data, const char **key, 
+                               JSON_DATA **value)
+    {
+    return json_inline_object_begin(data, key, value);
+    }
+
+JSON_MEMBER *json_object_next(JSON_MEMBER *member, const char **key,
+                              JSON_DATA **value)
+    {
+    return json_inline_object_next(member, key, value);
+    }
+
+size_t json_member_key_length(JSON_MEMBER *member)
+    {
+    return json_inline_member_key_length(member);
     }
 
 bool json_is_array(JSON_DATA *data)
     {
-    return data->type == array;
+    return json_inline_is_array(data);
+    }
+
+JSON_DATA **json_array(JSON_DATA *data)
+    {
+    return json_inline_array(data);
+    }
+
+size_t json_array_length(JSON_DATA *data)
+    {
+    return json_inline_array_length(data);
     }
 
-static JSON_DATA *find_map_data(MAP_NODE *map, const char *key)
+static JSON_DATA *find_map_data(JSON_DATA *map, const char *key, 
+                                size_t length)
     {
-    MAP_NODE *node = map;
-    while (node && strcmp(node->key, key))
+    if (map->overlay)
+        return overlay_find(map, key, length);
+    MAP_NODE *node = map->data.map;
+    while (node && (node->key_length != length || 
+                    memcmp(node->key, key, length)))
         node = node->next;
     if (node)
         return node->data;
@@ -725,7 +1270,7 @@ static JSON_DATA *_json_get_data(JSON_DATA *data, char *query)
         *p = '\0';
         JSON_DATA *next_data = NULL;
         if (json_is_object(data))
-            next_data = find_map_data(data->data.map, query);
+            next_data = find_map_data(data, query, i);
         else if (isdigit(query[0]) && json_is_array(data))
             next_data = find_array_data(data->data.array, atoi(query));
         *p = QUERY_DELIM;
@@ -735,7 +1280,7 @@ static JSON_DATA *_json_get_data(JSON_DATA *data, char *query)
             return NULL;
         }
     else if (json_is_object(data))
-        return find_map_data(data->data.map, query);
+        return find_map_data(data, query, i);
     else if (isdigit(query[0]) && json_is_array(data))
         return find_array_data(data->data.array, atoi(query));
     else
@@ -749,3 +1294,78 @@ JSON_DATA *json_get_data(JSON_DATA *data, const char *query)
     free(_query);
     return rval;
     }
+
+typedef struct QUERY_STEP QUERY_STEP;
+
+struct QUERY_STEP
+    {
+    const char *key;
+    size_t length;
+    int index; // -1 unless the key could be an array index
+    };
+
+struct JSON_QUERY
+    {
+    size_t count;
+    QUERY_STEP *steps;
+    };
+
+JSON_QUERY *json_query_compile(const char *query)
+    {
+    size_t count = 1;
+    for (const char *p = query; *p; ++p)
+        if (*p == QUERY_DELIM)
+            ++count;
+
+    // One block: header, steps, then a private copy of the keys
+    size_t length = strlen(query);
+    JSON_QUERY *compiled = malloc(sizeof(JSON_QUERY) + 
+        count * sizeof(QUERY_STEP) + length + 1);
+    if (!compiled)
+        return NULL;
+    compiled->count = count;
+    compiled->steps = (QUERY_STEP *)(compiled + 1);
+    char *key = (char *)(compiled->steps + count);
+    memcpy(key, query, length + 1);
+
+    for (size_t i = 0; i < count; ++i)
+        {
+        char *p = key;
+        while (*p && *p != QUERY_DELIM)
+            ++p;
+        *p = '\0';
+        compiled->steps[i].key = key;
+        compiled->steps[i].length = p - key;
+        compiled->steps[i].index = isdigit(key[0]) ? atoi(key) : -1;
+        key = p + 1;
+        }
+    return compiled;
+    }
+
+JSON_DATA *json_query_get(JSON_DATA *data, const JSON_QUERY *query)
+    {
+    return query_trace(data, query, NULL, NULL);
+    }
+
+JSON_DATA *query_trace(JSON_DATA *data, const JSON_QUERY *query,
+                       void (*look)(JSON_DATA *, void *), void *context)
+    {
+    for (size_t i = 0; data && i < query->count; ++i)
+        {
+        if (look && (json_is_object(data) || json_is_array(data)))
+            look(data, context);
+        if (json_is_object(data))
+            data = find_map_data(data, query->steps[i].key,
+                                 query->steps[i].length);
+        else if (query->steps[i].index >= 0 && json_is_array(data))
+            data = find_array_data(data->data.array, query->steps[i].index);
+        else
+            data = NULL;
+        }
+    return data;
+    }
+
+void json_query_destroy(JSON_QUERY *query)
+    {
+    free(query);
+    }
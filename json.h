@@ -18,12 +18,61 @@
 #include <stdbool.h>
 #endif
 
+#ifndef __mmijson_stdint_h
+#define __mmijson_stdint_h
+#include <stdint.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct JSON JSON;
 typedef struct JSON_DATA JSON_DATA;
+typedef struct JSON_MEMBER JSON_MEMBER;
+typedef struct JSON_QUERY JSON_QUERY;
+typedef struct JSON_LIVE JSON_LIVE;
+typedef struct JSON_SHAPE_CACHE JSON_SHAPE_CACHE;
+typedef struct JSON_INDEX JSON_INDEX;
+typedef struct JSON_ARRAY_STREAM JSON_ARRAY_STREAM;
+
+typedef enum JSON_ERROR
+    {
+    JSON_OK = 0,
+    JSON_BAD_MAP,
+    JSON_BAD_ARRAY,
+    JSON_BAD_STRING,
+    JSON_BAD_NUMBER,
+    JSON_BAD_BOOLEAN,
+    JSON_BAD_NULL,
+    JSON_BAD_TRAILING, // something other than whitespace after the value
+    JSON_TOO_DEEP,
+    JSON_TOO_MANY_NODES,
+    JSON_STRING_TOO_LONG,
+    JSON_TOO_BIG,
+    JSON_TIMED_OUT,
+    JSON_READ_ERROR,
+    JSON_NO_MEMORY
+    } JSON_ERROR;
+
+typedef struct JSON_PARSE_OPTIONS
+    // Budgets for a single parse; 0 means unlimited for every one.
+    // Exceeding any of them aborts the parse early with the matching
+    // JSON_ERROR. Also the shape cache to parse with, if any.
+    {
+    size_t max_depth; // nesting of arrays and objects
+    size_t max_nodes; // values of any type, containers included
+    size_t max_string_length; // decoded bytes, keys included
+    size_t max_total_bytes; // size of the input text
+    unsigned long timeout_us; // wall clock, checked every 1024 values
+    JSON_SHAPE_CACHE *shapes; // key orders to expect, or NULL for none
+    } JSON_PARSE_OPTIONS;
+
+typedef struct JSON_STRING_VIEW
+    {
+    const char *string;
+    size_t length;
+    } JSON_STRING_VIEW;
 
 JSON *json_parse_string(char *, bool should_free);
 // Parse the string into a JSON structure and return pointer to same.
@@ -36,20 +85,203 @@ JSON *json_parse_string(char *, bool should_free);
 
 JSON *json_parse_file(FILE *);
 
+JSON *json_parse_string_opts(char *, bool should_free, 
+                             const JSON_PARSE_OPTIONS *, JSON_ERROR *);
+JSON *json_parse_file_opts(FILE *, const JSON_PARSE_OPTIONS *, 
+                           JSON_ERROR *);
+// As above, but within the budgets given (options may be NULL) and
+// storing the reason for failure (or JSON_OK) through the JSON_ERROR
+// pointer when it isn't NULL.
+
+JSON_ERROR json_validate(const char *, size_t length, size_t *error_offset);
+// Checks that the length bytes are JSON that json_parse_buffer would
+// take (whitespace being what isspace() takes), and also that strings
+// are well formed UTF-8, without altering them or allocating anything.
+// Returns JSON_OK, or the problem (JSON_TOO_DEEP past 1024 levels of
+// nesting) and, when error_offset isn't NULL, the offset of the byte
+// at fault through it (length if the input ends too soon).
+
+JSON_ARRAY_STREAM *json_array_stream_open(FILE *);
+JSON_ARRAY_STREAM *json_array_stream_open_opts(FILE *,
+                                               const JSON_PARSE_OPTIONS *);
+// Reads a file holding one array, of any size, an element at a time.
+// Memory use is bounded by the largest element, not the file. The
+// budgets (and shape cache) in the options apply to each element on
+// its own, max_total_bytes to its text. Returns NULL if out of memory.
+
+JSON *json_array_stream_next(JSON_ARRAY_STREAM *, JSON_ERROR *);
+// The next element, as a document of its own, or NULL when there are
+// no more or on error (storing the reason, or JSON_OK at the end,
+// through the JSON_ERROR pointer when it isn't NULL). The document
+// belongs to the stream and is only valid until the next call: don't
+// destroy it, json_clone what should be kept.
+
+void json_array_stream_close(JSON_ARRAY_STREAM *);
+// Frees the stream; the file is left open.
+
+JSON_SHAPE_CACHE *json_shape_cache_create(size_t max_keys);
+void json_shape_cache_destroy(JSON_SHAPE_CACHE *);
+// A shape cache, given to parses through JSON_PARSE_OPTIONS, learns the
+// order of keys in the objects they see (up to max_keys keys in all,
+// 4096 if 0) and predicts it for the objects that follow: a key as
+// predicted is matched with a single compare, without being decoded
+// or checked against the object's other keys. It pays off for many
+// objects sharing a few layouts, as in arrays of records, and costs
+// little otherwise. A cache may be used by one parse at a time, and
+// may be destroyed while documents parsed with it are still in use.
+
+JSON *json_parse_buffer(const char *, size_t length);
+JSON *json_parse_buffer_opts(const char *, size_t length,
+                             const JSON_PARSE_OPTIONS *, JSON_ERROR *);
+// Parse length bytes without altering them or needing a terminating
+// NUL, so read-only memory (mmapped files, string literals) can be
+// parsed without a copy. The buffer must outlive the JSON: strings and
+// keys without escapes are referenced where they are, and so are not
+// NUL terminated; only those with escapes are decoded into memory of
+// the document's own. Use the lengths (json_string_view,
+// json_member_key_length) for strings from these documents.
+
+JSON *json_parse_compressed(FILE *);
+JSON *json_parse_compressed_opts(FILE *, const JSON_PARSE_OPTIONS *,
+                                 JSON_ERROR *);
+// As json_parse_file, for gzip compressed files (and zstd compressed
+// ones if built with JSON_ZSTD; JSON_READ_ERROR otherwise). Files that
+// are neither are parsed as they are. The file is read ahead on a
+// second thread while being decompressed directly into the buffer
+// that gets parsed, which for seekable gzip files and zstd frames that
+// record their size is allocated once at the decompressed size.
+// max_total_bytes limits the decompressed size and is enforced as
+// decompression goes. Requires linking with -lz and -lpthread (and
+// -lzstd).
+
+size_t json_parse_paths(const char **paths, size_t n, JSON **results,
+                        unsigned threads);
+// Parses n files at once, storing each file's JSON (or NULL if it
+// couldn't be read or parsed) in the matching element of results, and
+// returns how many were parsed. On Linux the reads are batched through
+// io_uring and each file is parsed as soon as its read completes;
+// with threads > 1 that many threads do the parsing. Elsewhere (or
+// built with JSON_NO_URING) a pool of at least 8 threads reads and
+// parses the files. Requires linking with -lpthread.
+
+size_t json_minify(char *buffer, size_t length);
+// Removes insignificant whitespace (anything outside of strings) from
+// the buffer in place and returns the new length. The buffer needn't
+// be valid JSON or NUL terminated; nothing past length is touched.
+
+size_t json_minify_partial(char *buffer, size_t length, unsigned *state);
+// json_minify for input arriving in pieces, each minified in place on
+// its own. *state must be 0 before the first piece and is carried
+// between calls, so strings and escapes may straddle pieces. After the
+// last piece *state is nonzero if the input ended inside a string.
+
+JSON *json_new(void);
+void json_set_root(JSON *, JSON_DATA *);
+// An empty document (its root NULL) to build with the calls below,
+// then dump and destroy like a parsed one. Setting the root replaces
+// the old one as json_object_set replaces a member's value; it does
+// nothing to the documents of json_clone and json_overlay.
+
+JSON_DATA *json_new_object(JSON *);
+JSON_DATA *json_new_array(JSON *);
+JSON_DATA *json_new_string(JSON *, const char *, size_t length);
+JSON_DATA *json_new_number(JSON *, double);
+JSON_DATA *json_new_boolean(JSON *, bool);
+JSON_DATA *json_new_null(JSON *);
+// New values for the document, allocated from it. One never put in
+// its tree is freed with the document, and one put there is freed as
+// json_object_set says. Strings are copied, and may
+// contain NULs. Numbers are written as the shortest text that reads
+// back as the same double (Grisu2 rather than printf); infinities and
+// NaN, which JSON can't hold, become null. Return NULL if out of
+// memory, and always for the documents of json_clone and json_overlay,
+// which can't change.
+
+bool json_object_set(JSON *, JSON_DATA *object, const char *key,
+                     JSON_DATA *value);
+bool json_array_push(JSON *, JSON_DATA *array, JSON_DATA *value);
+bool json_array_set(JSON *, JSON_DATA *array, size_t i, JSON_DATA *value);
+// Change a container of the document, built or parsed: set the value
+// of the member with the (NUL terminated) key, replacing it or adding
+// the member last; append an element; replace element i. Sets and
+// pushes are O(1) amortized. The value must be the document's, new or
+// already in it; a value may be in several places, though not inside
+// itself. One replaced in the last place it was is freed right away,
+// with all it holds that isn't elsewhere in the tree too, so a long
+// lived document doesn't grow with its changes (only with the keys it
+// has ever had, which are kept once each): to move a value, put it in
+// its new place before replacing it in the old. Don't change a layer
+// of a json_overlay view while using it. Changes are seen by json_hash
+// and json_equal right away, containers' cached hashes holding only
+// until the document's next change, and by the indexes that read what
+// changed (see json_index_build), which are filled again on their next
+// use. Return
+// false if the container isn't of the kind (or has no element i), if
+// the value is in 2^27 - 1 places already, or if out of memory.
+
 void json_dump(JSON *, FILE *);
-// JSON * must have been returned by one of the parse methods above.
+// JSON * must have been returned by one of the parse methods above,
+// json_new, json_clone or json_overlay.
 
 void json_destroy(JSON *);
-// JSON * must have been returned by one of the parse methods above.
+// JSON * must have been returned by one of the parse methods above,
+// json_new, json_clone or json_overlay.
 // Releases all resources used by the JSON object, rendering it
 // unusable.
 
+void json_destroy_deferred(JSON *);
+// As json_destroy, but in O(1): the document is queued for a
+// background thread to destroy. If the queue (64 documents) is full
+// the document is destroyed right away instead. Pending documents
+// that are still queued when the process exits are not freed.
+// Requires linking with -lpthread.
+
+void json_destroy_flush(void);
+// Waits until every document queued so far has been destroyed, not
+// for those other threads queue meanwhile.
+
+JSON *json_clone(JSON_DATA *);
+// Deep copies the value (and everything under it) into a new,
+// independent document, returning NULL if out of memory. The copy is
+// one exactly sized allocation with no tie to the original, which can
+// be destroyed as soon as the copy is made. Use it to keep a small
+// part of a large document, or to hand data to another thread.
+
+JSON *json_overlay(JSON_DATA **layers, size_t n_layers);
+// A view of the layers merged, each over those before it (layers[0]
+// being the base) as JSON Merge Patch (RFC 7386) has it: objects merge
+// member by member, a null member removes the one below, and anything
+// else replaces what was below. Objects more than one layer has (and
+// upper layers' objects with nulls to take out) get a node of the
+// view's own holding just the members set above the lowest layer;
+// every other value is the layers' own, shared rather than copied,
+// so a merge costs time and memory for what the upper layers hold and
+// not for the objects below them, however wide. Looking members up
+// falls through to the lowest layer's object, and an object set over
+// one of its members is merged with it when first looked up (reading
+// as missing if memory runs out) or read whole. Reading such an object
+// whole (iterating it, its size, json_dump, json_hash, json_equal,
+// json_clone) lays its members out once: those set above first, then
+// the lowest layer's others, in their order, sharing its list after
+// the last member set or removed above. If memory runs out doing
+// that, the object reads as empty. The view is a document to read like
+// any other but not to change, and as reading it may lay objects out,
+// not from several threads at once; json_hash caches in the layers'
+// nodes, too. The layers must outlive it, unchanged while it's in use.
+// json_clone its root for an independent copy, in one pass. Returns
+// NULL if n_layers is 0 or out of memory.
+
 JSON_DATA *json_get_root(JSON *);
 
 bool json_is_null(JSON_DATA *);
 
 bool json_is_string(JSON_DATA *);
 const char *json_string(JSON_DATA *); // NULL if not string
+size_t json_string_length(JSON_DATA *); // 0 if not string
+JSON_STRING_VIEW json_string_view(JSON_DATA *); // { NULL, 0 } if not string
+// Strings are stored decoded (\uXXXX escapes as UTF-8) and NUL
+// terminated (but see json_parse_buffer), and may contain embedded NULs
+// from \u0000, so the stored length is authoritative. Both length calls are O(1).
 
 bool json_is_number(JSON_DATA *);
 double json_number(JSON_DATA *); // NaN if not number
@@ -58,9 +290,32 @@ bool json_is_boolean(JSON_DATA *);
 bool json_boolean(JSON_DATA *); // false if not boolean :-(
 
 bool json_is_object(JSON_DATA *);
+size_t json_object_size(JSON_DATA *); // 0 if not object
+
+JSON_MEMBER *json_object_begin(JSON_DATA *, const char **key, 
+                               JSON_DATA **value);
+JSON_MEMBER *json_object_next(JSON_MEMBER *, const char **key, 
+                              JSON_DATA **value);
+// Cursor-style iteration over the members of an object, in document
+// order and O(1) per step. Each call stores the current member's key
+// and value through the given pointers and returns the cursor to pass
+// to the next call, or NULL (leaving key/value untouched) when there
+// are no more members. json_object_begin returns NULL if not object.
+//
+// Example:
+//
+//  const char *key;
+//  JSON_DATA *value;
+//  for (JSON_MEMBER *m = json_object_begin(obj, &key, &value); m;
+//       m = json_object_next(m, &key, &value))
+//      printf("%s\n", key);
+
+size_t json_member_key_length(JSON_MEMBER *);
+// Length of the key most recently returned for this cursor.
 
 bool json_is_array(JSON_DATA *);
 JSON_DATA **json_array(JSON_DATA *); // NULL-terminated array
+size_t json_array_length(JSON_DATA *); // 0 if not array
 
 JSON_DATA *json_get_data(JSON_DATA *, const char *query_string); 
 // Nestable query with comma-separated keys/indicies, starting at
@@ -72,8 +327,162 @@ JSON_DATA *json_get_data(JSON_DATA *, const char *query_string);
 //
 // { "foo": [ 0, 1, 2, 3, 4, 5, 6, { "bar": true }]}"
 
+uint64_t json_hash(JSON_DATA *);
+// Structural hash of the value: key order and formatting don't matter,
+// numbers hash by value (so 1, 1.0 and 1e0 agree). Hashes are cached in
+// the nodes, making repeat calls O(1); as that writes to the document,
+// don't hash one document from several threads at once. Stable across
+// runs on the same platform. Allocates nothing.
+
+bool json_equal(JSON_DATA *, JSON_DATA *);
+// Deep equality with the same rules as json_hash, whose (cached)
+// hashes are used to reject most differing values early.
+
+typedef struct JSON_STATS
+    // Parse counters, kept per thread by a library built with
+    // JSON_PROFILE (make PROFILE=1). Times are in TSC ticks on x86 and
+    // nanoseconds elsewhere; the phases are the exclusive parts of
+    // time_total that are worth telling apart.
+    {
+    uint64_t parses;
+    uint64_t bytes_scanned;
+    uint64_t time_total;
+    uint64_t time_whitespace;
+    uint64_t time_strings; // scanning and unescaping, keys included
+    uint64_t time_numbers;
+    uint64_t time_map_insert; // the duplicate key search
+    uint64_t objects;
+    uint64_t arrays;
+    uint64_t strings;
+    uint64_t numbers;
+    uint64_t booleans;
+    uint64_t nulls;
+    uint64_t pool_grows; // node memory allocations
+    uint64_t array_reallocs;
+    } JSON_STATS;
+
+typedef void JSON_STATS_HOOK(const JSON_STATS *parse, void *context);
+
+bool json_get_stats(JSON_STATS *);
+void json_reset_stats(void);
+// Reads and clears the calling thread's totals. json_get_stats zeroes
+// the JSON_STATS and returns false when built without JSON_PROFILE.
+
+bool json_set_stats_hook(JSON_STATS_HOOK *, void *context);
+// Has the hook called at the end of every parse, on the parsing
+// thread, with that parse's own counters (for latency histograms,
+// say). NULL removes it. Set it before parsing starts; returns false
+// when built without JSON_PROFILE.
+
+JSON_INDEX *json_index_build(JSON_DATA *array, const char *key_path);
+// Indexes the elements of the array by the value each has at key_path
+// (a json_get_data query applied to the element, or NULL for the
+// element itself); elements without one are left out. The index is
+// kept with the array and freed with the document, and building it
+// again returns the same one. Changing the array, or what the index
+// read under its elements (see json_object_set), outdates the index,
+// which is then filled again by its next build or lookup. Returns NULL if not array or out of
+// memory. Building hashes the values, so see json_hash about threads,
+// and don't use an index from several threads after a change before
+// one of them has used it.
+
+size_t json_index_lookup(const JSON_INDEX *, JSON_DATA *value,
+                         JSON_DATA ***elements);
+size_t json_index_lookup_string(const JSON_INDEX *, const char *,
+                                size_t length, JSON_DATA ***elements);
+size_t json_index_lookup_number(const JSON_INDEX *, double,
+                                JSON_DATA ***elements);
+// Finds the elements whose value json_equal's the one given, in O(1)
+// expected time. Returns how many there are and, if any, points
+// elements at them, in array order; the index owns that memory.
+//
+// Example:
+//
+//  JSON_INDEX *by_name = json_index_build(servlets, "servlet-name");
+//  JSON_DATA **found;
+//  if (json_index_lookup_string(by_name, "cofaxCDS", 8, &found))
+//      use(found[0]);
+
+JSON_QUERY *json_query_compile(const char *query_string);
+// Splits a json_get_data query string once, so that it can be applied
+// any number of times without re-parsing or allocating. Returns NULL
+// on allocation failure.
+
+JSON_DATA *json_query_get(JSON_DATA *, const JSON_QUERY *);
+// Same result as json_get_data with the original query string.
+
+void json_query_destroy(JSON_QUERY *);
+
+typedef enum JSON_COLUMN_TYPE
+    {
+    JSON_COLUMN_DOUBLE,
+    JSON_COLUMN_INT64,
+    JSON_COLUMN_STRING
+    } JSON_COLUMN_TYPE;
+
+typedef struct JSON_COLUMN
+    {
+    union
+        {
+        double *doubles;
+        int64_t *int64s;
+        JSON_STRING_VIEW *strings;
+        } values; // one per record
+    uint8_t *valid; // bit i % 8 of byte i / 8 set if record i has a value
+    } JSON_COLUMN;
+
+bool json_extract_columns(JSON_DATA *array, const char **field_names,
+                          const JSON_COLUMN_TYPE *types, size_t n_fields,
+                          JSON_COLUMN *columns);
+// Turns an array of objects into one contiguous column per named
+// field, in a single pass. columns[i] gets the values of member
+// field_names[i] as types[i]; a record where it is missing, null or of
+// another type (a number that isn't a whole int64 for
+// JSON_COLUMN_INT64), or that isn't an object, gets 0 with its valid
+// bit clear. Strings are views into the document and last as long as
+// it does. Returns false, with nothing allocated, if not array or out
+// of memory.
+
+void json_columns_free(JSON_COLUMN *columns, size_t n_fields);
+
+JSON_LIVE *json_live_open(const char *path, unsigned poll_ms);
+// Parses the file at path and keeps it current: a background thread
+// re-parses it whenever it changes (inotify on Linux, and a check of
+// size and modification time every poll_ms milliseconds, 1000 if 0,
+// everywhere) and publishes the result unless it json_equal's the
+// current version. A new version that fails to parse is ignored and
+// the previous one stays current. Returns NULL if the file can't be
+// parsed to begin with. Requires linking with -lpthread.
+
+JSON *json_live_acquire(JSON_LIVE *);
+void json_live_release(JSON_LIVE *, JSON *);
+// Pins the current version for reading and unpins it again. Neither
+// call blocks; any number of threads may hold versions at once and
+// each version is freed once it has been replaced and the last reader
+// has released it. Published documents are already hashed, so
+// json_hash and json_equal on them are safe from any thread too. Up to
+// 8 versions can be held at a time; while that many are pinned, new
+// versions wait.
+
+bool json_live_reload(JSON_LIVE *);
+// Re-parses the file now, returning true if a new version was
+// published.
+
+void json_live_close(JSON_LIVE *);
+// Stops watching and frees every version. All versions must have been
+// released.
+
 #ifdef __cplusplus
 }
 #endif
 
+#ifdef JSON_INLINE
+#include "json_inline.h"
+// Compile with JSON_INLINE defined to have the trivial accessors above
+// (type tests, scalar values, sizes, iteration and json_get_root)
+// expand inline rather than call into the library. The document layout
+// then becomes part of the compiled code, so everything must be built
+// against the same version of these headers.
+#endif
+
 #endif
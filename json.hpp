@@ -0,0 +1,256 @@
+//  json.hpp
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Header-only C++17 interface over json.h. Everything here is a thin
+//  inline wrapper: no allocations and no virtual calls beyond what the
+//  underlying C calls do.
+
+#ifndef __mmijson_json_hpp
+#define __mmijson_json_hpp
+
+#include "json.h"
+
+#include <cstddef>
+#include <limits>
+#include <string_view>
+#include <utility>
+
+namespace mmijson
+{
+
+class Path
+    // A precompiled query, see json_query_compile. Compile once and
+    // reuse: lookups through a Path neither parse nor allocate.
+    {
+public:
+    explicit Path(const char *query) noexcept
+        : query_(json_query_compile(query)) {}
+    ~Path() { if (query_) json_query_destroy(query_); }
+
+    Path(Path &&other) noexcept : query_(other.query_)
+        { other.query_ = nullptr; }
+    Path &operator=(Path &&other) noexcept
+        {
+        std::swap(query_, other.query_);
+        return *this;
+        }
+    Path(const Path &) = delete;
+    Path &operator=(const Path &) = delete;
+
+    explicit operator bool() const noexcept { return query_ != nullptr; }
+    const JSON_QUERY *get() const noexcept { return query_; }
+
+private:
+    JSON_QUERY *query_;
+    };
+
+class Value;
+
+class Member
+    {
+public:
+    std::string_view key;
+    Value value() const noexcept;
+
+private:
+    friend class ObjectIterator;
+    JSON_DATA *data_ = nullptr;
+    };
+
+class ArrayIterator
+    {
+public:
+    explicit ArrayIterator(JSON_DATA **p) noexcept : p_(p) {}
+    Value operator*() const noexcept;
+    ArrayIterator &operator++() noexcept { ++p_; return *this; }
+    bool operator!=(const ArrayIterator &other) const noexcept
+        { return p_ != other.p_; }
+    bool operator==(const ArrayIterator &other) const noexcept
+        { return p_ == other.p_; }
+
+private:
+    JSON_DATA **p_;
+    };
+
+class ObjectIterator
+    {
+public:
+    ObjectIterator() noexcept = default;
+    explicit ObjectIterator(JSON_DATA *object) noexcept
+        {
+        const char *key;
+        cursor_ = json_object_begin(object, &key, &member_.data_);
+        if (cursor_)
+            member_.key = std::string_view(key,
+                                           json_member_key_length(cursor_));
+        }
+    const Member &operator*() const noexcept { return member_; }
+    const Member *operator->() const noexcept { return &member_; }
+    ObjectIterator &operator++() noexcept
+        {
+        const char *key;
+        cursor_ = json_object_next(cursor_, &key, &member_.data_);
+        if (cursor_)
+            member_.key = std::string_view(key,
+                                           json_member_key_length(cursor_));
+        return *this;
+        }
+    bool operator!=(const ObjectIterator &other) const noexcept
+        { return cursor_ != other.cursor_; }
+    bool operator==(const ObjectIterator &other) const noexcept
+        { return cursor_ == other.cursor_; }
+
+private:
+    JSON_MEMBER *cursor_ = nullptr;
+    Member member_;
+    };
+
+template <typename Iterator>
+class Range
+    {
+public:
+    Range(Iterator begin, Iterator end) noexcept
+        : begin_(begin), end_(end) {}
+    Iterator begin() const noexcept { return begin_; }
+    Iterator end() const noexcept { return end_; }
+
+private:
+    Iterator begin_;
+    Iterator end_;
+    };
+
+class Value
+    // A non-owning handle to a node of a Document. Cheap to copy, valid
+    // as long as the Document it came from. A default constructed (or
+    // failed lookup) Value is empty and every accessor on it returns
+    // the "not that type" answer.
+    {
+public:
+    Value() noexcept = default;
+    explicit Value(JSON_DATA *data) noexcept : data_(data) {}
+
+    explicit operator bool() const noexcept { return data_ != nullptr; }
+    JSON_DATA *get() const noexcept { return data_; }
+
+    bool is_null() const noexcept { return data_ && json_is_null(data_); }
+    bool is_string() const noexcept
+        { return data_ && json_is_string(data_); }
+    bool is_number() const noexcept
+        { return data_ && json_is_number(data_); }
+    bool is_boolean() const noexcept
+        { return data_ && json_is_boolean(data_); }
+    bool is_object() const noexcept
+        { return data_ && json_is_object(data_); }
+    bool is_array() const noexcept
+        { return data_ && json_is_array(data_); }
+
+    std::string_view string() const noexcept
+        {
+        if (!data_)
+            return std::string_view();
+        JSON_STRING_VIEW view = json_string_view(data_);
+        return std::string_view(view.string, view.length);
+        }
+    double number() const noexcept
+        {
+        return data_ ? json_number(data_) :
+                       std::numeric_limits<double>::quiet_NaN();
+        }
+    bool boolean() const noexcept { return data_ && json_boolean(data_); }
+
+    std::size_t size() const noexcept
+        // Members of an object or elements of an array, else 0
+        {
+        if (is_array())
+            return json_array_length(data_);
+        if (is_object())
+            return json_object_size(data_);
+        return 0;
+        }
+
+    Value operator[](const Path &path) const noexcept
+        {
+        if (!data_ || !path)
+            return Value();
+        return Value(json_query_get(data_, path.get()));
+        }
+    Value operator[](std::size_t i) const noexcept
+        {
+        if (!is_array() || i >= json_array_length(data_))
+            return Value();
+        return Value(json_array(data_)[i]);
+        }
+
+    Range<ArrayIterator> elements() const noexcept
+        // Empty range if not array
+        {
+        if (!is_array())
+            return Range<ArrayIterator>(ArrayIterator(nullptr),
+                                        ArrayIterator(nullptr));
+        JSON_DATA **p = json_array(data_);
+        return Range<ArrayIterator>(ArrayIterator(p),
+            ArrayIterator(p + json_array_length(data_)));
+        }
+    Range<ObjectIterator> members() const noexcept
+        // Empty range if not object
+        {
+        if (!is_object())
+            return Range<ObjectIterator>(ObjectIterator(), ObjectIterator());
+        return Range<ObjectIterator>(ObjectIterator(data_),
+                                     ObjectIterator());
+        }
+
+private:
+    JSON_DATA *data_ = nullptr;
+    };
+
+inline Value Member::value() const noexcept { return Value(data_); }
+inline Value ArrayIterator::operator*() const noexcept { return Value(*p_); }
+
+class Document
+    // Move-only owner of a parsed JSON, destroyed with the Document.
+    {
+public:
+    Document() noexcept = default;
+    explicit Document(JSON *json) noexcept : json_(json) {}
+    ~Document() { if (json_) json_destroy(json_); }
+
+    Document(Document &&other) noexcept : json_(other.release()) {}
+    Document &operator=(Document &&other) noexcept
+        {
+        std::swap(json_, other.json_);
+        return *this;
+        }
+    Document(const Document &) = delete;
+    Document &operator=(const Document &) = delete;
+
+    static Document parse(char *s, bool should_free) noexcept
+        // See json_parse_string; empty Document on error.
+        { return Document(json_parse_string(s, should_free)); }
+    static Document parse(FILE *f) noexcept
+        { return Document(json_parse_file(f)); }
+
+    explicit operator bool() const noexcept { return json_ != nullptr; }
+    JSON *get() const noexcept { return json_; }
+    JSON *release() noexcept
+        {
+        JSON *json = json_;
+        json_ = nullptr;
+        return json;
+        }
+
+    Value root() const noexcept
+        { return json_ ? Value(json_get_root(json_)) : Value(); }
+    Value operator[](const Path &path) const noexcept
+        { return root()[path]; }
+    Value operator[](std::size_t i) const noexcept { return root()[i]; }
+
+private:
+    JSON *json_ = nullptr;
+    };
+
+} // namespace mmijson
+
+#endif
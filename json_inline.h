@@ -0,0 +1,179 @@
+//  json_inline.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  The trivial accessors of json.h as static inline functions. The
+//  library's own out-of-line versions are defined in terms of these.
+//  Compiling with JSON_INLINE defined (see json.h) maps the public
+//  names onto them, so calls compile down to a load or two instead
+//  of a call into the library.
+
+#ifndef __mmijson_json_inline_h
+#define __mmijson_json_inline_h
+
+#include "json_node.h"
+
+#ifndef __mmijson_stdlib_h
+#define __mmijson_stdlib_h
+#include <stdlib.h>
+#endif
+
+#ifndef __mmijson_math_h
+#define __mmijson_math_h
+#include <math.h>
+#endif
+
+static inline JSON_DATA *json_inline_get_root(JSON *json)
+    {
+    return json->data;
+    }
+
+static inline bool json_inline_is_null(JSON_DATA *data)
+    {
+    return data->type == JSON_TYPE_NULL;
+    }
+
+static inline bool json_inline_is_string(JSON_DATA *data)
+    {
+    return data->type == JSON_TYPE_STRING;
+    }
+
+static inline const char *json_inline_string(JSON_DATA *data)
+    {
+    if (json_inline_is_string(data))
+        return data->data.string;
+    return NULL;
+    }
+
+static inline size_t json_inline_string_length(JSON_DATA *data)
+    {
+    if (json_inline_is_string(data))
+        return data->length;
+    return 0;
+    }
+
+static inline JSON_STRING_VIEW json_inline_string_view(JSON_DATA *data)
+    {
+    JSON_STRING_VIEW view = { NULL, 0 };
+    if (json_inline_is_string(data))
+        {
+        view.string = data->data.string;
+        view.length = data->length;
+        }
+    return view;
+    }
+
+static inline bool json_inline_is_number(JSON_DATA *data)
+    {
+    return data->type == JSON_TYPE_NUMBER;
+    }
+
+static inline double json_inline_number(JSON_DATA *data)
+    {
+    if (json_inline_is_number(data))
+        return atof(data->data.string);
+    return NAN;
+    }
+
+static inline bool json_inline_is_boolean(JSON_DATA *data)
+    {
+    return data->type == JSON_TYPE_BOOLEAN;
+    }
+
+static inline bool json_inline_boolean(JSON_DATA *data)
+    {
+    if (json_inline_is_boolean(data))
+        return data->data.string[0] == 't';
+    return false; // :-(
+    }
+
+static inline bool json_inline_is_object(JSON_DATA *data)
+    {
+    return data->type == JSON_TYPE_MAP;
+    }
+
+static inline size_t json_inline_object_size(JSON_DATA *data)
+    {
+    if (json_inline_is_object(data) &&
+        (!data->overlay || overlay_flatten(data)))
+        return data->length;
+    return 0;
+    }
+
+static inline JSON_MEMBER *json_inline_member_fetch(MAP_NODE *node, 
+                                                    const char **key,
+                                                    JSON_DATA **value)
+    {
+    if (node)
+        {
+        *key = node->key;
+        *value = node->data;
+        }
+    return (JSON_MEMBER *)node;
+    }
+
+static inline JSON_MEMBER *json_inline_object_begin(JSON_DATA *data,
+                                                    const char **key,
+                                                    JSON_DATA **value)
+    {
+    if (json_inline_is_object(data) &&
+        (!data->overlay || overlay_flatten(data)))
+        return json_inline_member_fetch(data->data.map, key, value);
+    return NULL;
+    }
+
+static inline JSON_MEMBER *json_inline_object_next(JSON_MEMBER *member,
+                                                   const char **key,
+                                                   JSON_DATA **value)
+    {
+    if (member)
+        return json_inline_member_fetch(((MAP_NODE *)member)->next, 
+                                        key, value);
+    return NULL;
+    }
+
+static inline size_t json_inline_member_key_length(JSON_MEMBER *member)
+    {
+    return ((MAP_NODE *)member)->key_length;
+    }
+
+static inline bool json_inline_is_array(JSON_DATA *data)
+    {
+    return data->type == JSON_TYPE_ARRAY;
+    }
+
+static inline JSON_DATA **json_inline_array(JSON_DATA *data)
+    {
+    return data->data.array->array;
+    }
+
+static inline size_t json_inline_array_length(JSON_DATA *data)
+    {
+    if (json_inline_is_array(data))
+        return data->data.array->next;
+    return 0;
+    }
+
+#ifdef JSON_INLINE
+#define json_get_root json_inline_get_root
+#define json_is_null json_inline_is_null
+#define json_is_string json_inline_is_string
+#define json_string json_inline_string
+#define json_string_length json_inline_string_length
+#define json_string_view json_inline_string_view
+#define json_is_number json_inline_is_number
+#define json_number json_inline_number
+#define json_is_boolean json_inline_is_boolean
+#define json_boolean json_inline_boolean
+#define json_is_object json_inline_is_object
+#define json_object_size json_inline_object_size
+#define json_object_begin json_inline_object_begin
+#define json_object_next json_inline_object_next
+#define json_member_key_length json_inline_member_key_length
+#define json_is_array json_inline_is_array
+#define json_array json_inline_array
+#define json_array_length json_inline_array_length
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+//  json_node.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Memory layout of documents and their nodes, shared by the library
+//  sources and json_inline.h. This is not the API: use json.h, and
+//  expect anything here to change between versions.
+
+#ifndef __mmijson_json_node_h
+#define __mmijson_json_node_h
+
+#include "json.h"
+#include "pool.h"
+
+typedef struct MAP_NODE MAP_NODE;
+typedef struct ARRAY ARRAY;
+typedef struct BUILT BUILT;
+typedef struct OVERLAY OVERLAY;
+typedef struct DECODED DECODED;
+typedef struct WATCHES WATCHES;
+
+enum JSON_TYPE
+    {
+    JSON_TYPE_MAP,
+    JSON_TYPE_ARRAY,
+    JSON_TYPE_STRING,
+    JSON_TYPE_NUMBER,
+    JSON_TYPE_BOOLEAN,
+    JSON_TYPE_NULL
+    };
+
+#define MAX_REFS ((1u << 27) - 1)
+#define HASHED_FOREVER UINT32_MAX // hashed_at in nodes that can't change
+
+struct JSON_DATA
+    {
+    unsigned type : 3; // enum JSON_TYPE
+    unsigned refs : 27; // places it's in, the root's being one; kept by
+                        // documents that can change, to free it at 0
+    unsigned built : 1; // its text is the builder's, to free with it
+    unsigned overlay : 1; // a json_overlay object whose members aren't
+                          // laid out yet, see overlay_flatten
+    uint32_t hashed_at; // for containers, the document's count of
+                        // changes when hash was cached (see hash.c)
+    union
+        {
+        char *string; // also the token text of numbers, booleans, null
+        MAP_NODE *map;
+        ARRAY *array;
+        OVERLAY *overlay; // while the overlay bit is set
+        } data;
+    size_t length; // number of members for maps, bytes for strings and
+                   // the token text of numbers
+    uint64_t hash; // cached by json_hash, 0 until then
+    };
+
+struct MAP_NODE
+    {
+    char *key;
+    size_t key_length;
+    JSON_DATA *data;
+    MAP_NODE *next;
+    };
+
+struct ARRAY
+    {
+    JSON_DATA **array; // always NULL terminated
+    size_t size;
+    size_t next;
+    JSON_INDEX *indexes; // built by json_index_build, NULL if none
+    ARRAY *older; // the document's array made before this one
+    ARRAY *newer; // and after it, NULL for the last made
+    JSON *json; // the document, which records what the indexes read
+    uint64_t changes; // to it and what its indexes read, outdating them
+    };
+
+struct JSON
+    {
+    JSON_ERROR error;
+    Pool *data_pool;
+    Pool *map_pool;
+    Pool *array_pool;
+    JSON_DATA *data;
+    char *token;
+    size_t token_length;
+    int char_ahead;
+    char *work_buffer;
+    char *work_end; // the end of its room for read-only input, else NULL
+    char *p;
+    const char *end; // one past read-only input, NO_END when in place
+    char *buffer; // input to free, or NULL
+    DECODED *decoded; // text decoded from read-only input, newest first
+    size_t depth;
+    size_t nodes;
+    size_t max_depth;
+    size_t max_nodes;
+    size_t max_string_length;
+    uint64_t deadline; // now_ns() limit, 0 if none
+    JSON_SHAPE_CACHE *shapes; // NULL if none
+    ARRAY *arrays; // the last made, all freed by following older (in an
+                   // arena, the last to gain an index)
+    BUILT *built; // what the builder added, NULL if nothing
+    uint64_t changes; // made through the builder, outdating containers'
+                      // hashes
+    WATCHES *watches; // the containers indexes read (see index.c), or
+                      // NULL if none
+    bool view; // json_overlay's, made of other documents' nodes
+    OVERLAY *overlays; // the view's objects, all freed by following older
+    char *arena; // json_clone's single allocation (holding this JSON
+                 // too), or NULL for parsed documents
+    };
+
+static inline uint64_t cached_hash(const JSON_DATA *data)
+    // The hash json_hash cached in the node, or 0 if none or it no longer
+    // holds: scalars never change (the builder replaces them), but a
+    // container's holds only while its document has made no change since
+    {
+    if (!data->hash ||
+        (data->type != JSON_TYPE_MAP && data->type != JSON_TYPE_ARRAY) ||
+        data->hashed_at == HASHED_FOREVER ||
+        data->hashed_at == ((const JSON *)PoolOwner(data))->changes)
+        return data->hash;
+    return 0;
+    }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool overlay_flatten(JSON_DATA *);
+// Lays out the members of a json_overlay object with the overlay bit
+// set, after which it reads as any other. Returns false if out of
+// memory, leaving it as it was.
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,322 @@
+//  live.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Hot-reloaded documents. Every published version sits in one of a
+//  fixed set of slots, each with a count of the readers pinning it.
+//  Readers pin without locking: increment the current slot's count,
+//  then check the slot is still current. Only a single writer (the
+//  watcher thread or a json_live_reload caller, under a mutex) ever
+//  frees a document, and only once it is no longer current and its
+//  count has dropped to zero. A reader that loses the race to a swap
+//  backs off and retries before it touches the document.
+
+#include "json.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#define LIVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#define LIVE_SLOTS 8
+#define DEFAULT_POLL_MS 1000
+
+typedef struct SLOT SLOT;
+typedef struct STAMP STAMP;
+
+struct SLOT
+    {
+    JSON *json; // NULL if free
+    size_t readers;
+    };
+
+struct STAMP
+    // Enough of stat to notice a changed file without reading it
+    {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    };
+
+struct JSON_LIVE
+    {
+    char *path;
+    const char *name; // last component of path
+    SLOT slots[LIVE_SLOTS];
+    SLOT *current;
+    STAMP stamp;
+    pthread_mutex_t writer;
+    pthread_t thread;
+    int stop[2]; // pipe to wake the watcher when closing
+    int inotify; // -1 if only polling
+    int poll_ms;
+    };
+
+static bool read_stamp(const char *path, STAMP *stamp)
+    {
+    struct stat st;
+    if (stat(path, &st))
+        return false;
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->dev = st.st_dev;
+    stamp->ino = st.st_ino;
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtim;
+    return true;
+    }
+
+static bool same_stamp(const STAMP *a, const STAMP *b)
+    {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec;
+    }
+
+static void reclaim(JSON_LIVE *live)
+    // Writer only. Frees every retired version nobody has pinned. A
+    // reader may still bump the count of a slot freed here, but it will
+    // find the slot isn't current and back off without looking inside.
+    {
+    SLOT *current = __atomic_load_n(&live->current, __ATOMIC_SEQ_CST);
+    for (SLOT *slot = live->slots; slot < live->slots + LIVE_SLOTS; ++slot)
+        {
+        JSON *json = __atomic_load_n(&slot->json, __ATOMIC_SEQ_CST);
+        if (json && slot != current &&
+            !__atomic_load_n(&slot->readers, __ATOMIC_SEQ_CST))
+            {
+            __atomic_store_n(&slot->json, NULL, __ATOMIC_SEQ_CST);
+            json_destroy(json);
+            }
+        }
+    }
+
+static bool publish(JSON_LIVE *live, JSON *json)
+    // Writer only. Fails if every slot still holds a pinned version.
+    {
+    reclaim(live);
+    for (SLOT *slot = live->slots; slot < live->slots + LIVE_SLOTS; ++slot)
+        if (!slot->json)
+            {
+            __atomic_store_n(&slot->json, json, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&live->current, slot, __ATOMIC_SEQ_CST);
+            reclaim(live);
+            return true;
+            }
+    return false;
+    }
+
+static bool reload(JSON_LIVE *live, bool force)
+    // Writer only. Returns true if a new version was published.
+    {
+    STAMP stamp;
+    if (!read_stamp(live->path, &stamp) ||
+        (!force && same_stamp(&stamp, &live->stamp)))
+        return false;
+
+    FILE *f = fopen(live->path, "r");
+    if (!f)
+        return false;
+    JSON *json = json_parse_file(f);
+    fclose(f);
+    // A file that doesn't parse is most likely still being written;
+    // the write finishing will change the stamp again
+    live->stamp = stamp;
+    if (!json)
+        return false;
+
+    // Hash the whole new document while it is still private. The
+    // hashes are cached in the nodes, so from here on json_equal and
+    // json_hash only read the published versions.
+    JSON_DATA *root = json_get_root(json);
+    json_hash(root);
+    SLOT *current = live->current;
+    if (current && json_equal(root, json_get_root(current->json)))
+        {
+        json_destroy(json); // same content, nothing to publish
+        return false;
+        }
+    if (!publish(live, json))
+        {
+        // Every slot is pinned; forget the stamp to try again next round
+        json_destroy(json);
+        memset(&live->stamp, 0, sizeof(live->stamp));
+        return false;
+        }
+    return true;
+    }
+
+#ifdef LIVE_INOTIFY
+
+static bool names_file(JSON_LIVE *live)
+    // Drains the pending inotify events, true if any was about the file
+    {
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool hit = false;
+    ssize_t n;
+    while ((n = read(live->inotify, buffer, sizeof(buffer))) > 0)
+        for (char *p = buffer; p < buffer + n;)
+            {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len && !strcmp(event->name, live->name))
+                hit = true;
+            p += sizeof(*event) + event->len;
+            }
+    return hit;
+    }
+
+static void start_inotify(JSON_LIVE *live)
+    // Watches the directory rather than the file, so that replacing the
+    // file by renaming another over it is seen too
+    {
+    size_t dir_length = live->name - live->path;
+    char *dir = strndup(live->path, dir_length);
+    live->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (live->inotify >= 0 && dir &&
+        inotify_add_watch(live->inotify, dir_length ? dir : ".",
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+        {
+        close(live->inotify);
+        live->inotify = -1;
+        }
+    free(dir);
+    }
+
+#endif
+
+static void *watch(void *arg)
+    {
+    JSON_LIVE *live = (JSON_LIVE *)arg;
+    struct pollfd fds[2];
+    int count = 1;
+    fds[0].fd = live->stop[0];
+    fds[0].events = POLLIN;
+    if (live->inotify >= 0)
+        {
+        fds[count].fd = live->inotify;
+        fds[count++].events = POLLIN;
+        }
+    for (;;)
+        {
+        int n = poll(fds, count, live->poll_ms);
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n > 0 && fds[0].revents)
+            break;
+        bool force = false;
+#ifdef LIVE_INOTIFY
+        // An event naming the file forces a re-parse even if the stamp
+        // looks the same (timestamps can be coarser than the writes)
+        if (n > 0 && count > 1 && fds[1].revents)
+            force = names_file(live);
+#endif
+        // Timeouts double as the polling fallback
+        pthread_mutex_lock(&live->writer);
+        reload(live, force);
+        reclaim(live);
+        pthread_mutex_unlock(&live->writer);
+        }
+    return NULL;
+    }
+
+static void free_live(JSON_LIVE *live)
+    {
+    for (int i = 0; i < LIVE_SLOTS; ++i)
+        if (live->slots[i].json)
+            json_destroy(live->slots[i].json);
+    if (live->inotify >= 0)
+        close(live->inotify);
+    if (live->stop[0] >= 0)
+        {
+        close(live->stop[0]);
+        close(live->stop[1]);
+        }
+    pthread_mutex_destroy(&live->writer);
+    free(live->path);
+    free(live);
+    }
+
+JSON_LIVE *json_live_open(const char *path, unsigned poll_ms)
+    {
+    JSON_LIVE *live = (JSON_LIVE *)calloc(1, sizeof(*live));
+    if (!live)
+        return NULL;
+    live->inotify = live->stop[0] = live->stop[1] = -1;
+    live->poll_ms = poll_ms ? poll_ms : DEFAULT_POLL_MS;
+    pthread_mutex_init(&live->writer, NULL);
+    if (!(live->path = strdup(path)) || !reload(live, true) ||
+        pipe(live->stop))
+        {
+        free_live(live);
+        return NULL;
+        }
+    const char *slash = strrchr(live->path, '/');
+    live->name = slash ? slash + 1 : live->path;
+#ifdef LIVE_INOTIFY
+    start_inotify(live);
+#endif
+    if (pthread_create(&live->thread, NULL, watch, live))
+        {
+        free_live(live);
+        return NULL;
+        }
+    return live;
+    }
+
+JSON *json_live_acquire(JSON_LIVE *live)
+    {
+    for (;;)
+        {
+        SLOT *slot = __atomic_load_n(&live->current, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+        if (slot == __atomic_load_n(&live->current, __ATOMIC_SEQ_CST))
+            return __atomic_load_n(&slot->json, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+
+void json_live_release(JSON_LIVE *live, JSON *json)
+    {
+    for (SLOT *slot = live->slots; slot < live->slots + LIVE_SLOTS; ++slot)
+        if (__atomic_load_n(&slot->json, __ATOMIC_SEQ_CST) == json)
+            {
+            // The last reader out of a retired version frees it, unless
+            // the writer is busy (it will reclaim it on its next round)
+            if (!__atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST) &&
+                slot != __atomic_load_n(&live->current, __ATOMIC_SEQ_CST) &&
+                !pthread_mutex_trylock(&live->writer))
+                {
+                reclaim(live);
+                pthread_mutex_unlock(&live->writer);
+                }
+            return;
+            }
+    }
+
+bool json_live_reload(JSON_LIVE *live)
+    {
+    pthread_mutex_lock(&live->writer);
+    bool published = reload(live, true);
+    pthread_mutex_unlock(&live->writer);
+    return published;
+    }
+
+void json_live_close(JSON_LIVE *live)
+    {
+    ssize_t written;
+    do
+        written = write(live->stop[1], "x", 1);
+    while (written < 0 && errno == EINTR);
+    pthread_join(live->thread, NULL);
+    free_live(live);
+    }
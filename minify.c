@@ -0,0 +1,301 @@
+//  minify.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  In-place removal of insignificant whitespace. Input is handled 64
+//  bytes at a time: quote, backslash and whitespace positions become
+//  bitmasks, escapes and string interiors are resolved with bit
+//  arithmetic, and only the bytes left in the keep mask are copied
+//  down. On x86-64 the masks come from SSE2 compares, or from AVX2
+//  with a pshufb compaction when the CPU has it (checked on first use).
+
+#include "json.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MINIFY_X86
+#include <immintrin.h>
+#endif
+
+#define BLOCK_SIZE 64
+#define IN_STRING 1
+#define ESCAPED 2
+
+typedef struct MASKS MASKS;
+typedef struct CARRY CARRY;
+typedef char *BLOCKS_FN(char *, const char *, size_t, CARRY *);
+
+struct MASKS
+    {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t space;
+    };
+
+struct CARRY
+    // State flowing from one block into the next
+    {
+    uint64_t escaped; // 1 if the next block starts escaped
+    uint64_t in_string; // all ones if the next block starts in a string
+    };
+
+#ifdef MINIFY_X86
+
+static uint64_t match16(__m128i v, char c, int shift)
+    {
+    __m128i hit = _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+    return (uint64_t)(uint16_t)_mm_movemask_epi8(hit) << shift;
+    }
+
+static void find_masks(const char *block, MASKS *masks)
+    {
+    masks->quote = masks->backslash = masks->space = 0;
+    for (int i = 0; i < BLOCK_SIZE; i += 16)
+        {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        masks->quote |= match16(v, '"', i);
+        masks->backslash |= match16(v, '\\', i);
+        masks->space |= match16(v, ' ', i) | match16(v, '\n', i) |
+                        match16(v, '\r', i) | match16(v, '\t', i);
+        }
+    }
+
+#else
+
+static void find_masks(const char *block, MASKS *masks)
+    {
+    masks->quote = masks->backslash = masks->space = 0;
+    for (int i = 0; i < BLOCK_SIZE; ++i)
+        {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (block[i])
+            {
+        case '"':
+            masks->quote |= bit;
+            break;
+        case '\\':
+            masks->backslash |= bit;
+            break;
+        case ' ':
+        case '\n':
+        case '\r':
+        case '\t':
+            masks->space |= bit;
+            break;
+            }
+        }
+    }
+
+#endif
+
+static inline uint64_t find_escaped(uint64_t backslash, CARRY *carry)
+    // Bits for characters preceded by an odd run of backslashes. A run
+    // may continue from the previous block, hence the carry.
+    {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~carry->escaped;
+    uint64_t follows_escape = backslash << 1 | carry->escaped;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_sequences = odd_starts + backslash;
+    carry->escaped = even_sequences < odd_starts; // carried out the top
+    uint64_t invert_mask = even_sequences << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+    }
+
+static inline uint64_t prefix_xor(uint64_t x)
+    // Bit i becomes the parity of bits 0..i
+    {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+    }
+
+static inline uint64_t keep_mask(const MASKS *masks, CARRY *carry,
+                                 uint64_t *escaped)
+    {
+    *escaped = find_escaped(masks->backslash, carry);
+    uint64_t in_string = prefix_xor(masks->quote & ~*escaped) ^
+                         carry->in_string;
+    carry->in_string = (uint64_t)((int64_t)in_string >> 63);
+    return ~(masks->space & ~in_string);
+    }
+
+static char *compact(char *dst, const char *src, uint64_t keep)
+    // Copies the kept bytes of the block at src down to dst, which may
+    // be src itself or anywhere before it. Each byte is read before
+    // anything at or past it is written.
+    {
+    if (keep == ~(uint64_t)0)
+        {
+        memmove(dst, src, BLOCK_SIZE);
+        return dst + BLOCK_SIZE;
+        }
+    while (keep)
+        {
+        *dst++ = src[__builtin_ctzll(keep)];
+        keep &= keep - 1;
+        }
+    return dst;
+    }
+
+static char *minify_blocks(char *dst, const char *src, size_t count,
+                           CARRY *carry)
+    {
+    for (; count; --count, src += BLOCK_SIZE)
+        {
+        MASKS masks;
+        uint64_t escaped;
+        find_masks(src, &masks);
+        dst = compact(dst, src, keep_mask(&masks, carry, &escaped));
+        }
+    return dst;
+    }
+
+#ifdef MINIFY_X86
+
+#define AVX2 __attribute__((target("avx2,popcnt")))
+
+static uint64_t shuffle_table[256];
+// For each 8 bit keep mask, the pshufb control that packs the kept
+// bytes of an 8 byte group to the front
+
+static AVX2 uint64_t match32(__m256i v, char c)
+    {
+    __m256i hit = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+    return (uint32_t)_mm256_movemask_epi8(hit);
+    }
+
+static AVX2 void find_masks_avx2(const char *block, MASKS *masks)
+    {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(block + 32));
+    masks->quote = match32(lo, '"') | match32(hi, '"') << 32;
+    masks->backslash = match32(lo, '\\') | match32(hi, '\\') << 32;
+
+    // All four whitespace characters in one compare: pshufb looks up
+    // each byte's low nibble in a table of the whitespace character
+    // with that low nibble (bytes >= 0x80 look up 0, never a match)
+    const __m256i table = _mm256_setr_epi8(
+        ' ', 0, 0, 0, 0, 0, 0, 0, 0, '\t', '\n', 0, 0, '\r', 0, 0,
+        ' ', 0, 0, 0, 0, 0, 0, 0, 0, '\t', '\n', 0, 0, '\r', 0, 0);
+    __m256i ws_lo = _mm256_cmpeq_epi8(lo, _mm256_shuffle_epi8(table, lo));
+    __m256i ws_hi = _mm256_cmpeq_epi8(hi, _mm256_shuffle_epi8(table, hi));
+    masks->space = (uint32_t)_mm256_movemask_epi8(ws_lo) |
+                   (uint64_t)(uint32_t)_mm256_movemask_epi8(ws_hi) << 32;
+    }
+
+static AVX2 char *compact_avx2(char *dst, const char *src, uint64_t keep)
+    // Packs 8 bytes at a time and always stores all 8. Since dst never
+    // passes the group being read, the spare bytes only land on input
+    // already loaded, so this too is safe in place.
+    {
+    if (keep == ~(uint64_t)0)
+        {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)src);
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(src + 32));
+        _mm256_storeu_si256((__m256i *)dst, lo);
+        _mm256_storeu_si256((__m256i *)(dst + 32), hi);
+        return dst + BLOCK_SIZE;
+        }
+    for (int i = 0; i < BLOCK_SIZE; i += 8)
+        {
+        unsigned group = (keep >> i) & 0xFF;
+        __m128i v = _mm_loadl_epi64((const __m128i *)(src + i));
+        __m128i control =
+            _mm_loadl_epi64((const __m128i *)&shuffle_table[group]);
+        _mm_storel_epi64((__m128i *)dst, _mm_shuffle_epi8(v, control));
+        dst += __builtin_popcount(group);
+        }
+    return dst;
+    }
+
+static AVX2 char *minify_blocks_avx2(char *dst, const char *src,
+                                     size_t count, CARRY *carry)
+    {
+    for (; count; --count, src += BLOCK_SIZE)
+        {
+        MASKS masks;
+        uint64_t escaped;
+        find_masks_avx2(src, &masks);
+        dst = compact_avx2(dst, src, keep_mask(&masks, carry, &escaped));
+        }
+    return dst;
+    }
+
+static BLOCKS_FN *select_blocks(void)
+    {
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2") ||
+        !__builtin_cpu_supports("popcnt"))
+        return minify_blocks;
+
+    for (unsigned mask = 0; mask < 256; ++mask)
+        {
+        unsigned char control[8] = { 0 };
+        int n = 0;
+        for (int bit = 0; bit < 8; ++bit)
+            if (mask & (1u << bit))
+                control[n++] = bit;
+        memcpy(&shuffle_table[mask], control, 8);
+        }
+    return minify_blocks_avx2;
+    }
+
+#endif
+
+size_t json_minify_partial(char *buffer, size_t length, unsigned *state)
+    {
+#ifdef MINIFY_X86
+    static BLOCKS_FN *selected;
+    BLOCKS_FN *blocks = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (!blocks)
+        {
+        // Racing threads just compute the same answer
+        blocks = select_blocks();
+        __atomic_store_n(&selected, blocks, __ATOMIC_RELEASE);
+        }
+#else
+    BLOCKS_FN *blocks = minify_blocks;
+#endif
+    CARRY carry;
+    carry.escaped = (*state & ESCAPED) ? 1 : 0;
+    carry.in_string = (*state & IN_STRING) ? ~(uint64_t)0 : 0;
+    size_t count = length / BLOCK_SIZE;
+    char *dst = blocks(buffer, buffer, count, &carry);
+
+    size_t rest = length - count * BLOCK_SIZE;
+    if (rest)
+        {
+        // Pad the tail out to a full block. The padding holds no quotes,
+        // backslashes or whitespace so it can't disturb the masks, and
+        // its bits are dropped from the keep mask.
+        char block[BLOCK_SIZE];
+        MASKS masks;
+        uint64_t escaped;
+        memcpy(block, buffer + count * BLOCK_SIZE, rest);
+        memset(block + rest, 'x', BLOCK_SIZE - rest);
+        find_masks(block, &masks);
+        uint64_t keep = keep_mask(&masks, &carry, &escaped);
+        // Whether the next piece starts escaped shows on the first
+        // padding byte rather than as a carry out of the block
+        carry.escaped = (escaped >> rest) & 1;
+        dst = compact(dst, block, keep & (((uint64_t)1 << rest) - 1));
+        }
+
+    *state = (carry.in_string ? IN_STRING : 0) |
+             (carry.escaped ? ESCAPED : 0);
+    return dst - buffer;
+    }
+
+size_t json_minify(char *buffer, size_t length)
+    {
+    unsigned state = 0;
+    return json_minify_partial(buffer, length, &state);
+    }
@@ -0,0 +1,525 @@
+//  overlay.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Layered views. Each layer is merged over the ones below it as far as
+//  it reaches and no further. An object that more than one layer has
+//  (or an upper layer's with nulls to take out) gets a node of the
+//  view's own, an OVERLAY, holding just the members the layers above
+//  its base set, merged in turn, and a table of every key they set or
+//  removed; its base, the lowest layer's object, isn't touched. Lookups
+//  that miss the table fall through to the base. Only reading the
+//  object whole lays its members out in order, once: those set above,
+//  then copies of the base's up to the last one set or removed above,
+//  then the rest of the base's list, shared. Everything else, from a
+//  number to the base's largest subtree or an upper layer's object
+//  without nulls, is pointed to rather than copied, so a merge costs in
+//  proportion to what the upper layers hold, however wide the objects
+//  below them. So an object set over a key the base may have waits to
+//  be merged with the base's member until that's found anyway: when the
+//  key is looked up, or the object laid out.
+
+#include "json.h"
+#include "json_node.h"
+#include "pool.h"
+#include "parse.h"
+#include "overlay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SCANNED_KEYS 8 // objects with fewer members aren't hashed
+#define MIN_SLOTS 8
+
+typedef struct KEYS KEYS;
+
+struct OVERLAY
+    // An object more than one layer has: the members set above its
+    // base, then the base's that aren't
+    {
+    OVERLAY *older; // the view's made before this one
+    JSON *view;
+    JSON_DATA *base; // the lowest layer's object, NULL if none
+    MAP_NODE *members; // the view's, their values merged already
+    MAP_NODE *last;
+    size_t count; // of members
+    size_t keys; // in slots
+    size_t mask; // slots - 1, a power of 2 less 1
+    MAP_NODE **deferred; // as slots, for members whose value is still to
+                         // be merged over the base's: the objects set
+                         // over it, newest first, following next; or
+                         // NULL if there have been none
+    size_t deferrals; // in deferred
+    MAP_NODE *slots[]; // by key, each member and each null that removed
+                       // one (members are never null); NULL if empty
+    };
+
+struct KEYS
+    // An upper object's members, found by key, and which of them a
+    // member below has been merged with
+    {
+    MAP_NODE **members;
+    bool *taken;
+    size_t *slots; // member index + 1, 0 if empty; NULL if scanned
+    size_t mask;
+    size_t n;
+    };
+
+static uint64_t key_hash(const char *key, size_t length)
+    // FNV-1a
+    {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < length; ++i)
+        h = (h ^ (unsigned char)key[i]) * 0x100000001B3ull;
+    return h;
+    }
+
+static bool keys_open(KEYS *keys, JSON_DATA *object)
+    {
+    size_t n = object->length;
+    size_t slots = 0;
+    if (n >= SCANNED_KEYS)
+        for (slots = SCANNED_KEYS * 2; slots < n * 2; slots *= 2)
+            ;
+    // One block: members, slots, then the flags
+    char *block = (char *)calloc(1, n * sizeof(MAP_NODE *) +
+                                    slots * sizeof(size_t) + n + 1);
+    if (!block)
+        return false;
+    keys->members = (MAP_NODE **)block;
+    keys->slots = slots ? (size_t *)(block + n * sizeof(MAP_NODE *)) : NULL;
+    keys->taken = (bool *)(block + n * sizeof(MAP_NODE *) +
+                           slots * sizeof(size_t));
+    keys->mask = slots - 1;
+    keys->n = n;
+    size_t i = 0;
+    for (MAP_NODE *member = object->data.map; member; member = member->next)
+        {
+        keys->members[i++] = member;
+        if (keys->slots)
+            {
+            size_t slot = key_hash(member->key, member->key_length);
+            while (keys->slots[slot &= keys->mask])
+                ++slot;
+            keys->slots[slot] = i;
+            }
+        }
+    return true;
+    }
+
+static MAP_NODE *keys_take(KEYS *keys, const char *key, size_t length)
+    // The member with the key, marked taken, or NULL if none
+    {
+    size_t i;
+    if (keys->slots)
+        {
+        size_t slot = key_hash(key, length);
+        for (;; ++slot)
+            {
+            if (!(i = keys->slots[slot &= keys->mask]))
+                return NULL;
+            MAP_NODE *member = keys->members[--i];
+            if (member->key_length == length &&
+                !memcmp(member->key, key, length))
+                break;
+            }
+        }
+    else
+        {
+        for (i = 0; i < keys->n; ++i)
+            if (keys->members[i]->key_length == length &&
+                !memcmp(keys->members[i]->key, key, length))
+                break;
+        if (i == keys->n)
+            return NULL;
+        }
+    keys->taken[i] = true;
+    return keys->members[i];
+    }
+
+static MAP_NODE **find_in(MAP_NODE **slots, size_t mask, const char *key,
+                          size_t length)
+    // The key's slot, or the empty one where it would go
+    {
+    for (size_t i = key_hash(key, length) & mask;; i = (i + 1) & mask)
+        {
+        MAP_NODE *slot = slots[i];
+        if (!slot ||
+            (slot->key_length == length && !memcmp(slot->key, key, length)))
+            return &slots[i];
+        }
+    }
+
+static MAP_NODE **find_slot(OVERLAY *overlay, const char *key,
+                            size_t length)
+    {
+    return find_in(overlay->slots, overlay->mask, key, length);
+    }
+
+static MAP_NODE *find_deferred(OVERLAY *overlay, const char *key,
+                               size_t length)
+    // The objects to merge over the base's member with the key, or NULL
+    {
+    return overlay->deferrals ?
+        *find_in(overlay->deferred, overlay->mask, key, length) : NULL;
+    }
+
+static void set_key(OVERLAY *overlay, MAP_NODE *member)
+    {
+    MAP_NODE **slot = find_slot(overlay, member->key, member->key_length);
+    if (!*slot)
+        ++overlay->keys;
+    *slot = member;
+    }
+
+static JSON_DATA *find_member(JSON_DATA *object, const char *key,
+                              size_t length)
+    {
+    for (MAP_NODE *member = object->data.map; member; member = member->next)
+        if (member->key_length == length && !memcmp(member->key, key, length))
+            return member->data;
+    return NULL;
+    }
+
+static JSON_DATA *new_overlay(JSON *view, JSON_DATA *base, size_t keys)
+    // An object with nothing set over the base yet, with room for the
+    // keys. Returns NULL if out of memory.
+    {
+    size_t slots = MIN_SLOTS;
+    while (slots < keys * 2) // at most half full
+        slots *= 2;
+    JSON_DATA *object = (JSON_DATA *)PoolAlloc(view->data_pool);
+    OVERLAY *overlay = (OVERLAY *)calloc(1, sizeof(OVERLAY) +
+                                            slots * sizeof(MAP_NODE *));
+    if (!object || !overlay)
+        {
+        free(overlay);
+        return NULL;
+        }
+    overlay->older = view->overlays;
+    view->overlays = overlay;
+    overlay->view = view;
+    overlay->base = base;
+    overlay->mask = slots - 1;
+    object->type = JSON_TYPE_MAP;
+    object->refs = 0; // views don't change
+    object->built = 0;
+    object->overlay = 1;
+    object->data.overlay = overlay;
+    object->length = 0; // counted when laid out
+    object->hash = 0;
+    return object;
+    }
+
+static bool add(OVERLAY *overlay, MAP_NODE *from, JSON_DATA *value)
+    // A member with from's key and the value, after the last
+    {
+    MAP_NODE *member = (MAP_NODE *)PoolAlloc(overlay->view->map_pool);
+    if (!member)
+        return false;
+    member->key = from->key;
+    member->key_length = from->key_length;
+    member->data = value;
+    member->next = NULL;
+    if (overlay->last)
+        overlay->last->next = member;
+    else
+        overlay->members = member;
+    overlay->last = member;
+    ++overlay->count;
+    set_key(overlay, member);
+    return true;
+    }
+
+static bool defer(OVERLAY *overlay, MAP_NODE *from, JSON_DATA *value,
+                  MAP_NODE *older)
+    // Records that the value, with from's key, is to be merged over the
+    // base's member after the older objects (NULL if none) are. The
+    // member set for the key must be the last added.
+    {
+    MAP_NODE *patch = (MAP_NODE *)PoolAlloc(overlay->view->map_pool);
+    if (!patch || (!overlay->deferred &&
+                   !(overlay->deferred = (MAP_NODE **)calloc(
+                         overlay->mask + 1, sizeof(MAP_NODE *)))))
+        return false;
+    patch->key = from->key;
+    patch->key_length = from->key_length;
+    patch->data = value;
+    patch->next = older;
+    *find_in(overlay->deferred, overlay->mask, from->key,
+             from->key_length) = patch;
+    ++overlay->deferrals;
+    return true;
+    }
+
+static JSON_DATA *merge(JSON *, JSON_DATA *lower, JSON_DATA *upper);
+
+static JSON_DATA *apply(JSON *view, JSON_DATA *lower, MAP_NODE *patch)
+    // The patch's value merged over lower, after the older ones
+    {
+    if (patch->next && !(lower = apply(view, lower, patch->next)))
+        return NULL;
+    return merge(view, lower, patch->data);
+    }
+
+static bool resolve(OVERLAY *overlay, MAP_NODE *patch, JSON_DATA *under)
+    // Gives the member with the patch's key its value merged over under,
+    // the base's member (NULL if none), and drops the patch
+    {
+    JSON_DATA *value = apply(overlay->view, under, patch);
+    if (!value)
+        return false;
+    (*find_slot(overlay, patch->key, patch->key_length))->data = value;
+
+    // Empty its slot, moving back entries that probed past it
+    MAP_NODE **slots = overlay->deferred;
+    size_t i = find_in(slots, overlay->mask, patch->key,
+                       patch->key_length) - slots;
+    for (size_t j = (i + 1) & overlay->mask; slots[j];
+         j = (j + 1) & overlay->mask)
+        {
+        size_t home = key_hash(slots[j]->key, slots[j]->key_length) &
+                      overlay->mask;
+        // Entries whose probe starts after i (cyclically) stay put
+        if (i < j ? i < home && home <= j : i < home || home <= j)
+            continue;
+        slots[i] = slots[j];
+        i = j;
+        }
+    slots[i] = NULL;
+    --overlay->deferrals;
+    return true;
+    }
+
+static bool has_null(JSON_DATA *object)
+    // Whether merging the object over nothing would take anything out
+    // (or, if it can't be read, leave that to the merge to find)
+    {
+    if (object->overlay && !overlay_flatten(object))
+        return true;
+    for (MAP_NODE *member = object->data.map; member; member = member->next)
+        if (member->data->type == JSON_TYPE_NULL ||
+            (member->data->type == JSON_TYPE_MAP && has_null(member->data)))
+            return true;
+    return false;
+    }
+
+static JSON_DATA *merge(JSON *view, JSON_DATA *lower, JSON_DATA *upper)
+    // upper over lower (NULL if there's nothing below), as RFC 7386
+    // merges a patch. Returns NULL if out of memory.
+    {
+    if (upper->overlay && !overlay_flatten(upper))
+        return NULL; // another view's, read whole
+    if (upper->type != JSON_TYPE_MAP)
+        return upper;
+    if (lower && lower->type != JSON_TYPE_MAP)
+        lower = NULL; // replaced, but upper's nulls still go
+    if (!lower && !has_null(upper))
+        return upper; // nothing to take out, so shared
+    if (lower && !upper->length)
+        return lower; // nor anything to set
+    OVERLAY *below = lower && lower->overlay ? lower->data.overlay : NULL;
+    KEYS keys;
+    if (!keys_open(&keys, upper))
+        return NULL;
+    JSON_DATA *merged = new_overlay(view, below ? below->base : lower,
+                                    (below ? below->keys : 0) + keys.n);
+    if (!merged)
+        {
+        free(keys.members);
+        return NULL;
+        }
+    OVERLAY *overlay = merged->data.overlay;
+
+    // What the layers below set, in their order, over the same base
+    bool good = true;
+    for (MAP_NODE *member = below ? below->members : NULL;
+         member && good; member = member->next)
+        {
+        JSON_DATA *value = member->data;
+        MAP_NODE *over = keys_take(&keys, member->key, member->key_length);
+        MAP_NODE *patch = find_deferred(below, member->key,
+                                        member->key_length);
+        if (over && over->data->type == JSON_TYPE_NULL)
+            set_key(overlay, over); // removed
+        else if (patch && (!over || over->data->type == JSON_TYPE_MAP))
+            // Still waiting for the base's member, now with more to merge
+            good = add(overlay, member, over ? over->data : value) &&
+                   (over ? defer(overlay, member, over->data, patch) :
+                           defer(overlay, member, patch->data, patch->next));
+        else
+            good = (!over || (value = merge(view, value, over->data))) &&
+                   add(overlay, member, value);
+        }
+    for (size_t i = 0; below && i <= below->mask && good; ++i)
+        {
+        MAP_NODE *gone = below->slots[i];
+        if (!gone || gone->data->type != JSON_TYPE_NULL)
+            continue;
+        MAP_NODE *over = keys_take(&keys, gone->key, gone->key_length);
+        JSON_DATA *value;
+        if (!over || over->data->type == JSON_TYPE_NULL)
+            set_key(overlay, gone); // still removed
+        else
+            good = (value = merge(view, NULL, over->data)) &&
+                   add(overlay, over, value);
+        }
+
+    // Then what's new in upper, in its order: only objects need what
+    // the base has for them
+    for (size_t i = 0; i < keys.n && good; ++i)
+        {
+        MAP_NODE *member = keys.members[i];
+        JSON_DATA *value = member->data;
+        if (keys.taken[i])
+            continue;
+        if (value->type == JSON_TYPE_NULL)
+            {
+            set_key(overlay, member); // removed
+            continue;
+            }
+        if (value->type == JSON_TYPE_MAP && overlay->base)
+            good = add(overlay, member, value) &&
+                   defer(overlay, member, value, NULL);
+        else
+            good = (value = merge(view, NULL, value)) &&
+                   add(overlay, member, value);
+        }
+    free(keys.members);
+    return good ? merged : NULL;
+    }
+
+static bool is_set(OVERLAY *overlay, MAP_NODE **few, MAP_NODE *member)
+    // Whether the layers above the base set or removed the member's
+    // key. With few keys, comparing them all is cheaper than hashing.
+    {
+    if (overlay->keys >= SCANNED_KEYS)
+        return *find_slot(overlay, member->key, member->key_length);
+    for (size_t i = 0; i < overlay->keys; ++i)
+        if (few[i]->key_length == member->key_length &&
+            !memcmp(few[i]->key, member->key, member->key_length))
+            return true;
+    return false;
+    }
+
+bool overlay_flatten(JSON_DATA *object)
+    {
+    OVERLAY *overlay = object->data.overlay;
+    MAP_NODE *base = overlay->base ? overlay->base->data.map : NULL;
+
+    // Find the base's members set or removed above, stopping once all
+    // the keys are found
+    MAP_NODE *few[SCANNED_KEYS];
+    if (overlay->keys < SCANNED_KEYS)
+        for (size_t i = 0, n = 0; i <= overlay->mask; ++i)
+            if (overlay->slots[i])
+                few[n++] = overlay->slots[i];
+    MAP_NODE **set = (MAP_NODE **)malloc(overlay->keys * sizeof(MAP_NODE *)
+                                         + 1);
+    if (!set)
+        return false;
+    size_t found = 0;
+    for (MAP_NODE *member = base; member && found < overlay->keys;
+         member = member->next)
+        if (is_set(overlay, few, member))
+            {
+            MAP_NODE *patch = find_deferred(overlay, member->key,
+                                            member->key_length);
+            if (patch && !resolve(overlay, patch, member->data))
+                {
+                free(set);
+                return false;
+                }
+            set[found++] = member;
+            }
+    // What's still deferred has nothing in the base to merge over
+    for (size_t i = 0; overlay->deferrals && i <= overlay->mask; )
+        if (!overlay->deferred[i])
+            ++i;
+        else if (!resolve(overlay, overlay->deferred[i], NULL))
+            {
+            free(set);
+            return false;
+            }
+
+    // Those before the last of them are copied, skipping them; the rest
+    // are the base's, shared
+    MAP_NODE *copies = NULL;
+    MAP_NODE **link = &copies;
+    MAP_NODE *member = base;
+    for (size_t i = 0; i < found; member = member->next)
+        {
+        if (member == set[i])
+            {
+            ++i;
+            continue;
+            }
+        MAP_NODE *copy = (MAP_NODE *)PoolAlloc(overlay->view->map_pool);
+        if (!copy)
+            {
+            free(set);
+            return false;
+            }
+        *copy = *member;
+        *link = copy;
+        link = &copy->next;
+        }
+    *link = member;
+    free(set);
+
+    if (overlay->last)
+        overlay->last->next = copies;
+    else
+        overlay->members = copies;
+    object->data.map = overlay->members;
+    object->length = overlay->count +
+                     (base ? overlay->base->length - found : 0);
+    object->overlay = 0;
+    return true;
+    }
+
+JSON_DATA *overlay_find(JSON_DATA *object, const char *key, size_t length)
+    {
+    OVERLAY *overlay = object->data.overlay;
+    MAP_NODE *set = *find_slot(overlay, key, length);
+    if (!set)
+        return overlay->base ? find_member(overlay->base, key, length) :
+                               NULL;
+    MAP_NODE *patch = find_deferred(overlay, key, length);
+    if (patch &&
+        !resolve(overlay, patch, find_member(overlay->base, key, length)))
+        return NULL;
+    return set->data->type == JSON_TYPE_NULL ? NULL : set->data;
+    }
+
+void overlay_destroy(JSON *json)
+    {
+    while (json->overlays)
+        {
+        OVERLAY *older = json->overlays->older;
+        free(json->overlays->deferred);
+        free(json->overlays);
+        json->overlays = older;
+        }
+    }
+
+JSON *json_overlay(JSON_DATA **layers, size_t n_layers)
+    {
+    if (!n_layers)
+        return NULL;
+    JSON *view = parse_create();
+    if (!view)
+        return NULL;
+    view->view = true;
+    JSON_DATA *merged = layers[0];
+    for (size_t i = 1; i < n_layers && merged; ++i)
+        merged = merge(view, merged, layers[i]);
+    if (!merged)
+        {
+        json_destroy(view);
+        return NULL;
+        }
+    view->data = merged;
+    return view;
+    }
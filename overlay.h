@@ -0,0 +1,22 @@
+//  overlay.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  What json_overlay's objects need from the rest of the library, which
+//  looks their members up here and lays them out (see overlay_flatten
+//  in json_node.h) before reading them in order.
+
+#ifndef __mmijson_overlay_h
+#define __mmijson_overlay_h
+
+#include "json.h"
+
+JSON_DATA *overlay_find(JSON_DATA *, const char *key, size_t length);
+// The value of the object's member with the key, or NULL if none (or
+// out of memory merging it), without laying its members out.
+
+void overlay_destroy(JSON *);
+// Frees what the view's objects keep outside its pools.
+
+#endif
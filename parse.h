@@ -0,0 +1,25 @@
+//  parse.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Parser entry points for library sources that parse into documents
+//  of their own, reusing them from one parse to the next.
+
+#ifndef __mmijson_parse_h
+#define __mmijson_parse_h
+
+#include "json.h"
+
+JSON *parse_create(void);
+// An empty document, to parse into and json_destroy when done.
+
+JSON_ERROR parse_buffer_into(JSON *, const char *, size_t length,
+                             const JSON_PARSE_OPTIONS *);
+// json_parse_buffer_opts into an empty document, which keeps whatever
+// was parsed on failure too.
+
+void parse_recycle(JSON *);
+// Empties the document, keeping its pools' memory for the next parse.
+
+#endif
@@ -0,0 +1,484 @@
+//  paths.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Loading many files at once. On Linux the reads go through an
+//  io_uring (set up with raw system calls, no liburing needed) so that
+//  up to QUEUE_DEPTH of them are in flight at a time, and files are
+//  parsed as their reads complete, while the others are still being
+//  read. Elsewhere, or if the kernel refuses a ring, a pool of threads
+//  each reads (pread) and parses files on its own. Build with
+//  JSON_NO_URING to always use the pool.
+
+#include "json.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(JSON_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PATHS_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define QUEUE_DEPTH 64
+#define POOL_THREADS 8 // reads block, so the pool wants more than cores
+#define MAX_READ (1 << 30)
+#define MAX_THREADS 64
+
+typedef struct BATCH BATCH;
+
+struct BATCH
+    {
+    const char **paths;
+    size_t n;
+    JSON **results;
+    size_t next; // next path for the thread pool
+    pthread_mutex_t lock; // the rest is for parsing on several threads
+    pthread_cond_t wake;
+    size_t *ready; // indices of read files, in completion order
+    char **buffers;
+    size_t ready_count;
+    size_t taken;
+    bool reading; // more files may still become ready
+    };
+
+static char *read_whole(int fd, size_t size)
+    // NUL terminated contents of a regular file of the given size
+    {
+    char *buffer = (char *)malloc(size + 1);
+    size_t done = 0;
+    while (buffer && done < size)
+        {
+        ssize_t n = pread(fd, buffer + done, size - done, done);
+        if (n < 0)
+            {
+            free(buffer);
+            return NULL;
+            }
+        if (!n)
+            break; // the file shrank
+        done += n;
+        }
+    if (buffer)
+        buffer[done] = '\0';
+    return buffer;
+    }
+
+static JSON *load_file(const char *path)
+    // Everything for one file, blocking
+    {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    JSON *json = NULL;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size)
+        {
+        char *buffer = read_whole(fd, st.st_size);
+        if (buffer)
+            json = json_parse_string(buffer, true);
+        close(fd);
+        }
+    else
+        {
+        // Pipes, devices and files that claim to be empty: read until
+        // end of file instead
+        FILE *f = fdopen(fd, "r");
+        if (f)
+            {
+            json = json_parse_file(f);
+            fclose(f);
+            }
+        else
+            close(fd);
+        }
+    return json;
+    }
+
+static void *pool_thread(void *arg)
+    {
+    BATCH *batch = (BATCH *)arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+           batch->n)
+        batch->results[i] = load_file(batch->paths[i]);
+    return NULL;
+    }
+
+static void start_threads(pthread_t *threads, unsigned *count,
+                          void *(*fn)(void *), BATCH *batch)
+    // Starts up to *count threads, storing how many did start
+    {
+    unsigned wanted = *count;
+    for (*count = 0; *count < wanted; ++*count)
+        if (pthread_create(&threads[*count], NULL, fn, batch))
+            break;
+    }
+
+static void join_threads(pthread_t *threads, unsigned count)
+    {
+    while (count)
+        pthread_join(threads[--count], NULL);
+    }
+
+#ifdef PATHS_URING
+
+typedef struct RING RING;
+typedef struct LOAD LOAD;
+
+struct RING
+    {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned to_submit;
+    };
+
+struct LOAD
+    // A file being read
+    {
+    size_t index;
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t done;
+    bool busy;
+    LOAD *next_free;
+    };
+
+static void *parse_thread(void *arg)
+    // Parses files as the reader hands them over, until it is done
+    {
+    BATCH *batch = (BATCH *)arg;
+    pthread_mutex_lock(&batch->lock);
+    for (;;)
+        {
+        if (batch->taken < batch->ready_count)
+            {
+            size_t i = batch->ready[batch->taken++];
+            pthread_mutex_unlock(&batch->lock);
+            batch->results[i] = json_parse_string(batch->buffers[i], true);
+            pthread_mutex_lock(&batch->lock);
+            }
+        else if (batch->reading)
+            pthread_cond_wait(&batch->wake, &batch->lock);
+        else
+            break;
+        }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+    }
+
+static void parse_ready(BATCH *batch, bool parallel, size_t i, char *buffer)
+    {
+    if (!buffer)
+        return;
+    if (!parallel)
+        {
+        batch->results[i] = json_parse_string(buffer, true);
+        return;
+        }
+    pthread_mutex_lock(&batch->lock);
+    batch->buffers[i] = buffer;
+    batch->ready[batch->ready_count++] = i;
+    pthread_cond_signal(&batch->wake);
+    pthread_mutex_unlock(&batch->lock);
+    }
+
+static void ring_close(RING *ring)
+    {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map)
+        munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    }
+
+static bool ring_open(RING *ring, unsigned entries)
+    {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return false;
+
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p.cq_off.cqes +
+                        p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_map_size > ring->sq_map_size)
+        ring->sq_map_size = ring->cq_map_size;
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    void *map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+        {
+        ring_close(ring);
+        return false;
+        }
+    ring->sq_map = map;
+    if (single)
+        ring->cq_map = map;
+    else if ((map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING)) != MAP_FAILED)
+        ring->cq_map = map;
+    if (!ring->cq_map ||
+        (map = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES)) == MAP_FAILED)
+        {
+        ring_close(ring);
+        return false;
+        }
+    ring->sqes = (struct io_uring_sqe *)map;
+
+    char *sq = (char *)ring->sq_map;
+    char *cq = (char *)ring->cq_map;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+    }
+
+static void queue_read(RING *ring, LOAD *load)
+    // Never more than QUEUE_DEPTH loads are in flight, each with at most
+    // one read, so the submission queue can't overflow
+    {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    size_t length = load->size - load->done;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = load->fd;
+    sqe->addr = (uintptr_t)(load->buffer + load->done);
+    sqe->len = length > MAX_READ ? MAX_READ : length;
+    sqe->off = load->done;
+    sqe->user_data = (uintptr_t)load;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->to_submit;
+    }
+
+static bool ring_enter(RING *ring)
+    // Submits what's queued and waits for at least one completion
+    {
+    for (;;)
+        {
+        long n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0)
+            {
+            ring->to_submit -= n;
+            return true;
+            }
+        if (errno != EINTR)
+            return false;
+        }
+    }
+
+static bool start_load(RING *ring, LOAD *load, BATCH *batch)
+    // Opens a file and queues its first read. Returns false if the file
+    // was dealt with on the spot instead.
+    {
+    const char *path = batch->paths[load->index];
+    struct stat st;
+    load->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (load->fd < 0)
+        return false;
+    if (fstat(load->fd, &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+        !(load->buffer = (char *)malloc(st.st_size + 1)))
+        {
+        close(load->fd);
+        batch->results[load->index] = load_file(path);
+        return false;
+        }
+    load->size = st.st_size;
+    load->done = 0;
+    queue_read(ring, load);
+    return true;
+    }
+
+static bool uring_batch(BATCH *batch, RING *ring, bool parallel)
+    // Returns false if the ring failed; then batch->next is where the
+    // thread pool should carry on
+    {
+    LOAD loads[QUEUE_DEPTH];
+    LOAD *free_loads = NULL;
+    for (int i = 0; i < QUEUE_DEPTH; ++i)
+        {
+        loads[i].busy = false;
+        loads[i].next_free = free_loads;
+        free_loads = &loads[i];
+        }
+    unsigned in_flight = 0;
+    size_t next = 0;
+    for (;;)
+        {
+        while (free_loads && next < batch->n)
+            {
+            LOAD *load = free_loads;
+            load->index = next++;
+            if (start_load(ring, load, batch))
+                {
+                free_loads = load->next_free;
+                load->busy = true;
+                ++in_flight;
+                }
+            }
+        if (!in_flight)
+            return true;
+        if (!ring_enter(ring))
+            {
+            // The kernel may still write to the buffers of reads it
+            // accepted, so those are left to leak; read the files again
+            for (int i = 0; i < QUEUE_DEPTH; ++i)
+                if (loads[i].busy)
+                    {
+                    close(loads[i].fd);
+                    batch->results[loads[i].index] =
+                        load_file(batch->paths[loads[i].index]);
+                    }
+            batch->next = next;
+            return false;
+            }
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            {
+            struct io_uring_cqe *cqe = &ring->cqes[head++ & *ring->cq_mask];
+            LOAD *load = (LOAD *)(uintptr_t)cqe->user_data;
+            if (cqe->res > 0 && (load->done += cqe->res) < load->size)
+                {
+                queue_read(ring, load); // short read, ask for the rest
+                continue;
+                }
+            close(load->fd);
+            if (cqe->res < 0)
+                {
+                // An old kernel without IORING_OP_READ, say: try again
+                // the slow way
+                free(load->buffer);
+                batch->results[load->index] =
+                    load_file(batch->paths[load->index]);
+                }
+            else
+                {
+                load->buffer[load->done] = '\0'; // 0 if the file shrank
+                parse_ready(batch, parallel, load->index, load->buffer);
+                }
+            load->busy = false;
+            load->next_free = free_loads;
+            free_loads = load;
+            --in_flight;
+            }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+
+static bool uring_paths(BATCH *batch, unsigned threads)
+    // Returns false if the thread pool should carry on from batch->next
+    {
+    RING ring;
+    if (!ring_open(&ring, QUEUE_DEPTH))
+        return false;
+    pthread_t parsers[MAX_THREADS];
+    unsigned count = 0;
+    if (threads > 1 &&
+        (batch->ready = (size_t *)malloc(batch->n * sizeof(size_t))) &&
+        (batch->buffers = (char **)malloc(batch->n * sizeof(char *))))
+        {
+        batch->reading = true;
+        count = threads;
+        start_threads(parsers, &count, parse_thread, batch);
+        }
+    bool done = uring_batch(batch, &ring, count > 0);
+    ring_close(&ring);
+    if (count)
+        {
+        pthread_mutex_lock(&batch->lock);
+        batch->reading = false;
+        pthread_cond_broadcast(&batch->wake);
+        pthread_mutex_unlock(&batch->lock);
+        parse_thread(batch); // help with what's left
+        join_threads(parsers, count);
+        }
+    free(batch->ready);
+    free(batch->buffers);
+    return done;
+    }
+
+#endif
+
+static void run_pool(BATCH *batch, unsigned threads)
+    // Reads and parses from batch->next on, this thread included
+    {
+    pthread_t pool[MAX_THREADS];
+    unsigned count = threads > POOL_THREADS ? threads : POOL_THREADS;
+    if (count > batch->n - batch->next)
+        count = batch->n - batch->next;
+    if (count)
+        --count; // this thread is one of them
+    start_threads(pool, &count, pool_thread, batch);
+    pool_thread(batch);
+    join_threads(pool, count);
+    }
+
+size_t json_parse_paths(const char **paths, size_t n, JSON **results,
+                        unsigned threads)
+    {
+    BATCH batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.paths = paths;
+    batch.n = n;
+    batch.results = results;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.wake, NULL);
+    for (size_t i = 0; i < n; ++i)
+        results[i] = NULL;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+#ifdef PATHS_URING
+    if (!n || !uring_paths(&batch, threads))
+#endif
+        run_pool(&batch, threads);
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.wake);
+    size_t parsed = 0;
+    for (size_t i = 0; i < n; ++i)
+        parsed += results[i] != NULL;
+    return parsed;
+    }
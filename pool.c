@@ -4,14 +4,19 @@
 //  This code is licensed under MIT license (see LICENSE for details)
 
 #include "pool.h"
+#include "profile.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 
-/* This is supposed to be concerned with alignment, hopefully this
- * value makes sense... not sure what the significance of substracting
- * 16 is.
+/* Chunks come in slabs of up to POOL_SLAB_CHUNKS, doubling from one as
+ * the pool grows. A pool with an owner aligns them to their size, so
+ * that the chunk (and with it the pool) an element came from is found
+ * by rounding its address down.
  */
-#define POOL_CHUNK_SIZE (1024*8-16)
+#define POOL_CHUNK_BYTES (1024*8)
+#define POOL_CHUNK_SIZE (POOL_CHUNK_BYTES - 2*sizeof(void *) - sizeof(size_t))
+#define POOL_SLAB_CHUNKS 8
 
 struct PoolLink
     {
@@ -20,40 +25,71 @@ struct PoolLink
 
 struct PoolChunk
     {
-    struct PoolChunk *next;
+    struct PoolChunk *next; /* the next slab, kept in a slab's first */
+    Pool *pool;
+    size_t count; /* chunks in the slab, kept in its first */
     char mem[POOL_CHUNK_SIZE];
     };
 
 struct Pool
     {
-    struct PoolChunk *chunks;
+    struct PoolChunk *chunks; /* the first of each slab */
     size_t esize;
     struct PoolLink *head;
+    void *owner;
+    size_t slab; /* chunks in the next slab */
     };
 
 
+static void
+thread_chunk(Pool *target, struct PoolChunk *chunk)
+    /* Puts every element of the chunk on the free list. */
+    {
+    const int nelem = POOL_CHUNK_SIZE / target->esize;
+    char *start = chunk->mem;
+    char *last = &start[(nelem-1)*target->esize];
+    char *p;
+
+    for (p = start; p < last; p += target->esize)
+        ((struct PoolLink *)p)->next = 
+            (struct PoolLink *)(p + target->esize);
+
+    ((struct PoolLink *)last)->next = target->head;
+    target->head = (struct PoolLink *)start;
+    }
+
+static void
+thread_slab(Pool *target, struct PoolChunk *slab)
+    {
+    size_t i;
+
+    for (i = 0; i < slab->count; ++i)
+        thread_chunk(target, &slab[i]);
+    }
+
 static int 
 grow(Pool *target)
     {
-    struct PoolChunk *newChunk = 
-        (struct PoolChunk *)malloc(sizeof(struct PoolChunk));
+    size_t size = target->slab * sizeof(struct PoolChunk);
+    void *memory;
 
-    if (newChunk)
+    if (target->owner ?
+            !posix_memalign(&memory, POOL_CHUNK_BYTES, size) :
+            (memory = malloc(size)) != NULL)
         {
-        const int nelem = POOL_CHUNK_SIZE / target->esize;
-        char *start = newChunk->mem;
-        char *last = &start[(nelem-1)*target->esize];
-        char *p;
-
-        for (p = start; p < last; p += target->esize)
-            ((struct PoolLink *)p)->next = 
-                (struct PoolLink *)(p + target->esize);
+        struct PoolChunk *newSlab = (struct PoolChunk *)memory;
+        size_t i;
 
-        ((struct PoolLink *)last)->next = NULL;
-        target->head = (struct PoolLink *)start;
+        PROFILE_COUNT(pool_grows, 1);
+        for (i = 0; i < target->slab; ++i)
+            newSlab[i].pool = target;
+        newSlab->count = target->slab;
+        thread_slab(target, newSlab);
 
-        newChunk->next = target->chunks;
-        target->chunks = newChunk;
+        newSlab->next = target->chunks;
+        target->chunks = newSlab;
+        if (target->slab < POOL_SLAB_CHUNKS)
+            target->slab *= 2;
 
         return 0; /* good */
         }
@@ -71,11 +107,29 @@ PoolCreate(size_t size)
 
     target->head = NULL;
     target->chunks = NULL;
+    target->owner = NULL;
+    target->slab = 1;
 
     return target;
     }
 
 
+void
+PoolSetOwner(Pool *target, void *owner)
+    {
+    target->owner = owner;
+    }
+
+
+void *
+PoolOwner(const void *p)
+    {
+    const struct PoolChunk *chunk = (const struct PoolChunk *)
+        ((uintptr_t)p & ~(uintptr_t)(POOL_CHUNK_BYTES - 1));
+    return chunk->pool->owner;
+    }
+
+
 void
 PoolDestroy(Pool *target)
     {
@@ -107,6 +161,17 @@ PoolAlloc(Pool *target)
     }
 
 
+void
+PoolClear(Pool *target)
+    {
+    struct PoolChunk *n;
+
+    target->head = NULL;
+    for (n = target->chunks; n; n = n->next)
+        thread_slab(target, n);
+    }
+
+
 void
 PoolFree(Pool *target, void *b)
     {
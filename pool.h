@@ -32,13 +32,25 @@ void *PoolAlloc(Pool *target);
     /* Returns a pointer to a new allocation or NULL on failure. The
      * contents of the memory are undefined. */
 
+void PoolClear(Pool *target);
+    /* Releases every allocation made from the pool at once, keeping
+     * its memory for re-use. */
+
 void PoolFree(Pool *target, void *p);
     /* Releases a previously allocated element for re-use.  Calling
      * this on anything other than a value returned from PoolAlloc
      * called on the same pool, is undefined. */
 
+void PoolSetOwner(Pool *target, void *owner);
+    /* Records what the pool's allocations belong to, for PoolOwner.
+     * Call it before the first PoolAlloc. */
+
+void *PoolOwner(const void *p);
+    /* The owner set for the pool p was allocated from, or NULL if none
+     * was.  p must be a live allocation from some pool. */
 
-#ifdef __cpluscpus
+
+#ifdef __cplusplus
 }
 #endif
 
@@ -0,0 +1,84 @@
+//  profile.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Parse statistics, see JSON_STATS. Only collected when built with
+//  JSON_PROFILE; otherwise the calls below report that there is
+//  nothing to read.
+
+#include "json.h"
+#include "profile.h"
+
+#include <string.h>
+
+#ifdef JSON_PROFILE
+
+__thread JSON_STATS json_profile_stats;
+
+static JSON_STATS_HOOK *stats_hook;
+static void *stats_context;
+
+void json_profile_begin(PROFILE_PARSE *parse)
+    {
+    parse->before = json_profile_stats;
+    parse->start = profile_clock();
+    }
+
+void json_profile_end(PROFILE_PARSE *parse, size_t bytes_scanned)
+    {
+    json_profile_stats.time_total += profile_clock() - parse->start;
+    json_profile_stats.bytes_scanned += bytes_scanned;
+    ++json_profile_stats.parses;
+
+    JSON_STATS_HOOK *hook = __atomic_load_n(&stats_hook, __ATOMIC_ACQUIRE);
+    if (hook)
+        {
+        // Every field is a uint64_t counter, so this parse's share is
+        // the field by field difference
+        JSON_STATS delta;
+        const uint64_t *now = (const uint64_t *)&json_profile_stats;
+        const uint64_t *then = (const uint64_t *)&parse->before;
+        uint64_t *out = (uint64_t *)&delta;
+        for (size_t i = 0; i < sizeof(JSON_STATS) / sizeof(uint64_t); ++i)
+            out[i] = now[i] - then[i];
+        hook(&delta, __atomic_load_n(&stats_context, __ATOMIC_ACQUIRE));
+        }
+    }
+
+bool json_get_stats(JSON_STATS *stats)
+    {
+    *stats = json_profile_stats;
+    return true;
+    }
+
+void json_reset_stats(void)
+    {
+    memset(&json_profile_stats, 0, sizeof(json_profile_stats));
+    }
+
+bool json_set_stats_hook(JSON_STATS_HOOK *hook, void *context)
+    {
+    __atomic_store_n(&stats_context, context, __ATOMIC_RELEASE);
+    __atomic_store_n(&stats_hook, hook, __ATOMIC_RELEASE);
+    return true;
+    }
+
+#else
+
+bool json_get_stats(JSON_STATS *stats)
+    {
+    memset(stats, 0, sizeof(*stats));
+    return false;
+    }
+
+void json_reset_stats(void)
+    {
+    }
+
+bool json_set_stats_hook(JSON_STATS_HOOK *hook, void *context)
+    {
+    return false;
+    }
+
+#endif
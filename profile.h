@@ -0,0 +1,58 @@
+//  profile.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Instrumentation for libraries built with JSON_PROFILE. Without it
+//  every macro here expands to nothing, so instrumented code costs
+//  nothing either.
+
+#ifndef __mmijson_profile_h
+#define __mmijson_profile_h
+
+#include "json.h"
+
+#ifdef JSON_PROFILE
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define profile_clock() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t profile_clock(void)
+    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+#endif
+
+typedef struct PROFILE_PARSE
+    {
+    JSON_STATS before;
+    uint64_t start;
+    } PROFILE_PARSE;
+
+extern __thread JSON_STATS json_profile_stats;
+
+void json_profile_begin(PROFILE_PARSE *);
+void json_profile_end(PROFILE_PARSE *, size_t bytes_scanned);
+
+#define PROFILE_COUNT(field, n) (json_profile_stats.field += (n))
+#define PROFILE_START(name) uint64_t name = profile_clock()
+#define PROFILE_STOP(field, name) \
+    (json_profile_stats.field += profile_clock() - (name))
+#define PROFILE_PARSE_START(name) PROFILE_PARSE name; json_profile_begin(&name)
+#define PROFILE_PARSE_STOP(name, bytes) json_profile_end(&name, bytes)
+
+#else
+
+#define PROFILE_COUNT(field, n) ((void)0)
+#define PROFILE_START(name) ((void)0)
+#define PROFILE_STOP(field, name) ((void)0)
+#define PROFILE_PARSE_START(name) ((void)0)
+#define PROFILE_PARSE_STOP(name, bytes) ((void)0)
+
+#endif
+
+#endif
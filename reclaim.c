@@ -0,0 +1,98 @@
+//  reclaim.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Deferred destruction. Documents handed to json_destroy_deferred go
+//  into a bounded queue drained by a single reclaimer thread, started
+//  on first use, which calls json_destroy on them. When the queue is
+//  full (or the thread can't be started) the caller destroys the
+//  document itself, so memory held by pending documents stays bounded.
+
+#include "json.h"
+
+#include <pthread.h>
+
+#define RECLAIM_QUEUE 64
+
+static struct
+    {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signalled when a document is queued
+    pthread_cond_t done; // signalled when one is destroyed, if flushing
+    JSON *queue[RECLAIM_QUEUE];
+    size_t head; // next to destroy
+    size_t queued;
+    uint64_t added; // documents ever queued, numbering them in order
+    uint64_t destroyed; // of those, the ones the reclaimer is done with
+    size_t flushing; // threads waiting in json_destroy_flush
+    bool running;
+    } reclaim =
+    {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+    };
+
+static pthread_once_t reclaim_once = PTHREAD_ONCE_INIT;
+
+static void *reclaimer(void *arg)
+    {
+    pthread_mutex_lock(&reclaim.lock);
+    for (;;)
+        {
+        while (!reclaim.queued)
+            pthread_cond_wait(&reclaim.work, &reclaim.lock);
+        JSON *doomed = reclaim.queue[reclaim.head];
+        reclaim.head = (reclaim.head + 1) % RECLAIM_QUEUE;
+        --reclaim.queued;
+        pthread_mutex_unlock(&reclaim.lock);
+        json_destroy(doomed);
+        pthread_mutex_lock(&reclaim.lock);
+        ++reclaim.destroyed;
+        if (reclaim.flushing)
+            pthread_cond_broadcast(&reclaim.done);
+        }
+    return NULL;
+    }
+
+static void start_reclaimer(void)
+    {
+    pthread_t thread;
+    if (!pthread_create(&thread, NULL, reclaimer, NULL))
+        {
+        pthread_detach(thread);
+        reclaim.running = true;
+        }
+    }
+
+void json_destroy_deferred(JSON *doomed)
+    {
+    pthread_once(&reclaim_once, start_reclaimer);
+    pthread_mutex_lock(&reclaim.lock);
+    if (!reclaim.running || reclaim.queued == RECLAIM_QUEUE)
+        {
+        // Under pressure the caller pays, which also slows down
+        // whoever is producing garbage faster than it can be freed
+        pthread_mutex_unlock(&reclaim.lock);
+        json_destroy(doomed);
+        return;
+        }
+    reclaim.queue[(reclaim.head + reclaim.queued++) % RECLAIM_QUEUE] = doomed;
+    ++reclaim.added;
+    pthread_cond_signal(&reclaim.work);
+    pthread_mutex_unlock(&reclaim.lock);
+    }
+
+void json_destroy_flush(void)
+    {
+    // The queue is first in, first out, so once as many are destroyed
+    // as had been added by now, those are gone, whatever's been added
+    // since (waiting for an empty queue could wait forever)
+    pthread_mutex_lock(&reclaim.lock);
+    uint64_t added = reclaim.added;
+    ++reclaim.flushing;
+    while (reclaim.destroyed < added)
+        pthread_cond_wait(&reclaim.done, &reclaim.lock);
+    --reclaim.flushing;
+    pthread_mutex_unlock(&reclaim.lock);
+    }
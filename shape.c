@@ -0,0 +1,72 @@
+//  shape.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Shape caches: creation, learning and lookup. Matching a predicted
+//  key against the input is done by the parser itself, see json.c.
+
+#include "json.h"
+#include "shape.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_MAX_SHAPES 4096
+
+JSON_SHAPE_CACHE *json_shape_cache_create(size_t max_keys)
+    {
+    JSON_SHAPE_CACHE *cache = 
+        (JSON_SHAPE_CACHE *)calloc(1, sizeof(JSON_SHAPE_CACHE));
+    if (cache)
+        cache->max_shapes = max_keys ? max_keys : DEFAULT_MAX_SHAPES;
+    return cache;
+    }
+
+void json_shape_cache_destroy(JSON_SHAPE_CACHE *cache)
+    {
+    SHAPE *doomed = cache->all;
+    while (doomed)
+        {
+        SHAPE *next = doomed->all;
+        free(doomed);
+        doomed = next;
+        }
+    free(cache);
+    }
+
+SHAPE *shape_find(SHAPE **children, const char *key, size_t key_length)
+    {
+    SHAPE **link = children;
+    for (SHAPE *shape = *link; shape; link = &shape->sibling, 
+                                      shape = *link)
+        if (shape->key_length == key_length && 
+            !memcmp(shape->key, key, key_length))
+            {
+            *link = shape->sibling;
+            shape->sibling = *children;
+            *children = shape;
+            return shape;
+            }
+    return NULL;
+    }
+
+SHAPE *shape_add(JSON_SHAPE_CACHE *cache, SHAPE **children, const char *key,
+                 size_t key_length)
+    {
+    if (cache->shapes == cache->max_shapes)
+        return NULL;
+    SHAPE *shape = (SHAPE *)malloc(sizeof(SHAPE) + key_length + 1);
+    if (!shape)
+        return NULL;
+    memcpy(shape->key, key, key_length);
+    shape->key[key_length] = '\0';
+    shape->key_length = key_length;
+    shape->child = NULL;
+    shape->sibling = *children;
+    *children = shape;
+    shape->all = cache->all;
+    cache->all = shape;
+    ++cache->shapes;
+    return shape;
+    }
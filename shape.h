@@ -0,0 +1,45 @@
+//  shape.h
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Shape caches (see JSON_SHAPE_CACHE) as the parser sees them: a trie
+//  of the key sequences objects have been seen with. Every path from
+//  the root spells the keys of an object in order, all different, so
+//  an object whose keys keep following a path has no duplicates to
+//  look for.
+
+#ifndef __mmijson_shape_h
+#define __mmijson_shape_h
+
+#include "json.h"
+
+typedef struct SHAPE SHAPE;
+
+struct SHAPE
+    {
+    size_t key_length;
+    SHAPE *child; // the most recently followed first
+    SHAPE *sibling;
+    SHAPE *all; // every shape in the cache, to free them by
+    char key[]; // as in the input, so without escapes
+    };
+
+struct JSON_SHAPE_CACHE
+    {
+    SHAPE *first; // the empty object's children
+    SHAPE *all;
+    size_t shapes;
+    size_t max_shapes;
+    };
+
+SHAPE *shape_find(SHAPE **children, const char *key, size_t key_length);
+// The shape for key among the children (first or some shape's child
+// list), moved to the front, or NULL.
+
+SHAPE *shape_add(JSON_SHAPE_CACHE *, SHAPE **children, const char *key,
+                 size_t key_length);
+// Adds a shape for key at the front of the children, returning NULL if
+// the cache is full (or out of memory).
+
+#endif
@@ -0,0 +1,239 @@
+//  stream.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Pull iteration over a top-level array too big to load at once. A
+//  sliding buffer holds the unread part of the file. Each element's
+//  extent is found by a scan that follows strings and nesting (across
+//  refills), then the element is parsed read-only right where it lies,
+//  into one document that is emptied and reused for every element. The
+//  buffer only ever grows to hold the largest element.
+
+#include "json.h"
+#include "parse.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STREAM_START (64 * 1024)
+
+enum
+    {
+    expect_open, // the '['
+    expect_first, // an element or ']'
+    expect_next, // ',' or ']'
+    expect_eof, // nothing but whitespace
+    finished
+    };
+
+struct JSON_ARRAY_STREAM
+    {
+    FILE *f;
+    char *buffer;
+    size_t size;
+    size_t start; // the first byte not yet consumed
+    size_t fill; // bytes read into the buffer
+    bool eof;
+    int state;
+    JSON *json; // the current element
+    JSON_PARSE_OPTIONS options;
+    };
+
+static bool refill(JSON_ARRAY_STREAM *stream, JSON_ERROR *error)
+    // Slides the unconsumed bytes down and reads more after them,
+    // growing the buffer only when they fill it already. Returns false
+    // at the end of the file, and on errors (setting *error).
+    {
+    if (stream->eof)
+        return false;
+    size_t kept = stream->fill - stream->start;
+    memmove(stream->buffer, stream->buffer + stream->start, kept);
+    stream->start = 0;
+    stream->fill = kept;
+    if (kept == stream->size)
+        {
+        size_t max_bytes = stream->options.max_total_bytes;
+        if (max_bytes && kept > max_bytes)
+            {
+            *error = JSON_TOO_BIG;
+            return false;
+            }
+        char *bigger = (char *)realloc(stream->buffer, stream->size * 2);
+        if (!bigger)
+            {
+            *error = JSON_NO_MEMORY;
+            return false;
+            }
+        stream->buffer = bigger;
+        stream->size *= 2;
+        }
+    size_t got = fread(stream->buffer + stream->fill, 1,
+                       stream->size - stream->fill, stream->f);
+    stream->fill += got;
+    if (!got)
+        {
+        if (ferror(stream->f))
+            *error = JSON_READ_ERROR;
+        stream->eof = true;
+        return false;
+        }
+    return true;
+    }
+
+static int next_char(JSON_ARRAY_STREAM *stream, JSON_ERROR *error)
+    // Skips whitespace and returns the next character, left unconsumed,
+    // or EOF
+    {
+    do
+        {
+        for (; stream->start < stream->fill; ++stream->start)
+            if (!isspace((unsigned char)stream->buffer[stream->start]))
+                return (unsigned char)stream->buffer[stream->start];
+        }
+    while (refill(stream, error));
+    return EOF;
+    }
+
+static size_t element_length(JSON_ARRAY_STREAM *stream, JSON_ERROR *error)
+    // The length of the element at start: through its closing bracket
+    // or quote or, for other values, up to the next separator. Whatever
+    // there is if the file ends first; parsing it will say what's wrong.
+    {
+    char first = stream->buffer[stream->start];
+    bool scalar = first != '{' && first != '[' && first != '"';
+    bool in_string = false;
+    bool escaped = false;
+    size_t depth = 0;
+    size_t length = 0;
+    do
+        {
+        for (; stream->start + length < stream->fill; ++length)
+            {
+            char c = stream->buffer[stream->start + length];
+            if (scalar)
+                {
+                if (c == ',' || c == ']' || c == '}' ||
+                    isspace((unsigned char)c))
+                    return length;
+                }
+            else if (in_string)
+                {
+                if (escaped)
+                    escaped = false;
+                else if (c == '\\')
+                    escaped = true;
+                else if (c == '"' && (in_string = false, !depth))
+                    return length + 1;
+                }
+            else if (c == '"')
+                in_string = true;
+            else if (c == '{' || c == '[')
+                ++depth;
+            else if ((c == '}' || c == ']') && !--depth)
+                return length + 1;
+            }
+        }
+    while (refill(stream, error));
+    return length;
+    }
+
+JSON_ARRAY_STREAM *json_array_stream_open(FILE *f)
+    {
+    return json_array_stream_open_opts(f, NULL);
+    }
+
+JSON_ARRAY_STREAM *json_array_stream_open_opts(FILE *f,
+                                               const JSON_PARSE_OPTIONS
+                                                   *options)
+    {
+    JSON_ARRAY_STREAM *stream =
+        (JSON_ARRAY_STREAM *)calloc(1, sizeof(JSON_ARRAY_STREAM));
+    if (!stream)
+        return NULL;
+    stream->buffer = (char *)malloc(STREAM_START);
+    stream->json = parse_create();
+    if (!stream->buffer || !stream->json)
+        {
+        json_array_stream_close(stream);
+        return NULL;
+        }
+    stream->f = f;
+    stream->size = STREAM_START;
+    stream->state = expect_open;
+    if (options)
+        stream->options = *options;
+    return stream;
+    }
+
+JSON *json_array_stream_next(JSON_ARRAY_STREAM *stream, JSON_ERROR *error)
+    {
+    JSON_ERROR ignored;
+    if (!error)
+        error = &ignored;
+    *error = JSON_OK;
+    parse_recycle(stream->json);
+
+    int c;
+    if (stream->state == expect_open)
+        {
+        if ((c = next_char(stream, error)) != '[')
+            goto failed;
+        ++stream->start;
+        stream->state = expect_first;
+        }
+    if (stream->state == expect_first || stream->state == expect_next)
+        {
+        c = next_char(stream, error);
+        if (c == ']')
+            {
+            ++stream->start;
+            stream->state = expect_eof;
+            }
+        else
+            {
+            if (stream->state == expect_next)
+                {
+                if (c != ',')
+                    goto failed;
+                ++stream->start;
+                if ((c = next_char(stream, error)) == ']')
+                    goto failed;
+                }
+            if (c == EOF)
+                goto failed;
+            size_t length = element_length(stream, error);
+            if (*error)
+                goto failed;
+            if ((*error = parse_buffer_into(stream->json,
+                                            stream->buffer + stream->start,
+                                            length, &stream->options)))
+                goto failed;
+            stream->start += length;
+            stream->state = expect_next;
+            return stream->json;
+            }
+        }
+    if (stream->state == expect_eof)
+        {
+        if (next_char(stream, error) != EOF && !*error)
+            *error = JSON_BAD_TRAILING;
+        stream->state = finished;
+        }
+    return NULL;
+
+failed:
+    if (!*error)
+        *error = JSON_BAD_ARRAY;
+    stream->state = finished;
+    return NULL;
+    }
+
+void json_array_stream_close(JSON_ARRAY_STREAM *stream)
+    {
+    if (stream->json)
+        json_destroy(stream->json);
+    free(stream->buffer);
+    free(stream);
+    }
@@ -1,36 +1,101 @@
 //  strip_space
 //
 //  Strip un-quoted whitespaces and return number of them
+//
+//  Usage: strip_space [file] > out
+//
+//  A regular file (named, or redirected to stdin) is mapped and
+//  minified in one call; pipes are read in large blocks.
+
+#include "../json.h"
 
 #include <stdio.h>
-#include <ctype.h>
-#include <stdbool.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BLOCK_SIZE (4*1024*1024)
 
-int main(void)
+static int write_all(const char *p, size_t n)
     {
-    int space_count = 0;
-    bool in_quote = false;
-    int c;
-    while ((c = getchar()) != EOF)
+    while (n)
         {
-        if (c == '"')
-            in_quote = !in_quote;
-        if (in_quote && c == '\\')
-            {
-            putchar(c);
-            c = getchar();
-            }
-        if (!in_quote && isspace(c))
-            ++space_count;
-        else
-            putchar(c);
+        ssize_t written = write(STDOUT_FILENO, p, n);
+        if (written < 0)
+            return -1;
+        p += written;
+        n -= written;
         }
+    return 0;
+    }
 
-    if (in_quote)
+static int strip_mapped(int fd, size_t size, size_t *stripped, 
+                        unsigned *state)
+    {
+    if (size == 0)
+        return 0;
+    // Private mapping: minifying in place never reaches the file
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    madvise(p, size, MADV_SEQUENTIAL);
+    size_t length = json_minify_partial(p, size, state);
+    *stripped += size - length;
+    int rval = write_all(p, length);
+    munmap(p, size);
+    return rval;
+    }
+
+static int strip_blocks(int fd, size_t *stripped, unsigned *state)
+    {
+    char *block = malloc(BLOCK_SIZE);
+    ssize_t n;
+    int rval = 0;
+    if (!block)
+        return -1;
+    while ((n = read(fd, block, BLOCK_SIZE)) > 0)
+        {
+        size_t length = json_minify_partial(block, n, state);
+        *stripped += n - length;
+        if ((rval = write_all(block, length)))
+            break;
+        }
+    if (n < 0)
+        rval = -1;
+    free(block);
+    return rval;
+    }
+
+int main(int argc, char **argv)
+    {
+    int fd = STDIN_FILENO;
+    if (argc > 1 && (fd = open(argv[1], O_RDONLY)) < 0)
+        {
+        perror(argv[1]);
+        return -1;
+        }
+
+    struct stat st;
+    size_t space_count = 0;
+    unsigned state = 0;
+    int rval;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        rval = strip_mapped(fd, st.st_size, &space_count, &state);
+    else
+        rval = strip_blocks(fd, &space_count, &state);
+
+    if (rval)
+        {
+        perror("strip_space");
+        return -1;
+        }
+    if (state)
         {
         fprintf(stderr, "ERROR: eof before end of quote\n");
         return -1;
         }
-    fprintf(stderr, "%d\n", space_count);
+    fprintf(stderr, "%zu\n", space_count);
     return 0;
     }
@@ -10,11 +10,1364 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <malloc.h>
+#ifdef JSON_ZSTD
+#include <zstd.h>
+#endif
+
+static size_t minify_reference(char *s, size_t length)
+    {
+    bool in_quote = false, escaped = false;
+    size_t n = 0;
+    for (size_t i = 0; i < length; ++i)
+        {
+        char c = s[i];
+        if (escaped)
+            escaped = false;
+        else if (c == '\\')
+            escaped = true;
+        else if (c == '"')
+            in_quote = !in_quote;
+        if (in_quote || !strchr(" \t\r\n", c))
+            s[n++] = c;
+        }
+    return n;
+    }
+
+static void test_minify(void)
+    {
+    const char alphabet[] = "  \t\n\r\\\\\\\"\"\"abc{}[],:";
+    char in[1000], expected[1000], out[1000];
+    srand(1);
+    for (int round = 0; round < 2000; ++round)
+        {
+        size_t length = rand() % sizeof(in);
+        for (size_t i = 0; i < length; ++i)
+            in[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        memcpy(expected, in, length);
+        size_t expected_length = minify_reference(expected, length);
+
+        memcpy(out, in, length);
+        assert(json_minify(out, length) == expected_length);
+        assert(!memcmp(out, expected, expected_length));
+
+        // Same again in pieces, each minified in place
+        unsigned state = 0;
+        size_t done = 0, written = 0;
+        memcpy(out, in, length);
+        while (done < length)
+            {
+            size_t piece = 1 + rand() % (length - done);
+            size_t n = json_minify_partial(out + done, piece, &state);
+            memmove(out + written, out + done, n);
+            written += n;
+            done += piece;
+            }
+        assert(written == expected_length);
+        assert(!memcmp(out, expected, expected_length));
+        }
+
+    char text[] = "{ \"a b\" : [ 1 , \"x\\\" y\" ] }";
+    size_t length = json_minify(text, strlen(text));
+    assert(length == strlen("{\"a b\":[1,\"x\\\" y\"]}"));
+    assert(!memcmp(text, "{\"a b\":[1,\"x\\\" y\"]}", length));
+    }
+
+static JSON_ERROR parse_error(const char *s, const JSON_PARSE_OPTIONS *options)
+    {
+    JSON_ERROR error;
+    JSON *json = json_parse_string_opts(strdup(s), true, options, &error);
+    if (json)
+        json_destroy(json);
+    return error;
+    }
+
+static void test_budgets(void)
+    {
+    JSON_PARSE_OPTIONS options = { 0 };
+    assert(parse_error("[[[1]]]", &options) == JSON_OK);
+    assert(parse_error("[1,]", NULL) == JSON_BAD_ARRAY);
+    assert(parse_error("{\"a\" 1}", NULL) == JSON_BAD_MAP);
+    assert(parse_error("[1] 2", NULL) == JSON_BAD_TRAILING);
+
+    options.max_depth = 3;
+    assert(parse_error("[[[1]]]", &options) == JSON_OK);
+    assert(parse_error("[[[[1]]]]", &options) == JSON_TOO_DEEP);
+    assert(parse_error("{\"a\":[{\"b\":1}]}", &options) == JSON_OK);
+    assert(parse_error("{\"a\":[{\"b\":[]}]}", &options) == JSON_TOO_DEEP);
+    options.max_depth = 0;
+
+    options.max_nodes = 4;
+    assert(parse_error("[1,2,3]", &options) == JSON_OK);
+    assert(parse_error("[1,2,3,4]", &options) == JSON_TOO_MANY_NODES);
+    options.max_nodes = 0;
+
+    options.max_string_length = 3;
+    assert(parse_error("{\"abc\":\"\\u00e9x\"}", &options) == JSON_OK);
+    assert(parse_error("{\"abcd\":1}", &options) == JSON_STRING_TOO_LONG);
+    assert(parse_error("\"abcd\"", &options) == JSON_STRING_TOO_LONG);
+    // Found too long at the limit, before the string turns out bad
+    assert(parse_error("\"abcd\\x\"", &options) == JSON_STRING_TOO_LONG);
+    assert(parse_error("\"a\\nbcd\x01\"", &options) ==
+           JSON_STRING_TOO_LONG);
+    JSON_ERROR error;
+    assert(!json_parse_buffer_opts("\"abcd\x01\"", 7, &options, &error));
+    assert(error == JSON_STRING_TOO_LONG);
+    assert(!json_parse_buffer_opts("\"a\\nbcd\x01\"", 9, &options, &error));
+    assert(error == JSON_STRING_TOO_LONG);
+    assert(!json_parse_buffer_opts("\"ab\x01\"", 5, &options, &error));
+    assert(error == JSON_BAD_STRING);
+    options.max_string_length = 0;
+
+    options.max_total_bytes = 5;
+    assert(parse_error("[1,2]", &options) == JSON_OK);
+    assert(parse_error("[1,22]", &options) == JSON_TOO_BIG);
+    options.max_total_bytes = 0;
+
+    // A long flat array: no deeper stack than a short one, and long
+    // enough to blow a 1us deadline
+    size_t count = 1000000;
+    char *big = (char *)malloc(count * 2 + 2);
+    big[0] = '[';
+    for (size_t i = 0; i < count; ++i)
+        memcpy(big + 1 + i * 2, "1,", 2);
+    big[count * 2] = ']';
+    big[count * 2 + 1] = '\0';
+    assert(parse_error(big, NULL) == JSON_OK);
+    options.timeout_us = 1;
+    assert(parse_error(big, &options) == JSON_TIMED_OUT);
+    free(big);
+    }
+
+static void test_hash(void)
+    {
+    JSON *a = json_parse_string(strdup(
+        "{\"x\": [1, 2.0, {\"p\": null, \"q\": true}], \"y\": \"s\"}"), true);
+    JSON *b = json_parse_string(strdup(
+        "{ \"y\":\"s\", \"x\":[1e0,2,{\"q\":true,\"p\":null}] }"), true);
+    JSON *c = json_parse_string(strdup(
+        "{\"x\": [2, 1, {\"p\": null, \"q\": true}], \"y\": \"s\"}"), true);
+    JSON *d = json_parse_string(strdup(
+        "{\"x\": [1, 2, {\"p\": null, \"q\": false}], \"y\": \"s\"}"), true);
+    JSON_DATA *ra = json_get_root(a);
+    JSON_DATA *rb = json_get_root(b);
+
+    assert(json_hash(ra) == json_hash(rb));
+    assert(json_hash(ra) == json_hash(ra));
+    assert(json_equal(ra, rb));
+    assert(json_hash(ra) != json_hash(json_get_root(c)));
+    assert(!json_equal(ra, json_get_root(c)));
+    assert(!json_equal(ra, json_get_root(d)));
+    assert(!json_equal(json_get_data(ra, "x"), json_get_data(ra, "y")));
+    assert(json_equal(json_get_data(ra, "x,2"), json_get_data(rb, "x,2")));
+
+    json_destroy(a);
+    json_destroy(b);
+    json_destroy(c);
+    json_destroy(d);
+    }
+
+static void write_file(const char *path, const char *text)
+    // Write aside and rename over, the way configs should be updated
+    {
+    char temp[256];
+    snprintf(temp, sizeof(temp), "%s.new", path);
+    FILE *f = fopen(temp, "w");
+    assert(f);
+    fputs(text, f);
+    fclose(f);
+    assert(!rename(temp, path));
+    }
+
+static double live_number(JSON_LIVE *live)
+    {
+    JSON *json = json_live_acquire(live);
+    double n = json_number(json_get_data(json_get_root(json), "n"));
+    json_live_release(live, json);
+    return n;
+    }
+
+static bool live_done;
+
+static void *live_reader(void *arg)
+    {
+    JSON_LIVE *live = (JSON_LIVE *)arg;
+    double last = 0;
+    while (!__atomic_load_n(&live_done, __ATOMIC_RELAXED))
+        {
+        JSON *json = json_live_acquire(live);
+        JSON_DATA *root = json_get_root(json);
+        double n = json_number(json_get_data(root, "n"));
+        // Versions only move forward, and a pinned one stays intact
+        assert(n >= last);
+        assert(json_array_length(json_get_data(root, "pad")) == (size_t)n);
+        last = n;
+        json_live_release(live, json);
+        }
+    return NULL;
+    }
+
+static void test_live(void)
+    {
+    char path[] = "/tmp/mmijson_live_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    write_file(path, "{\"n\": 1, \"pad\": [0]}");
+
+    JSON_LIVE *live = json_live_open(path, 10);
+    assert(live);
+    JSON *pinned = json_live_acquire(live);
+    assert(live_number(live) == 1);
+
+    // Same content, different text: nothing new to publish
+    write_file(path, " { \"pad\" : [ 0 ] , \"n\" : 1e0 } ");
+    assert(!json_live_reload(live));
+    assert(json_live_acquire(live) == pinned);
+    json_live_release(live, pinned);
+
+    // Picked up by the watcher, while the old version stays pinned
+    write_file(path, "{\"n\": 2, \"pad\": [0, 0]}");
+    for (int i = 0; i < 500 && live_number(live) != 2; ++i)
+        usleep(10000);
+    assert(live_number(live) == 2);
+    assert(json_number(json_get_data(json_get_root(pinned), "n")) == 1);
+    json_live_release(live, pinned);
+
+    // A broken file leaves the current version alone
+    write_file(path, "{\"n\": ");
+    assert(!json_live_reload(live));
+    assert(live_number(live) == 2);
+
+    pthread_t readers[4];
+    __atomic_store_n(&live_done, false, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; ++i)
+        assert(!pthread_create(&readers[i], NULL, live_reader, live));
+    for (int n = 3; n < 200; ++n)
+        {
+        char text[2048];
+        int length = sprintf(text, "{\"n\": %d, \"pad\": [0", n);
+        for (int i = 1; i < n; ++i)
+            length += sprintf(text + length, ",0");
+        strcpy(text + length, "]}");
+        write_file(path, text);
+        json_live_reload(live);
+        }
+    __atomic_store_n(&live_done, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; ++i)
+        pthread_join(readers[i], NULL);
+    assert(live_number(live) == 199);
+
+    json_live_close(live);
+    unlink(path);
+    }
+
+static void test_paths(void)
+    {
+    char dir[] = "/tmp/mmijson_paths_XXXXXX";
+    assert(mkdtemp(dir));
+    enum { FILES = 300 };
+    char *paths[FILES];
+    for (int i = 0; i < FILES; ++i)
+        {
+        paths[i] = (char *)malloc(strlen(dir) + 32);
+        sprintf(paths[i], "%s/%d.json", dir, i);
+        if (i % 50 == 49)
+            continue; // missing
+        FILE *f = fopen(paths[i], "w");
+        assert(f);
+        if (i % 50 == 7)
+            fputs("{\"i\": ", f); // broken
+        else if (i % 50 == 8)
+            ; // empty
+        else
+            {
+            // Some big enough to take several reads
+            fprintf(f, "{\"pad\": [0");
+            for (int j = 0; j < (i % 50 == 9 ? 100000 : 10); ++j)
+                fputs(", 0", f);
+            fprintf(f, "], \"i\": %d}", i);
+            }
+        fclose(f);
+        }
+
+    for (unsigned threads = 1; threads <= 4; threads += 3)
+        {
+        JSON *results[FILES];
+        size_t parsed = json_parse_paths((const char **)paths, FILES, results,
+                                         threads);
+        assert(parsed == FILES - 3 * FILES / 50);
+        for (int i = 0; i < FILES; ++i)
+            {
+            if (i % 50 == 49 || i % 50 == 7 || i % 50 == 8)
+                {
+                assert(!results[i]);
+                continue;
+                }
+            JSON_DATA *root = json_get_root(results[i]);
+            assert(json_number(json_get_data(root, "i")) == i);
+            json_destroy(results[i]);
+            }
+        }
+    assert(json_parse_paths(NULL, 0, NULL, 1) == 0);
+
+    for (int i = 0; i < FILES; ++i)
+        {
+        unlink(paths[i]);
+        free(paths[i]);
+        }
+    rmdir(dir);
+    }
+
+static void write_gzip(FILE *f, const char *text, size_t length)
+    {
+    z_stream z;
+    unsigned char out[4096];
+    memset(&z, 0, sizeof(z));
+    assert(deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8,
+                        Z_DEFAULT_STRATEGY) == Z_OK);
+    z.next_in = (unsigned char *)text;
+    z.avail_in = length;
+    int status;
+    do
+        {
+        z.next_out = out;
+        z.avail_out = sizeof(out);
+        status = deflate(&z, Z_FINISH);
+        fwrite(out, 1, sizeof(out) - z.avail_out, f);
+        }
+    while (status == Z_OK);
+    assert(status == Z_STREAM_END);
+    deflateEnd(&z);
+    }
+
+#ifdef JSON_ZSTD
+static void write_zstd(FILE *f, const char *text, size_t length)
+    {
+    size_t bound = ZSTD_compressBound(length);
+    void *out = malloc(bound);
+    size_t written = ZSTD_compress(out, bound, text, length, 3);
+    assert(!ZSTD_isError(written));
+    fwrite(out, 1, written, f);
+    free(out);
+    }
+#endif
+
+static JSON *parse_compressed(FILE *f, const JSON_PARSE_OPTIONS *options,
+                              JSON_ERROR *error)
+    {
+    rewind(f);
+    return json_parse_compressed_opts(f, options, error);
+    }
+
+static void test_compressed(void)
+    {
+    // Big enough for several read ahead chunks
+    size_t size = 4 << 20;
+    char *text = (char *)malloc(size);
+    size_t length = sprintf(text, "[");
+    for (int i = 0; length < size - 100; ++i)
+        length += sprintf(text + length, "%s{\"i\": %d, \"s\": \"x%dx\"}",
+                          i ? ", " : "", i, i * 7);
+    length += sprintf(text + length, "]");
+    JSON *plain = json_parse_string(strdup(text), true);
+    JSON_ERROR error;
+
+    FILE *f = tmpfile();
+    write_gzip(f, text, length);
+    JSON *json = parse_compressed(f, NULL, &error);
+    assert(json && error == JSON_OK);
+    assert(json_equal(json_get_root(json), json_get_root(plain)));
+    json_destroy(json);
+
+    // The limit applies to the decompressed size
+    JSON_PARSE_OPTIONS options;
+    memset(&options, 0, sizeof(options));
+    options.max_total_bytes = length - 1;
+    assert(!parse_compressed(f, &options, &error) && error == JSON_TOO_BIG);
+    options.max_total_bytes = length;
+    json = parse_compressed(f, &options, &error);
+    assert(json && error == JSON_OK);
+    json_destroy(json);
+
+    // Not seekable, so no size hint
+    char command[64];
+    fflush(f);
+    sprintf(command, "cat /dev/fd/%d", fileno(f));
+    FILE *p = popen(command, "r");
+    assert(p);
+    json = json_parse_compressed(p);
+    pclose(p);
+    assert(json && json_equal(json_get_root(json), json_get_root(plain)));
+    json_destroy(json);
+
+    // Truncated
+    assert(!ftruncate(fileno(f), ftell(f) / 2));
+    assert(!parse_compressed(f, NULL, &error) && error == JSON_READ_ERROR);
+    fclose(f);
+
+    // Concatenated members
+    f = tmpfile();
+    write_gzip(f, "[1, ", 4);
+    write_gzip(f, "2]", 2);
+    json = parse_compressed(f, NULL, &error);
+    assert(json && json_array_length(json_get_root(json)) == 2);
+    json_destroy(json);
+    fclose(f);
+
+    // Uncompressed passes through
+    f = tmpfile();
+    fputs(" {\"a\": true} ", f);
+    json = parse_compressed(f, NULL, &error);
+    assert(json && json_boolean(json_get_data(json_get_root(json), "a")));
+    json_destroy(json);
+    fclose(f);
+
+    // Empty
+    f = tmpfile();
+    assert(!parse_compressed(f, NULL, &error) && error != JSON_OK);
+    fclose(f);
+
+    // A trailer claiming 4 GB from a few bytes isn't believed
+    f = tmpfile();
+    write_gzip(f, "[1]", 3);
+    fseek(f, -4, SEEK_END);
+    fwrite("\xff\xff\xff\xff", 1, 4, f);
+    assert(!parse_compressed(f, NULL, &error) && error == JSON_READ_ERROR);
+    fclose(f);
+
+#ifdef JSON_ZSTD
+    f = tmpfile();
+    write_zstd(f, text, length);
+    json = parse_compressed(f, NULL, &error);
+    assert(json && error == JSON_OK);
+    assert(json_equal(json_get_root(json), json_get_root(plain)));
+    json_destroy(json);
+    options.max_total_bytes = length - 1;
+    assert(!parse_compressed(f, &options, &error) && error == JSON_TOO_BIG);
+    assert(!ftruncate(fileno(f), ftell(f) / 2));
+    assert(!parse_compressed(f, NULL, &error) && error == JSON_READ_ERROR);
+    fclose(f);
+
+    // Frames concatenate too
+    f = tmpfile();
+    write_zstd(f, "[1, ", 4);
+    write_zstd(f, "2]", 2);
+    json = parse_compressed(f, NULL, &error);
+    assert(json && json_array_length(json_get_root(json)) == 2);
+    json_destroy(json);
+    fclose(f);
+#else
+    f = tmpfile();
+    fwrite("\x28\xb5\x2f\xfd", 1, 4, f);
+    assert(!parse_compressed(f, NULL, &error) && error == JSON_READ_ERROR);
+    fclose(f);
+#endif
+
+    json_destroy(plain);
+    free(text);
+    }
+
+static void count_parse(const JSON_STATS *stats, void *context)
+    {
+    JSON_STATS *sum = (JSON_STATS *)context;
+    sum->parses += stats->parses;
+    sum->strings += stats->strings;
+    }
+
+static void test_stats(void)
+    {
+    JSON_STATS stats;
+#ifdef JSON_PROFILE
+    const char *text = "{\"a\": [1, 2, \"x\", true, null], \"b\": {\"c\": \"d\"}}";
+    JSON_STATS hooked;
+    memset(&hooked, 0, sizeof(hooked));
+    json_reset_stats();
+    assert(json_set_stats_hook(count_parse, &hooked));
+    JSON *json = json_parse_string(strdup(text), true);
+    json_set_stats_hook(NULL, NULL);
+    json_destroy(json);
+
+    assert(json_get_stats(&stats));
+    assert(stats.parses == 1 && hooked.parses == 1);
+    assert(stats.bytes_scanned == strlen(text));
+    assert(stats.objects == 2 && stats.arrays == 1);
+    assert(stats.strings == 2 && hooked.strings == 2);
+    assert(stats.numbers == 2 && stats.booleans == 1 && stats.nulls == 1);
+    assert(stats.pool_grows == 3); // one chunk each for data, maps, arrays
+    assert(stats.array_reallocs == 1); // 5 elements outgrow 4 slots once
+    assert(stats.time_total >= stats.time_whitespace + stats.time_strings +
+                               stats.time_numbers + stats.time_map_insert);
+    json_reset_stats();
+    assert(json_get_stats(&stats) && stats.parses == 0);
+#else
+    assert(!json_get_stats(&stats) && stats.parses == 0);
+    assert(!json_set_stats_hook(count_parse, NULL));
+#endif
+    }
+
+static void *destroy_many(void *arg)
+    {
+    for (int i = 0; i < 200; ++i)
+        json_destroy_deferred(json_parse_string(strdup(
+            "{\"a\": [1, 2, {\"b\": [3, \"four\"]}], \"c\": null}"), true));
+    return NULL;
+    }
+
+static bool producing;
+
+static void *destroy_steadily(void *arg)
+    {
+    while (__atomic_load_n(&producing, __ATOMIC_SEQ_CST))
+        json_destroy_deferred(json_parse_string(strdup("[1]"), true));
+    return NULL;
+    }
+
+static size_t heap_in_use(void)
+    {
+    struct mallinfo2 heap = mallinfo2();
+    return heap.uordblks + heap.hblkhd;
+    }
+
+static void test_deferred(void)
+    {
+    // More than the queue holds, from several threads, so that some
+    // are destroyed on the spot
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i)
+        assert(!pthread_create(&threads[i], NULL, destroy_many, NULL));
+    for (int i = 0; i < 4; ++i)
+        pthread_join(threads[i], NULL);
+    json_destroy_flush();
+    json_destroy_flush();
+
+    // Flushing returns once what was queued before it is freed, while
+    // another thread keeps the queue from ever emptying
+    __atomic_store_n(&producing, true, __ATOMIC_SEQ_CST);
+    pthread_t producer;
+    assert(!pthread_create(&producer, NULL, destroy_steadily, NULL));
+    size_t length = 1 << 20;
+    char *big = (char *)malloc(length + 3);
+    memset(big, 'x', length + 2);
+    big[0] = big[length + 1] = '"';
+    big[length + 2] = '\0';
+    size_t heap = heap_in_use();
+    for (int i = 0; i < 32; ++i)
+        json_destroy_deferred(json_parse_string(strdup(big), true));
+    json_destroy_flush();
+    assert(heap_in_use() < heap + (4 << 20)); // not the 32 MB queued
+    __atomic_store_n(&producing, false, __ATOMIC_SEQ_CST);
+    pthread_join(producer, NULL);
+    json_destroy_flush();
+    free(big);
+    }
+
+static void test_clone(void)
+    {
+    JSON *json = json_parse_string(strdup(
+        "{\"keep\": {\"s\": \"caf\\u00e9\\u0000!\", \"n\": -1.5e3, "
+        "\"a\": [true, false, null, [], {}, [[1]]]}, \"drop\": [1, 2, 3]}"),
+        true);
+    JSON_DATA *keep = json_get_data(json_get_root(json), "keep");
+    uint64_t hash = json_hash(keep);
+    JSON *clone = json_clone(keep);
+    assert(clone);
+    JSON_DATA *root = json_get_root(clone);
+    assert(json_equal(root, keep) && json_hash(root) == hash);
+    json_destroy(json);
+
+    // Nothing refers back to the original
+    assert(json_string_length(json_get_data(root, "s")) == 7);
+    assert(!memcmp(json_string(json_get_data(root, "s")), "caf\xc3\xa9\0!", 7));
+    assert(json_number(json_get_data(root, "n")) == -1500);
+    assert(json_boolean(json_get_data(root, "a,0")));
+    assert(!json_boolean(json_get_data(root, "a,1")));
+    assert(json_is_null(json_get_data(root, "a,2")));
+    assert(json_array_length(json_get_data(root, "a")) == 6);
+    assert(json_array(json_get_data(root, "a"))[6] == NULL);
+    assert(json_number(json_get_data(root, "a,5,0,0")) == 1);
+    assert(json_object_size(root) == 3);
+
+    JSON *again = json_clone(json_get_data(root, "a,5"));
+    json_destroy(clone);
+    assert(json_number(json_get_data(json_get_root(again), "0,0")) == 1);
+    json_destroy(again);
+    }
+
+static bool column_valid(const JSON_COLUMN *column, size_t row)
+    {
+    return column->valid[row / 8] >> (row % 8) & 1;
+    }
+
+static void test_columns(void)
+    {
+    // Same shape, then reordered, missing, mistyped and not an object
+    JSON *json = json_parse_string(strdup(
+        "[{\"id\": 1, \"x\": 0.5, \"name\": \"a\", \"other\": 0},"
+        " {\"id\": 2, \"x\": 1.5, \"name\": \"bb\", \"other\": 0},"
+        " {\"name\": \"c\", \"id\": 3e2, \"x\": -2},"
+        " {\"id\": 4.5, \"x\": null, \"name\": 7},"
+        " 5,"
+        " {\"x\": 9}]"), true);
+    const char *fields[] = { "id", "x", "name" };
+    JSON_COLUMN_TYPE types[] =
+        {
+        JSON_COLUMN_INT64, JSON_COLUMN_DOUBLE, JSON_COLUMN_STRING
+        };
+    JSON_COLUMN columns[3];
+    assert(json_extract_columns(json_get_root(json), fields, types, 3,
+                                columns));
+
+    int64_t ids[] = { 1, 2, 300 };
+    for (size_t row = 0; row < 6; ++row)
+        assert(column_valid(&columns[0], row) == (row < 3));
+    for (size_t row = 0; row < 3; ++row)
+        assert(columns[0].values.int64s[row] == ids[row]);
+
+    double xs[] = { 0.5, 1.5, -2, 0, 0, 9 };
+    for (size_t row = 0; row < 6; ++row)
+        {
+        assert(column_valid(&columns[1], row) == (row < 3 || row == 5));
+        assert(columns[1].values.doubles[row] == xs[row]);
+        }
+
+    const char *names[] = { "a", "bb", "c" };
+    for (size_t row = 0; row < 6; ++row)
+        assert(column_valid(&columns[2], row) == (row < 3));
+    for (size_t row = 0; row < 3; ++row)
+        {
+        JSON_STRING_VIEW name = columns[2].values.strings[row];
+        assert(name.length == strlen(names[row]));
+        assert(!memcmp(name.string, names[row], name.length));
+        }
+    json_columns_free(columns, 3);
+
+    assert(!json_extract_columns(json_get_data(json_get_root(json), "0"),
+                                 fields, types, 3, columns));
+    json_destroy(json);
+    }
+
+static void test_buffer(void)
+    {
+    static const char text[] =
+        "{\"plain\": \"as is\", \"esc\\u00e9\": \"a\\\"b\\u0000c\", "
+        "\"n\": [-1.5e3, 0, true, false, null, {}, []]}";
+    char before[sizeof(text)];
+    memcpy(before, text, sizeof(text));
+    JSON *json = json_parse_buffer(text, sizeof(text) - 1);
+    assert(json && !memcmp(text, before, sizeof(text)));
+    JSON *copy = json_parse_string(strdup(text), true);
+    JSON_DATA *root = json_get_root(json);
+    assert(json_equal(root, json_get_root(copy)));
+    json_destroy(copy);
+
+    // Plain strings are where they were, escaped ones decoded elsewhere
+    JSON_STRING_VIEW plain = json_string_view(json_get_data(root, "plain"));
+    assert(plain.string > text && plain.string < text + sizeof(text));
+    assert(plain.length == 5 && !memcmp(plain.string, "as is", 5));
+    JSON_STRING_VIEW esc = json_string_view(json_get_data(root, "esc\xc3\xa9"));
+    assert(esc.length == 5 && !memcmp(esc.string, "a\"b\0c", 6));
+    assert(json_number(json_get_data(root, "n,0")) == -1500);
+    assert(json_boolean(json_get_data(root, "n,2")));
+
+    char dumped[256];
+    FILE *f = fmemopen(dumped, sizeof(dumped), "w");
+    json_dump(json, f);
+    fclose(f);
+    assert(!strcmp(dumped, "{\"plain\":\"as is\",\"esc\xc3\xa9\":\"a\\\"b\\u0000c\","
+                           "\"n\":[-1.5e3,0,true,false,null,{},[]]}"));
+    json_destroy(json);
+
+    // Nothing past length is read, and a NUL doesn't end the input
+    json = json_parse_buffer("125", 2);
+    assert(json && json_number(json_get_root(json)) == 12);
+    json_destroy(json);
+    JSON_ERROR error;
+    assert(!json_parse_buffer_opts("\"ab\"", 3, NULL, &error));
+    assert(error == JSON_BAD_STRING);
+    assert(!json_parse_buffer_opts("1 \0", 3, NULL, &error));
+    assert(error == JSON_BAD_TRAILING);
+    assert(!json_parse_buffer_opts("tru", 3, NULL, &error));
+    assert(error == JSON_BAD_BOOLEAN);
+    JSON_PARSE_OPTIONS options = { 0 };
+    options.max_total_bytes = 2;
+    assert(!json_parse_buffer_opts("[1]", 3, &options, &error));
+    assert(error == JSON_TOO_BIG);
+
+    // Decoded strings longer than the first chunks of room for them
+    size_t length = 3 * 3000 + 16;
+    char *escaped = (char *)malloc(length);
+    strcpy(escaped, "[\"");
+    for (int i = 0; i < 3000; ++i)
+        strcat(escaped + 3 * i, "a\\n");
+    strcat(escaped, "\", \"x\\ty\"]");
+    json = json_parse_buffer(escaped, strlen(escaped));
+    copy = json_parse_string(strdup(escaped), true);
+    assert(json && json_string_length(json_get_data(json_get_root(json), "0"))
+                   == 6000);
+    assert(json_equal(json_get_root(json), json_get_root(copy)));
+    json_destroy(copy);
+    json_destroy(json);
+    free(escaped);
+
+    // and no room taken for the rest of the input after an escape
+    length = 1 << 20;
+    char *wide = (char *)malloc(length);
+    memset(wide, ' ', length);
+    memcpy(wide, "\"a\\tb\"", 6);
+    size_t heap = heap_in_use();
+    json = json_parse_buffer(wide, length);
+    assert(json && json_string_length(json_get_root(json)) == 3);
+    assert(heap_in_use() < heap + 65536);
+    json_destroy(json);
+    free(wide);
+    }
+
+static void test_shapes(void)
+    {
+    static const char *texts[] =
+        {
+        "[{\"id\": 1, \"name\": \"a\", \"tags\": {\"x\": 1}},"
+        " {\"id\": 2, \"name\": \"b\", \"tags\": {\"x\": 2}},"
+        " {\"name\": \"c\", \"id\": 3},"
+        " {\"id\": 4, \"id\": 5, \"name\": \"d\"},"
+        " {\"id\": 6, \"na\\u006de\": \"e\", \"tags\": {}},"
+        " {\"id\": 7, \"nam\": \"f\"}, {\"id\": 8, \"namex\": 0}, {}]",
+        "{\"id\": 1, \"name\": \"a\", \"tags\": {\"x\": 1, \"x\": 3}}",
+        "{\"id\": 1, \"name\"", // cut short in a predicted key
+        };
+    JSON_SHAPE_CACHE *cache = json_shape_cache_create(0);
+    JSON_PARSE_OPTIONS options = { 0 };
+    options.shapes = cache;
+    for (int pass = 0; pass < 3; ++pass)
+        for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i)
+            {
+            // Learning, predicting, in place and read-only alike give
+            // what a parse without the cache does
+            JSON *plain = json_parse_string(strdup(texts[i]), true);
+            JSON *cached = json_parse_string_opts(strdup(texts[i]), true,
+                                                  &options, NULL);
+            JSON *buffer = json_parse_buffer_opts(texts[i], strlen(texts[i]),
+                                                  &options, NULL);
+            assert(!plain == !cached && !plain == !buffer);
+            if (plain)
+                {
+                JSON_DATA *root = json_get_root(plain);
+                assert(json_equal(root, json_get_root(cached)));
+                assert(json_equal(root, json_get_root(buffer)));
+                json_destroy(plain);
+                json_destroy(cached);
+                json_destroy(buffer);
+                }
+            }
+
+    JSON *json = json_parse_string_opts(strdup(texts[0]), true, &options,
+                                        NULL);
+    JSON_DATA *root = json_get_root(json);
+    assert(json_object_size(json_get_data(root, "3")) == 2);
+    assert(json_number(json_get_data(root, "3,id")) == 5);
+    assert(json_object_size(json_get_data(root, "4")) == 3);
+    assert(!strcmp(json_string(json_get_data(root, "4,name")), "e"));
+    assert(!strcmp(json_string(json_get_data(root, "1,name")), "b"));
+    json_shape_cache_destroy(cache); // the document doesn't need it
+    assert(json_number(json_get_data(root, "1,tags,x")) == 2);
+    json_destroy(json);
+
+    // A full cache still parses, just without learning more
+    cache = json_shape_cache_create(2);
+    options.shapes = cache;
+    json = json_parse_string_opts(strdup(texts[0]), true, &options, NULL);
+    assert(json && json_object_size(json_get_data(json_get_root(json),
+                                                  "0")) == 3);
+    json_destroy(json);
+    json_shape_cache_destroy(cache);
+    }
+
+static void test_index(void)
+    {
+    JSON *json = json_parse_string(strdup(
+        "{\"servlet\": [{\"servlet-name\": \"cofaxCDS\", \"n\": 1},"
+        " {\"servlet-name\": \"cofaxEmail\", \"n\": 2.0},"
+        " {\"n\": 1e0}, 7,"
+        " {\"servlet-name\": \"cofaxCDS\", \"n\": \"1\"}]}"), true);
+    JSON_DATA *servlets = json_get_data(json_get_root(json), "servlet");
+    JSON_INDEX *by_name = json_index_build(servlets, "servlet-name");
+    assert(by_name && json_index_build(servlets, "servlet-name") == by_name);
+    JSON_DATA **found;
+    assert(json_index_lookup_string(by_name, "cofaxCDS", 8, &found) == 2);
+    assert(found[0] == json_array(servlets)[0]);
+    assert(found[1] == json_array(servlets)[4]);
+    assert(json_index_lookup_string(by_name, "cofaxEmail", 10, &found) == 1);
+    assert(json_number(json_get_data(found[0], "n")) == 2);
+    assert(!json_index_lookup_string(by_name, "cofax", 5, &found));
+
+    // Numbers match by value, and not strings that look like them
+    JSON_INDEX *by_n = json_index_build(servlets, "n");
+    assert(json_index_lookup_number(by_n, 1, &found) == 2);
+    assert(found[1] == json_array(servlets)[2]);
+    assert(json_index_lookup_number(by_n, 2, &found) == 1);
+    assert(json_index_lookup(by_n, json_get_data(servlets, "4,n"),
+                             &found) == 1);
+    JSON_INDEX *whole = json_index_build(servlets, NULL);
+    assert(json_index_lookup_number(whole, 7, &found) == 1);
+    assert(!json_index_build(json_get_root(json), "n"));
+
+    // Clones start without indexes but can have their own
+    JSON *clone = json_clone(servlets);
+    json_destroy(json);
+    by_name = json_index_build(json_get_root(clone), "servlet-name");
+    assert(json_index_lookup_string(by_name, "cofaxCDS", 8, &found) == 2);
+    assert(json_index_lookup_number(json_index_build(json_get_root(clone),
+                                                     "n"), 1, &found) == 2);
+    json_destroy(clone);
+    json = json_parse_string(strdup("[[1, 2], [3, [4, 4]]]"), true);
+    clone = json_clone(json_get_root(json));
+    json_destroy(json);
+    JSON_DATA *inner = json_get_data(json_get_root(clone), "1,1");
+    assert(json_index_lookup_number(json_index_build(inner, NULL), 4,
+                                    &found) == 2);
+    assert(json_index_build(json_get_data(json_get_root(clone), "0"), NULL));
+    json_destroy(clone);
+    }
+
+static FILE *temp_text(const char *text)
+    {
+    FILE *f = tmpfile();
+    assert(f);
+    fputs(text, f);
+    rewind(f);
+    return f;
+    }
+
+static JSON_ERROR stream_all(const char *text, size_t *count)
+    {
+    FILE *f = temp_text(text);
+    JSON_ARRAY_STREAM *stream = json_array_stream_open(f);
+    JSON_ERROR error;
+    for (*count = 0; json_array_stream_next(stream, &error); ++*count)
+        ;
+    json_array_stream_close(stream);
+    fclose(f);
+    return error;
+    }
+
+static void test_stream(void)
+    {
+    // Many records, and one too big for the initial buffer with
+    // brackets, quotes and escapes in its strings
+    size_t records = 20000;
+    size_t big = 300000;
+    char *text = (char *)malloc(records * 64 + big + 64);
+    char *p = text + sprintf(text, " [\n");
+    for (size_t i = 0; i < records; ++i)
+        {
+        if (i == records / 2)
+            {
+            p += sprintf(p, "{\"big\": \"");
+            for (size_t j = 0; j < big; j += 6)
+                p += sprintf(p, "]}\\\"[{");
+            p += sprintf(p, "\"},\n");
+            }
+        p += sprintf(p, "{\"id\": %u, \"s\": \"x\\ty\", \"a\": [%u]},\n",
+                     (unsigned)i, (unsigned)i);
+        }
+    sprintf(p, "-1.5e3, \"end\", true, null, [] ]\n");
+
+    JSON *whole = json_parse_string(strdup(text), true);
+    assert(whole);
+    JSON_DATA **elements = json_array(json_get_root(whole));
+    FILE *f = temp_text(text);
+    JSON_SHAPE_CACHE *cache = json_shape_cache_create(0);
+    JSON_PARSE_OPTIONS options = { 0 };
+    options.shapes = cache;
+    JSON_ARRAY_STREAM *stream = json_array_stream_open_opts(f, &options);
+    JSON *element;
+    JSON_ERROR error;
+    size_t n = 0;
+    while ((element = json_array_stream_next(stream, &error)))
+        assert(json_equal(json_get_root(element), elements[n++]));
+    assert(error == JSON_OK && n == records + 6);
+    assert(!json_array_stream_next(stream, &error) && error == JSON_OK);
+    json_array_stream_close(stream);
+    json_shape_cache_destroy(cache);
+    fclose(f);
+    json_destroy(whole);
+
+    // An element over max_total_bytes stops the stream
+    f = temp_text(text);
+    options.shapes = NULL;
+    options.max_total_bytes = 100000;
+    stream = json_array_stream_open_opts(f, &options);
+    for (n = 0; json_array_stream_next(stream, &error); ++n)
+        ;
+    assert(error == JSON_TOO_BIG && n == records / 2);
+    json_array_stream_close(stream);
+    fclose(f);
+    free(text);
+
+    assert(stream_all(" [ ] ", &n) == JSON_OK && n == 0);
+    assert(stream_all("[1,\"]\",{\"a\":[]}]", &n) == JSON_OK && n == 3);
+    assert(stream_all("[1,]", &n) == JSON_BAD_ARRAY && n == 1);
+    assert(stream_all("[1 2]", &n) == JSON_BAD_ARRAY && n == 1);
+    assert(stream_all("[1, 2", &n) == JSON_BAD_ARRAY && n == 2);
+    assert(stream_all("[1, {\"a\": 2]", &n) == JSON_BAD_MAP && n == 1);
+    assert(stream_all("[1] x", &n) == JSON_BAD_TRAILING && n == 1);
+    assert(stream_all("{}", &n) == JSON_BAD_ARRAY && n == 0);
+    assert(stream_all("", &n) == JSON_BAD_ARRAY && n == 0);
+    }
+
+static void expect_invalid(const char *text, JSON_ERROR error, size_t offset)
+    {
+    size_t at = SIZE_MAX;
+    assert(json_validate(text, strlen(text), &at) == error);
+    assert(at == offset);
+    }
+
+static void test_validate(void)
+    {
+    const char *text = "{\"a\": [1, -2.5e+3, \"caf\xc3\xa9 \\ud83d\\ude00 "
+                       "\xe2\x82\xac \xf0\x9f\x98\x80 long enough for a "
+                       "whole block or two\", true, false, null, {}]}";
+    char copy[256];
+    strcpy(copy, text);
+    assert(json_validate(copy, strlen(copy), NULL) == JSON_OK);
+    assert(!strcmp(copy, text));
+    assert(json_validate(" 0 ", 3, NULL) == JSON_OK);
+
+    expect_invalid("[1, 2", JSON_BAD_ARRAY, 5);
+    expect_invalid("[1, ]", JSON_BAD_ARRAY, 4);
+    expect_invalid("{\"a\" 1}", JSON_BAD_MAP, 5);
+    expect_invalid("{\"a\": 1,}", JSON_BAD_MAP, 8);
+    expect_invalid("[1.e5]", JSON_BAD_NUMBER, 3);
+    expect_invalid("[-]", JSON_BAD_NUMBER, 2);
+    expect_invalid("[tru]", JSON_BAD_BOOLEAN, 4);
+    expect_invalid("nul", JSON_BAD_NULL, 3);
+    expect_invalid("[1] 2", JSON_BAD_TRAILING, 4);
+    expect_invalid("\"tab\there\"", JSON_BAD_STRING, 4);
+    expect_invalid("\"\\x\"", JSON_BAD_STRING, 2);
+    expect_invalid("[\"ab\\ude00\"]", JSON_BAD_STRING, 4);
+    expect_invalid("\"\\ud83dx\"", JSON_BAD_STRING, 7);
+    expect_invalid("\"unterminated", JSON_BAD_STRING, 13);
+
+    // Overlong, surrogate, out of range, stray and cut short sequences
+    expect_invalid("\"ab\xc0\xaf\"", JSON_BAD_STRING, 3);
+    expect_invalid("\"ab\xe0\x80\xaf\"", JSON_BAD_STRING, 3);
+    expect_invalid("\"ab\xed\xa0\x80\"", JSON_BAD_STRING, 3);
+    expect_invalid("\"ab\xf4\x90\x80\x80\"", JSON_BAD_STRING, 3);
+    expect_invalid("\"ab\x80\"", JSON_BAD_STRING, 3);
+    expect_invalid("\"0123456789abcdef\xe2\x82\"", JSON_BAD_STRING, 17);
+    size_t at;
+    assert(json_validate("\"\xe2\x82\xac\"", 3, &at) == JSON_BAD_STRING &&
+           at == 1);
+
+    // A NUL is just a bad character
+    assert(json_validate("[1]\0", 4, &at) == JSON_BAD_TRAILING && at == 3);
+
+    char deep[2049];
+    memset(deep, '[', 1025);
+    deep[1025] = '\0';
+    expect_invalid(deep, JSON_TOO_DEEP, 1024);
+    memset(deep + 1024, ']', 1024);
+    assert(json_validate(deep, 2048, NULL) == JSON_OK);
+    }
+
+static void parse_again_and_again(const char *text)
+    // Parsing the text over and over mustn't grow the heap
+    {
+    size_t before = 0;
+    for (int i = 0; i < 1000; ++i)
+        {
+        if (i == 10)
+            before = heap_in_use();
+        JSON *json = json_parse_buffer(text, strlen(text));
+        if (json)
+            json_destroy(json);
+        }
+    assert(heap_in_use() <= before + 4096);
+    }
+
+static void test_parse_leaks(void)
+    {
+    // The value a duplicate key replaces
+    parse_again_and_again("{\"a\": [[1, 2, 3], [4]], \"a\": 1}");
+
+    // Values that fail partway, in an array and in an object
+    parse_again_and_again("[[1, 2], [3, x]]");
+    parse_again_and_again("{\"a\": {\"b\": [1, 2], \"c\": x}}");
+    }
+
+static const char *dump_text(JSON *json, char *text, size_t size)
+    {
+    FILE *f = fmemopen(text, size, "w");
+    json_dump(json, f);
+    fclose(f);
+    return text;
+    }
+
+static void test_build(void)
+    {
+    char text[512];
+    JSON *json = json_new();
+    JSON_DATA *root = json_new_object(json);
+    json_set_root(json, root);
+    JSON_DATA *list = json_new_array(json);
+    assert(json_object_set(json, root, "id", json_new_number(json, 42)));
+    assert(json_object_set(json, root, "name",
+                           json_new_string(json, "a\"b\0c", 5)));
+    assert(json_object_set(json, root, "list", list));
+    const double numbers[] = { 0.1, -1.5e-7, 1e21, 123456.789,
+                               5e-324, 1.7976931348623157e308, 1.0 / 0.0 };
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); ++i)
+        assert(json_array_push(json, list, json_new_number(json, numbers[i])));
+    assert(json_array_push(json, list, json_new_boolean(json, true)));
+    assert(json_array_push(json, list, json_new_object(json)));
+    assert(json_object_set(json, root, "id", json_new_null(json)));
+    assert(!json_object_set(json, list, "id", json_new_null(json)));
+    assert(!json_array_set(json, list, 9, json_new_null(json)));
+    assert(!strcmp(dump_text(json, text, sizeof(text)),
+                   "{\"id\":null,\"name\":\"a\\\"b\\u0000c\",\"list\":[0.1,"
+                   "-1.5e-7,1e21,123456.789,5e-324,1.7976931348623157e308,"
+                   "null,true,{}]}"));
+    JSON *parsed = json_parse_string(strdup(text), true);
+    assert(json_equal(root, json_get_root(parsed)));
+    json_destroy(parsed);
+
+    // Big objects keep their order and their keys unique
+    JSON_DATA *big = json_new_object(json);
+    char key[16];
+    for (int round = 0; round < 2; ++round)
+        for (int i = 0; i < 1000; ++i)
+            {
+            snprintf(key, sizeof(key), "k%d", i);
+            assert(json_object_set(json, big, key,
+                                   json_new_number(json, i + round)));
+            }
+    assert(json_object_size(big) == 1000);
+    assert(json_number(json_get_data(big, "k999")) == 1000);
+    const char *first = NULL;
+    JSON_DATA *value = NULL;
+    assert(json_object_begin(big, &first, &value));
+    assert(!strcmp(first, "k0") && json_number(value) == 1);
+    json_destroy(json); // with unattached big
+
+    // Parsed documents change in place, forgetting what was cached
+    json = json_parse_string(strdup(
+        "{\"a\": 1, \"b\": [{\"k\": 1}, {\"k\": 2}], \"c\": 3, \"d\": 4,"
+        " \"e\": 5, \"f\": 6, \"g\": 7, \"h\": 8}"), true);
+    root = json_get_root(json);
+    JSON_DATA *b = json_get_data(root, "b");
+    uint64_t hash = json_hash(root);
+    JSON_DATA **found;
+    assert(json_index_lookup_number(json_index_build(b, "k"), 2, &found));
+    JSON_DATA *moved = json_array(b)[0];
+    assert(json_array_push(json, b, moved)); // before it's replaced
+    assert(json_array_set(json, b, 0, json_new_string(json, "x", 1)));
+    assert(json_index_lookup_number(json_index_build(b, "k"), 1,
+                                    &found) == 1 && found[0] == moved);
+    assert(json_object_set(json, root, "h", json_new_number(json, 9)));
+    assert(json_object_set(json, root, "i", moved));
+    assert(json_hash(root) != hash);
+    assert(!strcmp(dump_text(json, text, sizeof(text)),
+                   "{\"a\":1,\"b\":[\"x\",{\"k\":2},{\"k\":1}],\"c\":3,"
+                   "\"d\":4,\"e\":5,\"f\":6,\"g\":7,\"h\":9,\"i\":{\"k\":1}}"));
+
+    // Deeper changes are seen by hashes and indexes of what encloses them
+    JSON *nested = json_parse_string(strdup("{\"b\":{\"c\":1}}"), true);
+    JSON *expected = json_parse_string(strdup("{\"b\":{\"c\":2}}"), true);
+    JSON_DATA *nested_root = json_get_root(nested);
+    hash = json_hash(nested_root);
+    assert(!json_equal(nested_root, json_get_root(expected)));
+    assert(json_object_set(nested, json_get_data(nested_root, "b"), "c",
+                           json_new_number(nested, 2)));
+    assert(json_hash(nested_root) != hash);
+    assert(json_hash(nested_root) == json_hash(json_get_root(expected)));
+    assert(json_equal(nested_root, json_get_root(expected)));
+    assert(json_object_set(nested, json_get_data(nested_root, "b"), "c",
+                           json_new_number(nested, 3)));
+    JSON *cloned = json_clone(nested_root); // no outdated hashes copied
+    assert(!json_equal(json_get_root(cloned), json_get_root(expected)));
+    assert(json_hash(json_get_root(cloned)) == json_hash(nested_root));
+    json_destroy(cloned);
+    json_destroy(expected);
+    json_destroy(nested);
+    JSON_INDEX *by_k = json_index_build(b, "k");
+    assert(json_index_lookup_number(by_k, 3, &found) == 0);
+    assert(json_object_set(json, moved, "k", json_new_number(json, 3)));
+    assert(json_index_lookup_number(by_k, 3, &found) == 1 &&
+           found[0] == moved);
+    assert(json_index_lookup_number(by_k, 1, &found) == 0);
+
+    // Only changes to the array or what its index read outdate it, however
+    // deep, including in what replaced something it read
+    assert(json_object_set(json, root, "a", json_new_number(json, 2)));
+    assert(json_index_lookup_number(by_k, 3, &found) == 1);
+    JSON_DATA *deep = json_new_object(json);
+    assert(json_object_set(json, deep, "n", json_new_number(json, 1)));
+    assert(json_object_set(json, moved, "k", deep));
+    assert(json_index_lookup(by_k, deep, &found) == 1 && found[0] == moved);
+    assert(json_object_set(json, deep, "n", json_new_number(json, 2)));
+    assert(json_index_lookup(by_k, deep, &found) == 1 && found[0] == moved);
+    assert(json_index_lookup_number(by_k, 2, &found) == 1);
+    JSON_INDEX *by_n = json_index_build(b, "k,n");
+    assert(json_index_lookup_number(by_n, 2, &found) == 1);
+    assert(json_object_set(json, deep, "n", json_new_number(json, 5)));
+    assert(json_index_lookup_number(by_n, 5, &found) == 1 &&
+           found[0] == moved);
+    assert(json_object_set(json, moved, "k", json_new_object(json)));
+    assert(json_index_lookup_number(by_n, 5, &found) == 0);
+
+    // Replaced values are freed unless still somewhere else, so a long
+    // lived document stays its size
+    JSON *changing = json_new();
+    JSON_DATA *top = json_new_object(changing);
+    json_set_root(changing, top);
+    JSON_DATA *kept = json_new_string(changing, "kept", 4);
+    assert(json_object_set(changing, top, "kept", kept));
+    JSON_STATS stats;
+    for (int round = 0; round < 10000; ++round)
+        {
+        if (round == 1)
+            json_reset_stats();
+        JSON_DATA *list = json_new_array(changing);
+        JSON_DATA *wide = json_new_object(changing);
+        for (int i = 0; i < 10; ++i) // enough to be hashed
+            {
+            char key[8];
+            snprintf(key, sizeof(key), "k%d", i);
+            assert(json_object_set(changing, wide, key,
+                                   json_new_number(changing, round + i)));
+            }
+        assert(json_array_push(changing, list, wide));
+        assert(json_array_push(changing, list, json_new_string(changing,
+            "longer than what fits a short text's cell", 41)));
+        assert(json_array_push(changing, list, kept));
+        assert(json_object_set(changing, top, "list", list));
+        }
+    assert(json_object_set(changing, top, "kept", json_new_null(changing)));
+    assert(!strcmp(json_string(json_array(
+        json_get_data(top, "list"))[2]), "kept"));
+    assert(json_number(json_get_data(top, "list,0,k9")) == 9999 + 9);
+    if (json_get_stats(&stats))
+        assert(stats.pool_grows == 0);
+    JSON_DATA *other = json_new_array(changing);
+    json_set_root(changing, other);
+    assert(json_get_root(changing) == other);
+    json_set_root(changing, NULL);
+    assert(!json_get_root(changing));
+    json_destroy(changing);
+
+    // Clones can't change
+    JSON *clone = json_clone(root);
+    assert(!json_new_null(clone));
+    assert(!json_object_set(clone, json_get_root(clone), "a", root));
+    json_destroy(clone);
+    json_destroy(json);
+    }
+
+static void test_overlay(void)
+    {
+    char text[256];
+    JSON *base = json_parse_string(strdup(
+        "{\"a\": 1, \"b\": {\"c\": 2, \"d\": [1, {\"x\": null}]},"
+        " \"e\": {\"big\": [1, 2, 3]}, \"n\": null}"), true);
+    JSON *tenant = json_parse_string(strdup(
+        "{\"b\": {\"c\": 3, \"x\": null}, \"f\": true, \"e\": {}}"), true);
+    JSON *request = json_parse_string(strdup(
+        "{\"a\": null, \"b\": {\"d\": [9]}, \"g\": {\"h\": null, \"i\": 1}}"),
+        true);
+    JSON_DATA *layers[] = { json_get_root(base), json_get_root(tenant),
+                            json_get_root(request) };
+    JSON *view = json_overlay(layers, 3);
+    JSON_DATA *root = json_get_root(view);
+    assert(!json_get_data(root, "a") && !json_get_data(root, "b,x"));
+    assert(json_number(json_get_data(root, "b,c")) == 3);
+    assert(json_is_null(json_get_data(root, "n")));
+    // Members set above come first, then the base's others
+    assert(!strcmp(dump_text(view, text, sizeof(text)),
+                   "{\"b\":{\"c\":3,\"d\":[9]},\"f\":true,"
+                   "\"e\":{\"big\":[1,2,3]},\"g\":{\"i\":1},\"n\":null}"));
+    assert(json_object_size(root) == 5 && !json_get_data(root, "a"));
+    // Untouched subtrees are the layers' own
+    assert(json_get_data(root, "e,big") ==
+           json_get_data(json_get_root(base), "e,big"));
+    assert(json_get_data(root, "b,d") ==
+           json_get_data(json_get_root(request), "b,d"));
+    assert(!json_object_set(view, root, "a", root));
+    // As are objects only upper layers have, unless they hold nulls
+    assert(json_get_data(root, "g") != json_get_data(json_get_root(request),
+                                                     "g"));
+    JSON *added = json_parse_string(strdup("{\"z\": {\"y\": [null]}}"), true);
+    JSON_DATA *add_layers[] = { root, json_get_root(added) };
+    JSON *add_view = json_overlay(add_layers, 2);
+    assert(json_get_data(json_get_root(add_view), "z") ==
+           json_get_data(json_get_root(added), "z"));
+    json_destroy(add_view);
+    json_destroy(added);
+
+    // Flattened, it outlives the layers
+    JSON *flat = json_clone(root);
+    assert(json_equal(json_get_root(flat), root));
+    json_destroy(view);
+
+    // Non-objects replace, and one layer is itself
+    JSON_DATA *replaced[] = { json_get_root(base), json_get_data(
+                                  json_get_root(base), "b,d") };
+    view = json_overlay(replaced, 2);
+    assert(json_get_root(view) == replaced[1]);
+    json_destroy(view);
+    view = json_overlay(layers, 1);
+    assert(json_get_root(view) == layers[0]);
+    json_destroy(view);
+    assert(!json_overlay(layers, 0));
+    json_destroy(base);
+    json_destroy(tenant);
+    json_destroy(request);
+    assert(json_number(json_get_data(json_get_root(flat), "b,c")) == 3);
+    json_destroy(flat);
+
+    // Wide objects are merged by hashing
+    JSON *wide = json_new();
+    JSON *patch = json_new();
+    JSON_DATA *lower = json_new_object(wide);
+    JSON_DATA *upper = json_new_object(patch);
+    char key[16];
+    for (int i = 0; i < 100; ++i)
+        {
+        snprintf(key, sizeof(key), "k%d", i);
+        json_object_set(wide, lower, key, json_new_number(wide, i));
+        if (i % 3 == 0)
+            json_object_set(patch, upper, key, i % 2 ? json_new_null(patch) :
+                                               json_new_number(patch, -i));
+        }
+    json_object_set(patch, upper, "new", json_new_null(patch));
+    JSON_DATA *wide_layers[] = { lower, upper };
+    view = json_overlay(wide_layers, 2);
+    root = json_get_root(view);
+    assert(json_object_size(root) == 83);
+    assert(json_number(json_get_data(root, "k6")) == -6);
+    assert(!json_get_data(root, "k3") && !json_get_data(root, "new"));
+    assert(json_number(json_get_data(root, "k4")) == 4);
+
+    // Layered again, over the view: removed members come back, and
+    // views are layers like any other
+    JSON *again = json_parse_string(strdup(
+        "{\"k3\": \"back\", \"k6\": null, \"k7\": {\"x\": 1}}"), true);
+    JSON_DATA *again_layers[] = { root, json_get_root(again) };
+    JSON *over_view = json_overlay(again_layers, 2);
+    JSON_DATA *over_root = json_get_root(over_view);
+    assert(!strcmp(json_string(json_get_data(over_root, "k3")), "back"));
+    assert(!json_get_data(over_root, "k6") && !json_get_data(over_root, "k9"));
+    assert(json_number(json_get_data(over_root, "k7,x")) == 1);
+    assert(json_object_size(over_root) == 83);
+    assert(json_object_size(root) == 83); // not changed by the layer over it
+    json_destroy(over_view);
+    JSON_DATA *three[] = { lower, upper, json_get_root(again) };
+    over_view = json_overlay(three, 3);
+    over_root = json_get_root(over_view);
+    assert(!strcmp(json_string(json_get_data(over_root, "k3")), "back"));
+    assert(!json_get_data(over_root, "k6") && !json_get_data(over_root, "k9"));
+    assert(json_number(json_get_data(over_root, "k0")) == 0);
+    assert(json_object_size(over_root) == 83);
+    json_destroy(over_view);
+    json_destroy(again);
+    json_destroy(view);
+    json_destroy(patch);
+    json_destroy(wide);
+
+    // A wide base costs nothing per view until it's read whole, and
+    // then its untouched tail is shared rather than copied
+    wide = json_new();
+    lower = json_new_object(wide);
+    json_set_root(wide, lower);
+    for (int i = 0; i < 100000; ++i)
+        {
+        snprintf(key, sizeof(key), "k%d", i);
+        json_object_set(wide, lower, key, json_new_number(wide, i));
+        }
+    JSON *small = json_parse_string(strdup("{\"k5\": -5}"), true);
+    JSON_DATA *small_layers[] = { lower, json_get_root(small) };
+    view = json_overlay(small_layers, 2);
+    root = json_get_root(view);
+    assert(json_number(json_get_data(root, "k5")) == -5);
+    assert(json_number(json_get_data(root, "k99999")) == 99999);
+    assert(json_object_size(root) == 100000);
+    const char *first = NULL;
+    JSON_DATA *value = NULL;
+    JSON_MEMBER *member = json_object_begin(root, &first, &value);
+    assert(!strcmp(first, "k5") && json_number(value) == -5);
+    JSON_MEMBER *below = json_object_begin(lower, &first, &value);
+    for (int i = 0; i < 6; ++i)
+        {
+        member = json_object_next(member, &first, &value);
+        below = json_object_next(below, &first, &value);
+        }
+    assert(member == below && !strcmp(first, "k6")); // the base's own
+    json_destroy(view);
+    json_destroy(small);
+
+    // Objects set over it are merged with the base's members when those
+    // are looked up or laid out, through any number of layers
+    JSON_DATA *nested = json_new_object(wide);
+    json_object_set(wide, nested, "y", json_new_number(wide, 1));
+    json_object_set(wide, nested, "z", json_new_number(wide, 2));
+    json_object_set(wide, lower, "k99990", nested);
+    JSON *deep = json_parse_string(strdup(
+        "{\"k99990\": {\"x\": 2, \"z\": null},"
+        " \"k100000\": {\"w\": null, \"v\": 1}}"), true);
+    JSON *deeper = json_parse_string(strdup("{\"k3\": {\"x\": 3}}"), true);
+    JSON_DATA *deep_layers[] = { lower, json_get_root(deep),
+                                 json_get_root(deeper) };
+    for (int whole = 0; whole < 2; ++whole)
+        for (size_t n = 2; n <= 3; ++n)
+            {
+            view = json_overlay(deep_layers, n);
+            root = json_get_root(view);
+            if (whole)
+                assert(json_object_size(root) == 100001);
+            JSON_DATA *merged = json_get_data(root, "k99990");
+            assert(json_object_size(merged) == 2);
+            assert(json_number(json_get_data(merged, "y")) == 1);
+            assert(json_number(json_get_data(merged, "x")) == 2);
+            assert(json_object_size(json_get_data(root, "k100000")) == 1);
+            assert(json_number(json_get_data(root, "k100000,v")) == 1);
+            assert(n == 2 ? json_number(json_get_data(root, "k3")) == 3 :
+                            json_number(json_get_data(root, "k3,x")) == 3);
+            assert(json_object_size(root) == 100001);
+            assert(json_object_size(nested) == 2); // the base's untouched
+            json_destroy(view);
+            }
+    json_destroy(deeper);
+    json_destroy(deep);
+    json_destroy(wide);
+    }
 
 int main(int argc, char **argv)
     {
+    test_minify();
+    test_budgets();
+    test_hash();
+    test_live();
+    test_paths();
+    test_compressed();
+    test_stats();
+    test_deferred();
+    test_clone();
+    test_columns();
+    test_buffer();
+    test_shapes();
+    test_index();
+    test_stream();
+    test_validate();
+    test_parse_leaks();
+    test_build();
+    test_overlay();
+
     const char *good_strings[] = { 
         "  27.312  ",
+        "[-0, 0.5, 1e9, -2.5E-3, 1E+2]",
         "true",
         "false",
         "null",
@@ -25,11 +1378,15 @@ int main(int argc, char **argv)
         "[1,2,\"foo\"]",
         "{\"foo\": \"bar\", \"baz\": \"blah\"}",
         "{\"a\": {\"foo\": \"bar\", \"baz\": \"blah\"}, \"b\": {\"foo\": \"bar\", \"baz\": \"blah\"}}",
-        "  \" foobar \"  "
+        "  \" foobar \"  ",
+        "\"caf\\u00e9 \\ud83d\\ude00\"",
+        "{\"nul\\u0000key\": \"a\\u0000b\"}"
     };
 
     for (int i = 0; i < sizeof(good_strings)/sizeof(good_strings[0]); ++i)
         {
+        assert(json_validate(good_strings[i], strlen(good_strings[i]),
+                             NULL) == JSON_OK);
         JSON *json = json_parse_string(strdup(good_strings[i]), true);
         if (!json)
             {
@@ -38,7 +1395,11 @@ int main(int argc, char **argv)
             }
         JSON_DATA *data = json_get_root(json);
         if (json_is_string(data))
-            printf("\nstring[%s]\n", json_string(data));
+            {
+            const char *string = json_string(data);
+            assert(string);
+            printf("\nstring[%s]\n", string);
+            }
         else if (json_is_null(data))
             printf("\nIt's null\n");
         else if (json_is_number(data))
@@ -61,7 +1422,15 @@ int main(int argc, char **argv)
     
     const char *bad_strings[] = { 
         "  27,312  ",
+        "[01]",
+        "[1.]",
+        "[.5]",
+        "[1e]",
+        "[-]",
+        "[1e+]",
         "txue",
+        "frue",
+        "talse",
         "falsx",
         "nullx",
         "[1,]",
@@ -71,10 +1440,17 @@ int main(int argc, char **argv)
         "[1,2,foo\"]",
         "{\"foo\": \"bar\", \"baz\"; \"blah\"}",
         "{\"a\": [\"foo\": \"bar\", \"baz\": \"blah\"}, \"b\": {\"foo\": \"bar\", \"baz\": \"blah\"}}",
-        "  ' foobar \"  "
+        "  ' foobar \"  ",
+        "\"\\u12G4\"",
+        "\"\\ud83d\"",
+        "\"\\ude00\"",
+        "\"\\ud83d\\u0041\"",
+        "\"\\u00"
     };
     for (int i = 0; i < sizeof(bad_strings)/sizeof(bad_strings[0]); ++i)
         {
+        assert(json_validate(bad_strings[i], strlen(bad_strings[i]),
+                             NULL) != JSON_OK);
         JSON *json = json_parse_string(strdup(bad_strings[i]), true);
         if (json)
             {
@@ -104,7 +1480,9 @@ int main(int argc, char **argv)
     printf("The 4 P's:\n");
     while (*da)
         {
-        printf("  %s\n", json_string(*da));
+        const char *genre = json_string(*da);
+        assert(genre);
+        printf("  %s\n", genre);
         ++da;
         }
     d = json_get_data(root, "bands");
@@ -114,6 +1492,38 @@ int main(int argc, char **argv)
     d = json_get_data(root, "bands,devo,bass");
     assert(!d);
 
+    d = json_get_data(root, "bands,gbv");
+    assert(json_object_size(d) == 3);
+    assert(json_object_size(root) == 6);
+    assert(json_array_length(json_get_data(root, "genres")) == 4);
+    assert(json_array_length(root) == 0);
+    const char *key;
+    JSON_DATA *value;
+    size_t n = 0;
+    for (JSON_MEMBER *m = json_object_begin(d, &key, &value); m;
+         m = json_object_next(m, &key, &value))
+        {
+        assert(value == json_get_data(d, key));
+        ++n;
+        }
+    assert(n == json_object_size(d));
+    assert(!json_object_begin(json_get_data(root, "genres"), &key, &value));
+
+    d = json_get_data(root, "big_string");
+    assert(json_string_length(d) == strlen(json_string(d)));
+    assert(json_string_view(d).string == json_string(d));
+    assert(json_string_length(root) == 0 && !json_string_view(root).string);
+
+    JSON *escaped = json_parse_string(
+        strdup("[\"caf\\u00e9\", \"\\ud83d\\ude00\", \"a\\u0000b\"]"), true);
+    JSON_DATA **strings = json_array(json_get_root(escaped));
+    assert(json_string_length(strings[0]) == 5);
+    assert(!strcmp(json_string(strings[0]), "caf\xc3\xa9"));
+    assert(!strcmp(json_string(strings[1]), "\xf0\x9f\x98\x80"));
+    assert(json_string_length(strings[2]) == 3);
+    assert(!memcmp(json_string(strings[2]), "a\0b", 3));
+    json_destroy(escaped);
+
     json_destroy(json);
 
     json = json_parse_file(stdin);
@@ -0,0 +1,74 @@
+//  testhpp.cpp
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Exercises the header-only C++ interface in json.hpp
+
+#include "json.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+using namespace mmijson;
+
+static_assert(!std::is_copy_constructible<Document>::value);
+static_assert(std::is_nothrow_move_constructible<Document>::value);
+static_assert(std::is_trivially_copyable<Value>::value);
+
+int main()
+    {
+    FILE *f = fopen("test.json", "r");
+    Document doc = Document::parse(f);
+    fclose(f);
+    assert(doc);
+
+    Path lead("bands,beatles,lead");
+    assert(doc[lead].string() == "John");
+    assert(doc[Path("bands,devo,bass")].string().empty());
+    assert(!doc[Path("genres,9")]);
+    assert(doc[Path("big_string")].string().size() == 
+           strlen(json_string(doc[Path("big_string")].get())));
+
+    Value genres = doc[Path("genres")];
+    assert(genres.size() == 4);
+    assert(genres[2].string() == "prog");
+    assert(!genres[4]);
+    size_t n = 0;
+    for (Value g : genres.elements())
+        {
+        assert(g.is_string());
+        ++n;
+        }
+    assert(n == 4);
+
+    n = 0;
+    for (const Member &m : doc[Path("bands,gbv")].members())
+        {
+        assert(m.key == "vocal" || m.key == "lead" || m.key == "rhythm");
+        assert(m.value().is_string());
+        ++n;
+        }
+    assert(n == 3);
+    for (const Member &m : genres.members())
+        {
+        (void)m;
+        assert(false);
+        }
+
+    Document moved = std::move(doc);
+    assert(!doc && moved);
+    assert(moved[lead].string() == "John");
+
+    char text[] = "{\"n\": 2.5, \"t\": true, \"z\": null}";
+    Document small = Document::parse(text, false);
+    assert(small[Path("n")].number() == 2.5);
+    assert(small[Path("t")].boolean());
+    assert(small[Path("z")].is_null());
+    assert(small.root().size() == 3);
+    printf("testhpp passed\n");
+    return 0;
+    }
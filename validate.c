@@ -0,0 +1,367 @@
+//  validate.c
+//
+//  (c) 2019 Skip Sopscak
+//  This code is licensed under MIT license (see LICENSE for details)
+//
+//  Validation without building anything. The grammar is the parser's,
+//  checked by a loop over three states (expecting a value, a key, or
+//  what follows a value) with the open containers kept as a stack of
+//  bits, one per level. String interiors, where most bytes of most
+//  documents are, are skipped 16 bytes at a time on x86-64 until a
+//  quote, backslash, control or non-ASCII byte turns up.
+
+#include "json.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define VALIDATE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define VALIDATE_DEPTH 1024
+#define STACK_WORDS (VALIDATE_DEPTH / 64)
+
+typedef struct VALIDATOR VALIDATOR;
+
+struct VALIDATOR
+    {
+    const unsigned char *p;
+    const unsigned char *end;
+    size_t depth;
+    uint64_t objects[STACK_WORDS]; // bit set if that level is an object
+    };
+
+enum
+    {
+    value, // a value is next
+    key, // a key (or '}' if first) is next
+    after // a value was just completed
+    };
+
+static bool is_space(unsigned char c)
+    // What the parser's isspace() takes
+    {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+static int peek(VALIDATOR *v)
+    // Skips whitespace and returns the next character, left in place,
+    // or 0 at the end
+    {
+    while (v->p < v->end && is_space(*v->p))
+        ++v->p;
+    return v->p < v->end ? *v->p : 0;
+    }
+
+static int hex4(VALIDATOR *v)
+    {
+    int code = 0;
+    for (int i = 0; i < 4; ++i, ++v->p)
+        {
+        int c = v->p < v->end ? *v->p : 0;
+        code <<= 4;
+        if (c >= '0' && c <= '9')
+            code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            code |= c - 'A' + 10;
+        else
+            return -1;
+        }
+    return code;
+    }
+
+static bool escape(VALIDATOR *v)
+    // After the backslash
+    {
+    int c = v->p < v->end ? *v->p : 0;
+    if (c != 'u')
+        {
+        if (!strchr("\"\\/bfnrt", c) || !c)
+            return false;
+        ++v->p;
+        return true;
+        }
+    ++v->p;
+    int code = hex4(v);
+    if (code < 0)
+        return false;
+    if (code >= 0xDC00 && code <= 0xDFFF)
+        {
+        v->p -= 6; // the escape is at fault, not what follows
+        return false;
+        }
+    if (code >= 0xD800 && code <= 0xDBFF)
+        {
+        // A low surrogate must follow
+        const unsigned char *low = v->p;
+        if (v->end - v->p < 2 || v->p[0] != '\\' || v->p[1] != 'u')
+            return false;
+        v->p += 2;
+        code = hex4(v);
+        if (code < 0xDC00 || code > 0xDFFF)
+            {
+            if (code >= 0)
+                v->p = low;
+            return false;
+            }
+        }
+    return true;
+    }
+
+static size_t utf8_length(const unsigned char *p, const unsigned char *end)
+    // Bytes in the well formed sequence starting at p (with a lead byte),
+    // 0 if ill formed: overlong, a surrogate, past U+10FFFF, or cut short
+    {
+    size_t n;
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    if (*p < 0xC2)
+        return 0;
+    else if (*p < 0xE0)
+        n = 2;
+    else if (*p < 0xF0)
+        {
+        n = 3;
+        if (*p == 0xE0)
+            low = 0xA0;
+        else if (*p == 0xED)
+            high = 0x9F;
+        }
+    else if (*p < 0xF5)
+        {
+        n = 4;
+        if (*p == 0xF0)
+            low = 0x90;
+        else if (*p == 0xF4)
+            high = 0x8F;
+        }
+    else
+        return 0;
+    if ((size_t)(end - p) < n || p[1] < low || p[1] > high)
+        return 0;
+    for (size_t i = 2; i < n; ++i)
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+    return n;
+    }
+
+static bool string(VALIDATOR *v)
+    // After the opening quote, through the closing one
+    {
+    for (;;)
+        {
+#ifdef VALIDATE_SSE2
+        // Signed, bytes from 0x80 compare less than ' ' too
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i del = _mm_set1_epi8(0x7F);
+        while (v->end - v->p >= 16)
+            {
+            __m128i x = _mm_loadu_si128((const __m128i *)v->p);
+            __m128i stop = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(x, quote),
+                             _mm_cmpeq_epi8(x, backslash)),
+                _mm_or_si128(_mm_cmplt_epi8(x, space),
+                             _mm_cmpeq_epi8(x, del)));
+            unsigned mask = _mm_movemask_epi8(stop);
+            if (mask)
+                {
+                v->p += __builtin_ctz(mask);
+                break;
+                }
+            v->p += 16;
+            }
+#endif
+        if (v->p == v->end)
+            return false;
+        unsigned char c = *v->p;
+        if (c == '"')
+            {
+            ++v->p;
+            return true;
+            }
+        if (c == '\\')
+            {
+            ++v->p;
+            if (!escape(v))
+                return false;
+            }
+        else if (c >= 0x80)
+            {
+            size_t n = utf8_length(v->p, v->end);
+            if (!n)
+                return false;
+            v->p += n;
+            }
+        else if (c < ' ' || c == 0x7F)
+            return false;
+        else
+            ++v->p;
+        }
+    }
+
+static bool digits(VALIDATOR *v)
+    // At least one
+    {
+    const unsigned char *start = v->p;
+    while (v->p < v->end && *v->p >= '0' && *v->p <= '9')
+        ++v->p;
+    return v->p != start;
+    }
+
+static bool number(VALIDATOR *v)
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, from its first
+    // character
+    {
+    if (v->p < v->end && *v->p == '-')
+        ++v->p;
+    if (v->p < v->end && *v->p == '0')
+        ++v->p;
+    else if (!digits(v))
+        return false;
+    if (v->p < v->end && *v->p == '.')
+        {
+        ++v->p;
+        if (!digits(v))
+            return false;
+        }
+    if (v->p < v->end && (*v->p == 'e' || *v->p == 'E'))
+        {
+        ++v->p;
+        if (v->p < v->end && (*v->p == '+' || *v->p == '-'))
+            ++v->p;
+        if (!digits(v))
+            return false;
+        }
+    return true;
+    }
+
+static bool literal(VALIDATOR *v, const char *text)
+    // From its first character, leaving p at the first that differs
+    {
+    for (; *text; ++text, ++v->p)
+        if (v->p == v->end || *v->p != (unsigned char)*text)
+            return false;
+    return true;
+    }
+
+static bool push(VALIDATOR *v, bool object)
+    {
+    if (v->depth == VALIDATE_DEPTH)
+        return false;
+    uint64_t bit = 1ull << (v->depth % 64);
+    if (object)
+        v->objects[v->depth / 64] |= bit;
+    else
+        v->objects[v->depth / 64] &= ~bit;
+    ++v->depth;
+    return true;
+    }
+
+static bool in_object(const VALIDATOR *v)
+    {
+    size_t top = v->depth - 1;
+    return v->objects[top / 64] >> (top % 64) & 1;
+    }
+
+static JSON_ERROR validate(VALIDATOR *v)
+    // Leaves p at the character in error, if any
+    {
+    int state = value;
+    for (;;)
+        {
+        int c = peek(v);
+        switch (state)
+            {
+        case value:
+            state = after;
+            switch (c)
+                {
+            case '{':
+            case '[':
+                if (!push(v, c == '{'))
+                    return JSON_TOO_DEEP;
+                ++v->p;
+                if (peek(v) == c + 2) // the matching '}' or ']'
+                    {
+                    ++v->p;
+                    --v->depth;
+                    }
+                else
+                    state = c == '{' ? key : value;
+                break;
+            case '"':
+                ++v->p;
+                if (!string(v))
+                    return JSON_BAD_STRING;
+                break;
+            case 't':
+                if (!literal(v, "true"))
+                    return JSON_BAD_BOOLEAN;
+                break;
+            case 'f':
+                if (!literal(v, "false"))
+                    return JSON_BAD_BOOLEAN;
+                break;
+            case 'n':
+                if (!literal(v, "null"))
+                    return JSON_BAD_NULL;
+                break;
+            default:
+                if (!number(v))
+                    return JSON_BAD_NUMBER;
+                break;
+                }
+            break;
+        case key:
+            if (c != '"')
+                return JSON_BAD_MAP;
+            ++v->p;
+            if (!string(v))
+                return JSON_BAD_STRING;
+            if (peek(v) != ':')
+                return JSON_BAD_MAP;
+            ++v->p;
+            state = value;
+            break;
+        case after:
+            if (!v->depth)
+                return v->p == v->end ? JSON_OK : JSON_BAD_TRAILING;
+            if (c == ',')
+                {
+                ++v->p;
+                if (in_object(v))
+                    state = key;
+                else if (peek(v) == ']')
+                    return JSON_BAD_ARRAY;
+                else
+                    state = value;
+                }
+            else if (c == (in_object(v) ? '}' : ']'))
+                {
+                ++v->p;
+                --v->depth;
+                }
+            else
+                return in_object(v) ? JSON_BAD_MAP : JSON_BAD_ARRAY;
+            break;
+            }
+        }
+    }
+
+JSON_ERROR json_validate(const char *buffer, size_t length,
+                         size_t *error_offset)
+    {
+    VALIDATOR v;
+    v.p = (const unsigned char *)buffer;
+    v.end = v.p + length;
+    v.depth = 0;
+    JSON_ERROR error = validate(&v);
+    if (error && error_offset)
+        *error_offset = (const char *)v.p - buffer;
+    return error;
+    }